@@ -0,0 +1,161 @@
+/*
+ * arena.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/**
+ * fat_arena_alloc - allocate memory from arena.
+ * @arena: arena
+ * @size:  size to allocate
+ * @align: alignment (power of 2)
+ *
+ * Memory is released only all at once, by fat_arena_free().
+ *
+ * Return: allocated memory, or NULL if out of memory
+ */
+void *fat_arena_alloc(struct fat_arena *arena, size_t size, size_t align)
+{
+  size_t used, blksize;
+  struct fat_arena_block *blk = arena->head;
+
+  if (blk) {
+    used = (blk->used + align - 1) & ~(align - 1);
+    if (used + size <= blk->size) {
+      blk->used = used + size;
+      return blk->data + used;
+    }
+  }
+
+  /* large allocation gets its own block, behind the current one */
+  blksize = size + align > FAT_ARENA_BLOCK / 4 ? size + align : FAT_ARENA_BLOCK;
+  if (!(blk = malloc(sizeof(*blk) + blksize)))
+    return NULL;
+  blk->size = blksize;
+  used = (-(uintptr_t)blk->data) & (align - 1);
+  blk->used = used + size;
+  if (arena->head && blksize != FAT_ARENA_BLOCK) {
+    blk->next = arena->head->next;
+    arena->head->next = blk;
+  } else {
+    blk->next = arena->head;
+    arena->head = blk;
+  }
+  arena->total += blksize;
+  return blk->data + used;
+}
+
+/**
+ * fat_arena_calloc - allocate zeroed array from arena.
+ * @arena: arena
+ * @n:     count of elements
+ * @size:  size of element
+ *
+ * Return: allocated memory, or NULL if out of memory
+ */
+void *fat_arena_calloc(struct fat_arena *arena, size_t n, size_t size)
+{
+  void *p;
+
+  if (size && n > SIZE_MAX / size)
+    return NULL;
+  if ((p = fat_arena_alloc(arena, n * size, FAT_ARENA_ALIGN)))
+    memset(p, 0, n * size);
+  return p;
+}
+
+/**
+ * fat_arena_realloc - resize allocation of arena.
+ * @arena:   arena
+ * @ptr:     allocation to grow (NULL: new allocation)
+ * @oldsize: current size of @ptr
+ * @size:    new size
+ *
+ * The last allocation of the current block grows (or shrinks) in place,
+ * which is the case when one array is appended to at a time. Otherwise it
+ * is copied, and the old space is not reused until the arena is released.
+ *
+ * Return: grown memory, or NULL if out of memory (@ptr is kept)
+ */
+void *fat_arena_realloc(struct fat_arena *arena, void *ptr, size_t oldsize, size_t size)
+{
+  void *p;
+  struct fat_arena_block *blk = arena->head;
+
+  if (ptr && blk && (unsigned char *)ptr + oldsize == blk->data + blk->used
+      && (unsigned char *)ptr - blk->data + size <= blk->size) {
+    blk->used = (unsigned char *)ptr - blk->data + size;
+    return ptr;
+  }
+  if (ptr && size <= oldsize)
+    return ptr;
+  if ((p = fat_arena_alloc(arena, size, FAT_ARENA_ALIGN)) && ptr)
+    memcpy(p, ptr, oldsize < size ? oldsize : size);
+  return p;
+}
+
+/**
+ * fat_arena_strndup - copy string into arena.
+ * @arena: arena
+ * @s:     string
+ * @len:   length of @s
+ *
+ * Return: NUL-terminated copy, or NULL if out of memory
+ */
+char *fat_arena_strndup(struct fat_arena *arena, const char *s, size_t len)
+{
+  char *p;
+
+  if (!(p = fat_arena_alloc(arena, len + 1, 1)))
+    return NULL;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+/**
+ * fat_arena_free - release all memory of arena.
+ * @arena: arena
+ */
+void fat_arena_free(struct fat_arena *arena)
+{
+  struct fat_arena_block *blk, *next;
+
+  for (blk = arena->head; blk; blk = next) {
+    next = blk->next;
+    free(blk);
+  }
+  arena->head = NULL;
+  arena->total = 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * batch.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+static void fat_batch_task(struct fat_pool *, int, void *);
+
+/**
+ * fat_batch_fill - submit images up to window.
+ * @pool:   thread pool
+ * @worker: index of calling worker, or -1 from outside of pool
+ *
+ * Caller must hold batch->lock.
+ */
+static void fat_batch_fill(struct fat_pool *pool, int worker)
+{
+  int err;
+  struct fat_batch *batch = pool->data;
+
+  while (!batch->err && batch->submitted < batch->count
+      && batch->submitted < batch->flushed + batch->window) {
+    err = fat_pool_submit(pool, worker, fat_batch_task,
+        &(batch->item[batch->submitted]));
+    if (err < 0) {
+      batch->err = err;
+      break;
+    }
+    batch->submitted++;
+  }
+}
+
+/**
+ * fat_batch_flush - write out finished images in order.
+ * @batch: batch
+ *
+ * Caller must hold batch->lock.
+ */
+static void fat_batch_flush(struct fat_batch *batch)
+{
+  struct fat_batch_item *item;
+
+  while (batch->flushed < batch->count) {
+    item = &(batch->item[batch->flushed]);
+    if (!item->done)
+      break;
+    if (item->len)
+      fwrite(item->buf, 1, item->len, batch->out);
+    if (item->err)
+      batch->failed++;
+    free(item->buf);
+    item->buf = NULL;
+    batch->flushed++;
+  }
+}
+
+/**
+ * fat_batch_task - process one image into its own buffer.
+ * @pool:   thread pool
+ * @worker: index of this worker
+ * @arg:    batch item
+ */
+static void fat_batch_task(struct fat_pool *pool, int worker, void *arg)
+{
+  FILE *fp;
+  struct fat_batch_item *item = arg;
+  struct fat_batch *batch = pool->data;
+
+  if ((fp = open_memstream(&(item->buf), &(item->len))) == NULL) {
+    item->err = -errno;
+  } else {
+    item->err = batch->fn(item->path, item - batch->item, fp, batch->arg);
+    if (fclose(fp) && !item->err)
+      item->err = -EIO;
+  }
+
+  pthread_mutex_lock(&(batch->lock));
+  item->done = true;
+  fat_batch_flush(batch);
+  fat_batch_fill(pool, worker);
+  pthread_mutex_unlock(&(batch->lock));
+}
+
+/**
+ * fat_batch_run - process images on thread pool.
+ * @batch: batch (path, count, fn, arg and out must be set)
+ * @jobs:  count of threads
+ *
+ * Each image is written by @batch->fn (given its path and index) to a
+ * private memory stream, and streams are copied to @batch->out in order
+ * of @batch->path. At most FAT_BATCH_WINDOW images per thread are in
+ * flight, so a slow image does not make the others pile up in memory.
+ *
+ * Return: count of failed images
+ *         negative - error (errno)
+ */
+int fat_batch_run(struct fat_batch *batch, int jobs)
+{
+  int err;
+  size_t i;
+  struct fat_pool pool;
+
+  if (!(batch->item = calloc(batch->count, sizeof(*(batch->item)))))
+    return -ENOMEM;
+  for (i = 0; i < batch->count; i++)
+    batch->item[i].path = batch->path[i];
+  batch->submitted = 0;
+  batch->flushed = 0;
+  batch->failed = 0;
+  batch->window = (size_t)jobs * FAT_BATCH_WINDOW;
+  batch->err = 0;
+  pthread_mutex_init(&(batch->lock), NULL);
+
+  if ((err = fat_pool_init(&pool, jobs)) < 0)
+    goto out;
+  pool.data = batch;
+
+  pthread_mutex_lock(&(batch->lock));
+  fat_batch_fill(&pool, -1);
+  pthread_mutex_unlock(&(batch->lock));
+  fat_pool_wait(&pool);
+  fat_pool_destroy(&pool);
+
+  err = batch->err ? batch->err : (int)batch->failed;
+out:
+  for (i = 0; i < batch->count; i++)
+    free(batch->item[i].buf);
+  free(batch->item);
+  batch->item = NULL;
+  pthread_mutex_destroy(&(batch->lock));
+  return err;
+}
+
+/**
+ * fat_batch_read_list - read list of images, one path per line.
+ * @fp:    input stream
+ * @path:  (out) array of paths
+ * @count: (out) count of paths
+ *
+ * Empty lines are skipped. Caller must free each path and @path.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+int fat_batch_read_list(FILE *fp, char ***path, size_t *count)
+{
+  char *line = NULL;
+  char **tmp;
+  size_t n = 0, alloc = 0;
+  size_t linesize = 0;
+  ssize_t len;
+
+  *path = NULL;
+  while ((len = getline(&line, &linesize, fp)) >= 0) {
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (!len)
+      continue;
+    if (n == alloc) {
+      alloc = alloc ? alloc * 2 : 64;
+      if (!(tmp = realloc(*path, alloc * sizeof(*tmp))))
+        goto err;
+      *path = tmp;
+    }
+    if (!((*path)[n] = strdup(line)))
+      goto err;
+    n++;
+  }
+  free(line);
+  *count = n;
+  return 0;
+
+err:
+  while (n)
+    free((*path)[--n]);
+  free(*path);
+  free(line);
+  *path = NULL;
+  *count = 0;
+  return -ENOMEM;
+}
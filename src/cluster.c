@@ -0,0 +1,258 @@
+/*
+ * cluster.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/**
+ * fat_cluster_offset - get byte offset of cluster in image.
+ * @vol:  FAT volume
+ * @clus: cluster number (must be valid)
+ */
+u_int64_t fat_cluster_offset(struct fat_volume *vol, u_int32_t clus)
+{
+  return vol->geo.data_offset + ((u_int64_t)(clus - 2) << vol->geo.cluster_shift);
+}
+
+/**
+ * fat_chain_init - start walking cluster chain.
+ * @ch:    cluster chain iterator
+ * @vol:   FAT volume
+ * @start: first cluster (0 means empty chain)
+ */
+void fat_chain_init(struct fat_chain *ch, struct fat_volume *vol, u_int32_t start)
+{
+  ch->vol = vol;
+  ch->cluster = 0;
+  ch->next = start;
+  ch->count = 0;
+  ch->mark = 0;
+  ch->power = 1;
+  ch->done = !start;
+  ch->err = 0;
+}
+
+/**
+ * fat_chain_step - move to next cluster of chain.
+ * @ch:     cluster chain iterator
+ * @get:    entry accessor of FAT type
+ * @is_eoc: end of chain test of FAT type
+ *
+ * Loop in chain is detected by Brent's algorithm, before walking the same
+ * cluster more than about twice.
+ *
+ * Always inlined with constant @get and @is_eoc by FAT_ENTRY_OPS().
+ */
+static inline __attribute__((always_inline))
+bool fat_chain_step(struct fat_chain *ch,
+    u_int32_t (*get)(struct fat_volume *, u_int32_t), bool (*is_eoc)(u_int32_t))
+{
+  u_int32_t clus = ch->next;
+
+  if (ch->done)
+    return false;
+
+  if (!fat_valid_cluster(ch->vol, clus)) {
+    ch->err = -EINVAL;
+    ch->done = true;
+    return false;
+  }
+  if (clus == ch->mark) {
+    ch->err = -ELOOP;
+    ch->done = true;
+    return false;
+  }
+  if (++ch->count == ch->power) {
+    ch->mark = clus;
+    ch->power *= 2;
+  }
+
+  ch->cluster = clus;
+  ch->next = get(ch->vol, clus);
+  if (is_eoc(ch->next))
+    ch->done = true;
+  return true;
+}
+
+/**
+ * fat_count_step - count allocation statistics of range of FAT.
+ * @vol:   FAT volume
+ * @first: first cluster number
+ * @n:     count of entries
+ * @st:    (in/out) statistics
+ * @get, @is_eoc, @is_bad, @is_reserved: functions of FAT type
+ *
+ * Always inlined with constant functions by FAT_ENTRY_OPS().
+ */
+static inline __attribute__((always_inline))
+void fat_count_step(struct fat_volume *vol, u_int32_t first, u_int32_t n,
+    struct fat_stat *st, u_int32_t (*get)(struct fat_volume *, u_int32_t),
+    bool (*is_eoc)(u_int32_t), bool (*is_bad)(u_int32_t),
+    bool (*is_reserved)(u_int32_t))
+{
+  u_int32_t clus, entry;
+
+  for (clus = first; clus < first + n; clus++) {
+    entry = get(vol, clus);
+    if (!entry)
+      st->free++;
+    else if (is_bad(entry))
+      st->bad++;
+    else if (is_eoc(entry))
+      st->eoc++;
+    else if (is_reserved(entry))
+      st->reserved++;
+  }
+}
+
+/*
+ * FAT_ENTRY_OPS - generate entry operations of one FAT type.
+ * @bits:  12, 16 or 32
+ * @mask:  mask of valid bits of entry
+ *
+ * Special values of entry are taken from FAT<bits>_* definitions, and
+ * fat<bits>_get_entry() is inlined into every loop.
+ */
+#define FAT_ENTRY_OPS(bits, mask)                                           \
+static bool fat##bits##_is_eoc(u_int32_t entry)                             \
+{                                                                           \
+  return entry >= (FAT##bits##_DATAEND & (mask));                           \
+}                                                                           \
+                                                                            \
+static bool fat##bits##_is_bad(u_int32_t entry)                             \
+{                                                                           \
+  return entry == (FAT##bits##_BADCLUSTER & (mask));                        \
+}                                                                           \
+                                                                            \
+static bool fat##bits##_is_reserved(u_int32_t entry)                        \
+{                                                                           \
+  return entry == FAT12_RESERVED                                            \
+    || (entry >= (FAT##bits##_RSVDSTART & (mask))                           \
+        && entry < (FAT##bits##_BADCLUSTER & (mask)));                      \
+}                                                                           \
+                                                                            \
+static void fat##bits##_get_entries(struct fat_volume *vol, u_int32_t first, \
+    u_int32_t n, u_int32_t *out)                                            \
+{                                                                           \
+  u_int32_t i;                                                              \
+                                                                            \
+  for (i = 0; i < n; i++)                                                   \
+    out[i] = fat##bits##_get_entry(vol, first + i);                         \
+}                                                                           \
+                                                                            \
+static bool fat##bits##_chain_next(struct fat_chain *ch)                    \
+{                                                                           \
+  return fat_chain_step(ch, fat##bits##_get_entry, fat##bits##_is_eoc);     \
+}                                                                           \
+                                                                            \
+static void fat##bits##_count(struct fat_volume *vol, u_int32_t first,      \
+    u_int32_t n, struct fat_stat *st)                                       \
+{                                                                           \
+  fat_count_step(vol, first, n, st, fat##bits##_get_entry,                  \
+      fat##bits##_is_eoc, fat##bits##_is_bad, fat##bits##_is_reserved);     \
+}                                                                           \
+                                                                            \
+const struct fat_entry_ops fat##bits##_entry_ops = {                        \
+  .get_entry = fat##bits##_get_entry,                                       \
+  .get_entries = fat##bits##_get_entries,                                   \
+  .eoc = FAT##bits##_DATAEND & (mask),                                      \
+  .bad = FAT##bits##_BADCLUSTER & (mask),                                   \
+  .chain_next = fat##bits##_chain_next,                                     \
+  .count = fat##bits##_count,                                               \
+}
+
+FAT_ENTRY_OPS(12, 0x0fff);
+FAT_ENTRY_OPS(16, 0xffff);
+FAT_ENTRY_OPS(32, FAT32_ENTRYMASK);
+
+/**
+ * fat_count_fattable - count allocation statistics of first FAT.
+ * @vol: FAT volume
+ * @st:  statistics
+ *
+ * FAT16/32 tables are counted by SIMD kernel when possible, and
+ * the rest entries are counted one by one.
+ */
+void fat_count_fattable(struct fat_volume *vol, struct fat_stat *st)
+{
+  size_t i = 0;
+  size_t n = vol->CountofClusters;
+
+  memset(st, 0, sizeof(*st));
+  if (vol->fstype == FAT16_FILESYSTEM)
+    i = fat16_count_fattable(vol, 2, n, st);
+  else if (vol->fstype == FAT32_FILESYSTEM)
+    i = fat32_count_fattable(vol, 2, n, st);
+
+  vol->ops->count(vol, i + 2, n - i, st);
+  st->used = n - st->free - st->bad - st->reserved;
+}
+
+/**
+ * fat_dump_fatstat - print out allocation statistics.
+ * @st:  statistics
+ * @out: output stream
+ */
+void fat_dump_fatstat(struct fat_stat *st, FILE *out)
+{
+  fprintf(out, "%-28s\t: %u\n", _("Free clusters"), st->free);
+  fprintf(out, "%-28s\t: %u\n", _("Used clusters"), st->used);
+  fprintf(out, "%-28s\t: %u\n", _("End of chain clusters"), st->eoc);
+  fprintf(out, "%-28s\t: %u\n", _("Bad clusters"), st->bad);
+  fprintf(out, "%-28s\t: %u\n", _("Reserved clusters"), st->reserved);
+}
+
+/**
+ * fat_dump_fattable - print out allocation statistics of volume.
+ * @vol: FAT volume
+ * @out: output stream
+ */
+void fat_dump_fattable(struct fat_volume *vol, FILE *out)
+{
+  struct fat_stat st;
+
+  fat_count_fattable(vol, &st);
+  switch (vol->fstype) {
+    case FAT16_FILESYSTEM:
+      fat16_dump_fattable(vol, &st, out);
+      break;
+    case FAT32_FILESYSTEM:
+      fat32_dump_fattable(vol, &st, out);
+      break;
+    default:
+      fat_dump_fatstat(&st, out);
+  }
+}
@@ -0,0 +1,369 @@
+/*
+ * diff.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/* FAT tables are compared by this many bytes at first */
+#define FAT_DIFF_BLOCK (64 * 1024)
+
+/**
+ * Pair of directories waiting to be compared
+ */
+struct fat_diff_item {
+  struct fat_node *a;  /* NULL: directory was created */
+  struct fat_node *b;  /* NULL: directory was deleted */
+  char *path;
+};
+
+/**
+ * State of diff
+ */
+struct fat_diff {
+  struct fat_volume *vol[2];
+  struct fat_output *out;
+  bool layout;
+  unsigned char *dirty;
+  unsigned char *visited[2];
+  struct fat_tree *tree[2];
+  struct fat_diff_item *queue;
+  size_t head;
+  size_t count;
+  size_t alloc;
+};
+
+/**
+ * fat_diff_layout - whether both volumes place clusters in the same way.
+ * @a: FAT volume
+ * @b: FAT volume
+ */
+static bool fat_diff_layout(struct fat_volume *a, struct fat_volume *b)
+{
+  return a->fstype == b->fstype && a->geo.sector == b->geo.sector
+    && a->geo.cluster_size == b->geo.cluster_size && a->secsPerFat == b->secsPerFat
+    && a->RootDirStartSector == b->RootDirStartSector
+    && a->RootDirSectors == b->RootDirSectors
+    && a->DataStartSector == b->DataStartSector
+    && a->CountofClusters == b->CountofClusters;
+}
+
+/**
+ * fat_diff_fat - find sectors of FAT which differ.
+ * @d: state of diff
+ *
+ * Most of FAT is usually the same, so whole blocks are compared first,
+ * and only differing blocks are compared by sector.
+ */
+static int fat_diff_fat(struct fat_diff *d)
+{
+  size_t off, n, s;
+  struct fat_volume *a = d->vol[0], *b = d->vol[1];
+  size_t len = b->geo.fat_size;
+
+  if (!(d->dirty = calloc(b->secsPerFat / CHAR_BIT + 1, sizeof(*d->dirty))))
+    return -ENOMEM;
+  if (!d->layout)
+    return 0;
+  for (off = 0; off < len; off += n) {
+    n = len - off < FAT_DIFF_BLOCK ? len - off : FAT_DIFF_BLOCK;
+    if (!memcmp(a->fat + off, b->fat + off, n))
+      continue;
+    for (s = off; s < off + n; s += b->geo.sector) {
+      if (memcmp(a->fat + s, b->fat + s, b->geo.sector))
+        set_bit(d->dirty, s / b->geo.sector);
+    }
+  }
+  return 0;
+}
+
+/**
+ * fat_diff_region - whether region has the same data in both images.
+ * @d:      state of diff
+ * @offset: byte offset of region
+ * @len:    length of region
+ */
+static bool fat_diff_region(struct fat_diff *d, u_int64_t offset, size_t len)
+{
+  bool same = false;
+  unsigned char *a, *b;
+
+  if (!(a = fat_image_get(d->vol[0]->img, offset, len)))
+    return false;
+  if ((b = fat_image_get(d->vol[1]->img, offset, len))) {
+    same = !memcmp(a, b, len);
+    fat_image_put(d->vol[1]->img, b);
+  }
+  fat_image_put(d->vol[0]->img, a);
+  return same;
+}
+
+/**
+ * fat_diff_clean - whether pair of directories has the same data.
+ * @d:    state of diff
+ * @item: pair of directories
+ *
+ * Directories are the same if they start at the same cluster, FAT entries
+ * of the chain are in the same sectors of FAT, and every cluster has the
+ * same data in both images.
+ */
+static bool fat_diff_clean(struct fat_diff *d, struct fat_diff_item *item)
+{
+  struct fat_chain ch;
+  struct fat_volume *vol = d->vol[1];
+  u_int32_t clus = fat_dentry_cluster(vol, &(item->b->dentry));
+
+  if (!d->layout || clus != fat_dentry_cluster(d->vol[0], &(item->a->dentry)))
+    return false;
+  if (!clus)
+    return fat_diff_region(d, vol->geo.root_offset, vol->geo.root_size);
+
+  fat_chain_init(&ch, vol, clus);
+  while (fat_chain_next(&ch)) {
+    if (fat_delta_entry_dirty(vol, d->dirty, ch.cluster)
+        || !fat_diff_region(d, fat_cluster_offset(vol, ch.cluster), vol->geo.cluster_size))
+      return false;
+  }
+  return !ch.err;
+}
+
+/**
+ * fat_diff_subdir - whether node is child directory to compare.
+ * @vol:  FAT volume
+ * @node: node (may be NULL)
+ */
+static bool fat_diff_subdir(struct fat_volume *vol, struct fat_node *node)
+{
+  return node && fat_is_subdir(&(node->dentry))
+    && fat_valid_cluster(vol, fat_dentry_cluster(vol, &(node->dentry)));
+}
+
+/**
+ * fat_diff_push - queue pair of directories to compare.
+ * @d:    state of diff
+ * @a:    directory of first image (NULL: created)
+ * @b:    directory of second image (NULL: deleted)
+ * @path: path of parent directory
+ */
+static int fat_diff_push(struct fat_diff *d, struct fat_node *a,
+    struct fat_node *b, const char *path)
+{
+  size_t len;
+  const char *name;
+  char buf[NameSIZE + 2];
+  struct fat_diff_item *tmp, *item;
+
+  if (d->count == d->alloc) {
+    d->alloc = d->alloc ? d->alloc * 2 : 64;
+    if (!(tmp = realloc(d->queue, d->alloc * sizeof(*tmp))))
+      return -ENOMEM;
+    d->queue = tmp;
+  }
+  item = &(d->queue[d->count]);
+  name = fat_node_name(b ? b : a, buf);
+  len = strlen(path) + strlen(name) + 2;
+  if (!(item->path = malloc(len)))
+    return -ENOMEM;
+  snprintf(item->path, len, "%s/%s", strcmp(path, "/") ? path : "", name);
+  item->a = a;
+  item->b = b;
+  d->count++;
+  return 0;
+}
+
+/**
+ * fat_diff_scan - read directory of one image, and name its children.
+ * @d:    state of diff
+ * @i:    0: first image, 1: second image
+ * @node: directory node
+ */
+static int fat_diff_scan(struct fat_diff *d, int i, struct fat_node *node)
+{
+  int err;
+
+  if (!node)
+    return 0;
+  if ((err = fat_scan_dir(d->vol[i], node, d->visited[i], d->tree[i]->arena)) < 0) {
+    if (err == -ENOMEM)
+      return err;
+    fat_dir_error(d->vol[i], node, err);
+  }
+  return fat_lfn_assemble(node, d->tree[i]->arena);
+}
+
+/**
+ * fat_diff_dir - compare pair of directories.
+ * @d:    state of diff
+ * @item: pair of directories
+ *
+ * Entries of directories with the same data are not compared, only their
+ * child directories are queued.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+static int fat_diff_dir(struct fat_diff *d, struct fat_diff_item *item)
+{
+  int err = 0, cmp;
+  size_t i = 0, j = 0, na = 0, nb = 0;
+  struct fat_node *a = item->a, *b = item->b, *ca, *cb;
+  struct fat_delta_name *la = NULL, *lb = NULL;
+  struct fat_output *out = d->out;
+  bool clean = a && b && fat_diff_clean(d, item);
+
+  if ((err = fat_diff_scan(d, 0, a)) < 0 || (err = fat_diff_scan(d, 1, b)) < 0)
+    return err;
+
+  if (clean && a->nchild == b->nchild) {
+    for (i = 0; i < b->nchild; i++) {
+      if (!fat_diff_subdir(d->vol[1], &(b->child[i])))
+        continue;
+      if ((err = fat_diff_push(d, &(a->child[i]), &(b->child[i]), item->path)) < 0)
+        return err;
+    }
+    return 0;
+  }
+
+  if ((err = fat_delta_names(&la, &na, a ? a->child : NULL, a ? a->nchild : 0)) < 0)
+    goto out;
+  if ((err = fat_delta_names(&lb, &nb, b ? b->child : NULL, b ? b->nchild : 0)) < 0)
+    goto out;
+
+  /* both lists are sorted by name, so merge them */
+  while (i < na || j < nb) {
+    if (i == na)
+      cmp = 1;
+    else if (j == nb)
+      cmp = -1;
+    else
+      cmp = strcmp(la[i].name, lb[j].name);
+
+    ca = cmp <= 0 ? &(a->child[la[i].index]) : NULL;
+    cb = cmp >= 0 ? &(b->child[lb[j].index]) : NULL;
+    if (!ca)
+      out->ops->delta(out, CHANGE_CREATED, item->path, b, cb);
+    else if (!cb)
+      out->ops->delta(out, CHANGE_DELETED, item->path, a, ca);
+    else if (memcmp(&(ca->dentry), &(cb->dentry), sizeof(ca->dentry)))
+      out->ops->delta(out, CHANGE_MODIFIED, item->path, b, cb);
+
+    if (!fat_diff_subdir(d->vol[0], ca))
+      ca = NULL;
+    if (!fat_diff_subdir(d->vol[1], cb))
+      cb = NULL;
+    if ((ca || cb) && (err = fat_diff_push(d, ca, cb, item->path)) < 0)
+      goto out;
+
+    if (cmp <= 0)
+      i++;
+    if (cmp >= 0)
+      j++;
+  }
+out:
+  free(la);
+  free(lb);
+  return err;
+}
+
+/**
+ * fat_diff - report changed entries from one volume to another.
+ * @a:   FAT volume before
+ * @b:   FAT volume after
+ * @out: output sink of changes
+ *
+ * Directories are compared from root in pairs, and entries are matched by
+ * long name if any, otherwise by short name, and reported as created,
+ * deleted or modified.
+ * If both volumes have the same layout, a pair of directories with the
+ * same clusters and data is not compared entry by entry.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+int fat_diff(struct fat_volume *a, struct fat_volume *b, struct fat_output *out)
+{
+  int i, err = 0;
+  struct fat_diff_item item;
+  struct fat_tree tree[2];
+  struct fat_diff d = {
+    .vol = {a, b},
+    .out = out,
+    .layout = fat_diff_layout(a, b),
+  };
+
+  memset(tree, 0, sizeof(tree));
+  for (i = 0; i < 2; i++) {
+    if ((err = fat_init_tree(&(tree[i]), 1)) < 0)
+      goto out;
+    d.tree[i] = &(tree[i]);
+    tree[i].root.dentry.DIR_Attr = ATTR_DIRECTORY;
+    tree[i].root.dentry.DIR_FstClusHI = d.vol[i]->RootClus >> 16;
+    tree[i].root.dentry.DIR_FstClusLO = d.vol[i]->RootClus & 0xffff;
+    d.visited[i] = calloc(d.vol[i]->CountofClusters / CHAR_BIT + 1,
+        sizeof(*d.visited[i]));
+    if (!d.visited[i])
+      err = -ENOMEM;
+  }
+  if (err < 0 || (err = fat_diff_fat(&d)) < 0)
+    goto out;
+
+  if (!(d.queue = malloc(sizeof(*d.queue))) || !(d.queue[0].path = strdup("/"))) {
+    err = -ENOMEM;
+    goto out;
+  }
+  d.queue[0].a = &(tree[0].root);
+  d.queue[0].b = &(tree[1].root);
+  d.count = d.alloc = 1;
+
+  /* queue may be reallocated while directories are compared */
+  while (d.head < d.count) {
+    item = d.queue[d.head++];
+    err = fat_diff_dir(&d, &item);
+    free(item.path);
+    if (err < 0)
+      break;
+  }
+out:
+  if (d.queue) {
+    for (; d.head < d.count; d.head++)
+      free(d.queue[d.head].path);
+  }
+  free(d.queue);
+  free(d.dirty);
+  for (i = 0; i < 2; i++) {
+    free(d.visited[i]);
+    fat_free_tree(&(tree[i]));
+  }
+  return err;
+}
@@ -0,0 +1,330 @@
+/*
+ * digest.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "fat.h"
+
+/**
+ * File to hash
+ */
+struct fat_digest_file {
+  struct fat_node *node;
+  const char *dir;
+  u_int64_t digest;
+  int err;
+};
+
+/**
+ * Files hashed by one task
+ */
+struct fat_digest_range {
+  size_t start;
+  size_t count;
+};
+
+/**
+ * State of hashing
+ */
+struct fat_digest {
+  struct fat_volume *vol;
+  struct fat_digest_file *file;
+  size_t nfile;
+  size_t afile;
+  char **dir;
+  struct fat_node **dirnode;
+  size_t ndir;
+  size_t adir;
+};
+
+/**
+ * fat_digest_node - hash contents of file.
+ * @vol:    FAT volume
+ * @node:   dentry node of file
+ * @digest: (out) digest of contents
+ *
+ * Clusters are hashed in place, up to DIR_FileSize. Next chunk is
+ * prefetched while current chunk is hashed.
+ *
+ * Return: 0 - success
+ *         -EIO - cluster chain is shorter than file, or image is truncated
+ *         negative - error (errno)
+ */
+static int fat_digest_node(struct fat_volume *vol, struct fat_node *node,
+    u_int64_t *digest)
+{
+  int err = 0;
+  u_int32_t i;
+  size_t len;
+  u_int64_t offset, end;
+  u_int64_t size = node->dentry.DIR_FileSize;
+  unsigned char *buf;
+  struct fat_hash h;
+
+  fat_hash_init(&h, 0);
+  if (size && (err = fat_node_extents(vol, node)) < 0 && !node->nextent)
+    return err;
+  err = 0;
+
+  for (i = 0; i < node->nextent && size; i++) {
+    offset = fat_cluster_offset(vol, node->extent[i].cluster);
+    end = (u_int64_t)node->extent[i].count * vol->geo.cluster_size;
+    end = offset + (end < size ? end : size);
+    size -= end - offset;
+    for (; offset < end; offset += len) {
+      len = end - offset < FAT_DIGEST_CHUNK ? end - offset : FAT_DIGEST_CHUNK;
+      if (end - offset > len)
+        fat_image_advise(vol->img, offset + len, FAT_DIGEST_CHUNK, MADV_WILLNEED);
+      if (!(buf = fat_image_get(vol->img, offset, len))) {
+        err = -EIO;
+        goto out;
+      }
+      fat_hash_update(&h, buf, len);
+      fat_image_put(vol->img, buf);
+    }
+  }
+  if (size)
+    err = -EIO;
+  *digest = fat_hash_final(&h);
+out:
+  /* extents are not used again */
+  free(node->extent);
+  node->extent = NULL;
+  node->nextent = 0;
+  return err;
+}
+
+static void fat_digest_task(struct fat_pool *pool, int worker, void *arg)
+{
+  size_t i;
+  struct fat_digest *d = pool->data;
+  struct fat_digest_range *r = arg;
+  struct fat_digest_file *f;
+
+  for (i = r->start; i < r->start + r->count; i++) {
+    f = &(d->file[i]);
+    f->err = fat_digest_node(d->vol, f->node, &(f->digest));
+  }
+}
+
+/**
+ * fat_digest_hashed - whether dentry is file to hash.
+ * @dentry: directory entry
+ */
+static bool fat_digest_hashed(struct fat_dentry *dentry)
+{
+  if ((dentry->DIR_Attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME)
+    return false;
+  return !(dentry->DIR_Attr & (ATTR_DIRECTORY | ATTR_VOLUME_ID));
+}
+
+/**
+ * fat_digest_add_dir - append directory to list.
+ * @d:    state of hashing
+ * @node: directory node
+ * @path: allocated path of directory (freed on error)
+ */
+static int fat_digest_add_dir(struct fat_digest *d, struct fat_node *node, char *path)
+{
+  char **dir;
+  struct fat_node **dirnode;
+
+  if (d->ndir == d->adir) {
+    d->adir = d->adir ? d->adir * 2 : 64;
+    dir = realloc(d->dir, d->adir * sizeof(*dir));
+    if (dir)
+      d->dir = dir;
+    dirnode = realloc(d->dirnode, d->adir * sizeof(*dirnode));
+    if (dirnode)
+      d->dirnode = dirnode;
+    if (!dir || !dirnode) {
+      free(path);
+      return -ENOMEM;
+    }
+  }
+  d->dir[d->ndir] = path;
+  d->dirnode[d->ndir++] = node;
+  return 0;
+}
+
+/**
+ * fat_digest_collect - list files of tree, directory by directory.
+ * @d:    state of hashing
+ * @tree: directory tree
+ */
+static int fat_digest_collect(struct fat_digest *d, struct fat_tree *tree)
+{
+  int err;
+  size_t i, j, len;
+  char buf[NameSIZE + 2];
+  const char *name;
+  char *path;
+  struct fat_node *dir, *node;
+  struct fat_digest_file *file;
+
+  if (!(path = strdup("")) || (err = fat_digest_add_dir(d, &(tree->root), path)) < 0)
+    return -ENOMEM;
+  for (i = 0; i < d->ndir; i++) {
+    dir = d->dirnode[i];
+    for (j = 0; j < dir->nchild; j++) {
+      node = &(dir->child[j]);
+      if (node->child && fat_is_subdir(&(node->dentry))) {
+        name = fat_node_name(node, buf);
+        len = strlen(d->dir[i]) + strlen(name) + 2;
+        if (!(path = malloc(len)))
+          return -ENOMEM;
+        snprintf(path, len, "%s/%s", d->dir[i], name);
+        if ((err = fat_digest_add_dir(d, node, path)) < 0)
+          return err;
+        continue;
+      }
+      if (!fat_digest_hashed(&(node->dentry)))
+        continue;
+      if (d->nfile == d->afile) {
+        d->afile = d->afile ? d->afile * 2 : 256;
+        if (!(file = realloc(d->file, d->afile * sizeof(*file))))
+          return -ENOMEM;
+        d->file = file;
+      }
+      file = &(d->file[d->nfile++]);
+      file->node = node;
+      file->dir = d->dir[i];
+      file->digest = 0;
+      file->err = 0;
+    }
+  }
+  return 0;
+}
+
+/**
+ * fat_digest_tree - hash contents of every file.
+ * @vol:  FAT volume
+ * @tree: directory tree
+ * @out:  output sink
+ * @jobs: count of threads
+ *
+ * Files are hashed on thread pool, small files being grouped up to
+ * FAT_DIGEST_BATCH bytes per task, and are printed out in order of the
+ * directory walk.
+ *
+ * Return: 0 - success
+ *         -EIO - some files are not hashed
+ *         negative - error (errno)
+ */
+int fat_digest_tree(struct fat_volume *vol, struct fat_tree *tree,
+    struct fat_output *out, int jobs)
+{
+  int err;
+  size_t i, n = 0, bytes = 0;
+  char buf[NameSIZE + 2];
+  const char *name;
+  char *path = NULL;
+  size_t pathlen = 0, len;
+  struct fat_pool pool;
+  struct fat_digest_range *range = NULL;
+  struct fat_digest_file *f;
+  struct fat_digest d = {
+    .vol = vol,
+  };
+
+  if (vol->img->seg)
+    return -EOPNOTSUPP;
+  if ((err = fat_digest_collect(&d, tree)) < 0)
+    goto out;
+  if (d.nfile && !(range = calloc(d.nfile, sizeof(*range)))) {
+    err = -ENOMEM;
+    goto out;
+  }
+
+  /* group files into tasks */
+  for (i = 0; i < d.nfile; i++) {
+    if (!range[n].count)
+      range[n].start = i;
+    range[n].count++;
+    bytes += d.file[i].node->dentry.DIR_FileSize;
+    if (bytes >= FAT_DIGEST_BATCH) {
+      n++;
+      bytes = 0;
+    }
+  }
+  if (d.nfile && range[n].count)
+    n++;
+
+  if (jobs > 1 && n > 1 && !fat_pool_init(&pool, jobs)) {
+    pool.data = &d;
+    for (i = 0; i < n; i++) {
+      if ((err = fat_pool_submit(&pool, -1, fat_digest_task, &(range[i]))) < 0)
+        break;
+    }
+    fat_pool_wait(&pool);
+    fat_pool_destroy(&pool);
+    if (err < 0)
+      goto out;
+  } else {
+    pool.data = &d;
+    for (i = 0; i < n; i++)
+      fat_digest_task(&pool, 0, &(range[i]));
+  }
+
+  for (i = 0; i < d.nfile; i++) {
+    f = &(d.file[i]);
+    name = fat_node_name(f->node, buf);
+    len = strlen(f->dir) + strlen(name) + 2;
+    if (len > pathlen) {
+      free(path);
+      pathlen = len * 2;
+      if (!(path = malloc(pathlen))) {
+        err = -ENOMEM;
+        goto out;
+      }
+    }
+    snprintf(path, pathlen, "%s/%s", f->dir, name);
+    if (f->err) {
+      fprintf(stderr, "%s: %s\n", path, strerror(-f->err));
+      err = -EIO;
+      continue;
+    }
+    out->ops->digest(out, path, f->node, f->digest);
+  }
+out:
+  for (i = 0; i < d.ndir; i++)
+    free(d.dir[i]);
+  free(d.dir);
+  free(d.dirnode);
+  free(d.file);
+  free(range);
+  free(path);
+  return err;
+}
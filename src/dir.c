@@ -0,0 +1,657 @@
+/*
+ * dir.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/**
+ * Growable array of nodes, used as stack
+ */
+struct fat_stack {
+  struct fat_node **node;
+  size_t *len;
+  size_t count;
+  size_t alloc;
+};
+
+static int fat_stack_push(struct fat_stack *st, struct fat_node *node, size_t len)
+{
+  struct fat_node **n;
+  size_t *l;
+
+  if (st->count == st->alloc) {
+    st->alloc = st->alloc ? st->alloc * 2 : 64;
+    n = realloc(st->node, st->alloc * sizeof(*n));
+    if (!n)
+      return -ENOMEM;
+    st->node = n;
+    l = realloc(st->len, st->alloc * sizeof(*l));
+    if (!l)
+      return -ENOMEM;
+    st->len = l;
+  }
+  st->node[st->count] = node;
+  st->len[st->count] = len;
+  st->count++;
+  return 0;
+}
+
+static void fat_stack_free(struct fat_stack *st)
+{
+  free(st->node);
+  free(st->len);
+}
+
+/**
+ * fat_dentry_cluster - get first cluster of dentry.
+ * @vol:    FAT volume
+ * @dentry: directory entry
+ *
+ * DIR_FstClusHI is only meaningful in FAT32.
+ */
+u_int32_t fat_dentry_cluster(struct fat_volume *vol, struct fat_dentry *dentry)
+{
+  if (vol->fstype == FAT32_FILESYSTEM)
+    return ((u_int32_t)dentry->DIR_FstClusHI << 16) | dentry->DIR_FstClusLO;
+  return dentry->DIR_FstClusLO;
+}
+
+/**
+ * fat_is_subdir - whether dentry is child directory to walk.
+ * @dentry: directory entry
+ *
+ * "." and ".." are not children.
+ */
+bool fat_is_subdir(struct fat_dentry *dentry)
+{
+  if ((dentry->DIR_Attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME)
+    return false;
+  if (!(dentry->DIR_Attr & ATTR_DIRECTORY))
+    return false;
+  return dentry->IR_Name[0] != DENTRY_DOT;
+}
+
+/**
+ * fat_scan_entries - append dentries in buffer to directory.
+ * @dir:    directory node
+ * @alloc:  allocated count of dir->child
+ * @buf:    directory data
+ * @len:    length of @buf
+ * @offset: byte offset of @buf in image
+ * @arena:  arena of dir->child
+ *
+ * Return: 1 - end of directory
+ *         0 - continue to next buffer
+ *         -ENOMEM - out of memory
+ */
+static int fat_scan_entries(struct fat_node *dir, size_t *alloc,
+    unsigned char *buf, size_t len, u_int64_t offset, struct fat_arena *arena)
+{
+  size_t i, n;
+  struct fat_node *child;
+
+  for (i = 0; i + DENTRY_SIZE <= len; i += DENTRY_SIZE) {
+    if (buf[i] == DENTRY_END)
+      return 1;
+    if (check_dentryfree(buf + i))
+      continue;
+    if (dir->nchild == *alloc) {
+      n = *alloc ? *alloc * 2 : 16;
+      child = fat_arena_realloc(arena, dir->child, *alloc * sizeof(*child),
+          n * sizeof(*child));
+      if (!child)
+        return -ENOMEM;
+      dir->child = child;
+      *alloc = n;
+    }
+    child = &(dir->child[dir->nchild++]);
+    fat_load_dentry(&(child->dentry), buf + i);
+    child->offset = offset + i;
+    child->name = NULL;
+    child->child = NULL;
+    child->nchild = 0;
+    child->extent = NULL;
+    child->nextent = 0;
+  }
+  return 0;
+}
+
+/**
+ * fat_scan_chain - read dentries of all clusters of directory.
+ * @vol:     FAT volume
+ * @dir:     directory node
+ * @visited: bitmap of directory clusters which are already read
+ * @arena:   arena of dir->child
+ * @alloc:   (out) allocated count of dir->child
+ */
+static int fat_scan_chain(struct fat_volume *vol, struct fat_node *dir,
+    unsigned char *visited, struct fat_arena *arena, size_t *alloc)
+{
+  int ret = 0;
+  u_int64_t offset;
+  size_t len;
+  unsigned char *buf;
+  struct fat_chain ch;
+  u_int32_t clus = fat_dentry_cluster(vol, &(dir->dentry));
+
+  if (!clus) {
+    offset = vol->geo.root_offset;
+    len = vol->geo.root_size;
+    if (!len)
+      return 0;
+    if (!(buf = fat_image_get(vol->img, offset, len)))
+      return -EIO;
+    ret = fat_scan_entries(dir, alloc, buf, len, offset, arena);
+    fat_image_put(vol->img, buf);
+    return ret < 0 ? ret : 0;
+  }
+
+  fat_chain_init(&ch, vol, clus);
+  while (fat_chain_next(&ch)) {
+    if (test_and_set_bit(visited, ch.cluster - 2))
+      return ch.count == 1 ? -EEXIST : -ELOOP;
+    offset = fat_cluster_offset(vol, ch.cluster);
+    if (!(buf = fat_image_get(vol->img, offset, vol->geo.cluster_size)))
+      return -EIO;
+    ret = fat_scan_entries(dir, alloc, buf, vol->geo.cluster_size, offset, arena);
+    fat_image_put(vol->img, buf);
+    if (ret)
+      return ret < 0 ? ret : 0;
+  }
+  return ch.err;
+}
+
+/**
+ * fat_scan_dir - read all dentries of directory.
+ * @vol:     FAT volume
+ * @dir:     directory node
+ * @visited: bitmap of directory clusters which are already read
+ * @arena:   arena to allocate children from (of the calling thread)
+ *
+ * Cluster 0 means fixed root directory region of FAT12/16.
+ * Each directory cluster is read only once, so neither loop in chain nor
+ * cross-linked directory is walked twice.
+ *
+ * Return: 0 - success
+ *         -EEXIST - directory is already walked
+ *         negative - error
+ */
+int fat_scan_dir(struct fat_volume *vol, struct fat_node *dir,
+    unsigned char *visited, struct fat_arena *arena)
+{
+  int err;
+  size_t alloc = 0;
+
+  err = fat_scan_chain(vol, dir, visited, arena, &alloc);
+  /* children grow at the end of arena, so unused space is given back */
+  if (dir->child)
+    dir->child = fat_arena_realloc(arena, dir->child,
+        alloc * sizeof(*dir->child), dir->nchild * sizeof(*dir->child));
+  return err;
+}
+
+void fat_dir_error(struct fat_volume *vol, struct fat_node *dir, int err)
+{
+  const char *msg;
+
+  switch (err) {
+    case -EEXIST:
+      msg = _("already walked");
+      break;
+    case -ELOOP:
+      msg = _("loop in cluster chain");
+      break;
+    case -EINVAL:
+      msg = _("broken cluster chain");
+      break;
+    default:
+      msg = strerror(-err);
+  }
+  fprintf(stderr, _("directory cluster %u: %s\n"),
+      fat_dentry_cluster(vol, &(dir->dentry)), msg);
+}
+
+/**
+ * State of directory tree walk
+ */
+struct fat_walk {
+  struct fat_volume *vol;
+  struct fat_tree *tree;
+  unsigned char *visited;
+  struct fat_pool *pool;
+  struct fat_stack stack;
+  int err;
+};
+
+static void fat_walk_task(struct fat_pool *, int, void *);
+
+/**
+ * fat_walk_dir - read directory, and queue its child directories.
+ * @walk:   state of walk
+ * @dir:    directory node
+ * @worker: index of worker thread (only for parallel walk)
+ *
+ * Child directories are queued in reverse order, so that they are taken
+ * in on-disk order from the stack (or own deque of worker).
+ */
+static int fat_walk_dir(struct fat_walk *walk, struct fat_node *dir, int worker)
+{
+  int err;
+  size_t i;
+  u_int32_t clus;
+  struct fat_volume *vol = walk->vol;
+
+  if ((err = fat_scan_dir(vol, dir, walk->visited, &(walk->tree->arena[worker]))) < 0) {
+    if (err == -ENOMEM)
+      return err;
+    fat_dir_error(vol, dir, err);
+  }
+  __atomic_fetch_add(&(walk->tree->count), dir->nchild, __ATOMIC_RELAXED);
+
+  for (i = dir->nchild; i-- > 0;) {
+    if (!fat_is_subdir(&(dir->child[i].dentry)))
+      continue;
+    clus = fat_dentry_cluster(vol, &(dir->child[i].dentry));
+    if (!fat_valid_cluster(vol, clus))
+      continue;
+    if (walk->pool)
+      err = fat_pool_submit(walk->pool, worker, fat_walk_task, &(dir->child[i]));
+    else
+      err = fat_stack_push(&(walk->stack), &(dir->child[i]), 0);
+    if (err < 0)
+      return err;
+  }
+  return 0;
+}
+
+static void fat_walk_task(struct fat_pool *pool, int worker, void *arg)
+{
+  struct fat_walk *walk = pool->data;
+  int err;
+
+  if ((err = fat_walk_dir(walk, arg, worker)) < 0)
+    __atomic_store_n(&(walk->err), err, __ATOMIC_RELAXED);
+}
+
+/**
+ * fat_build_tree - walk whole directory tree.
+ * @vol:  FAT volume
+ * @tree: directory tree to build
+ * @jobs: count of threads to read directories
+ *
+ * Directory is walked only once, even if some dentries point to the same
+ * cluster (such as corrupted volume).
+ * Entries are kept in on-disk order, and whole walk is linear in the count
+ * of directory clusters.
+ * Each directory owns the array of its entries, so the resulting tree
+ * does not depend on the count of threads or on scheduling.
+ *
+ * On error, the partial tree is released.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+int fat_build_tree(struct fat_volume *vol, struct fat_tree *tree, int jobs)
+{
+  int err;
+  struct fat_pool pool;
+  struct fat_walk walk = {0};
+
+  if ((err = fat_init_tree(tree, jobs > 1 ? jobs : 1)) < 0)
+    return err;
+  tree->root.dentry.DIR_Attr = ATTR_DIRECTORY;
+  tree->root.dentry.DIR_FstClusHI = vol->RootClus >> 16;
+  tree->root.dentry.DIR_FstClusLO = vol->RootClus & 0xffff;
+
+  walk.vol = vol;
+  walk.tree = tree;
+  walk.visited = calloc(vol->CountofClusters / CHAR_BIT + 1, sizeof(*walk.visited));
+  if (!walk.visited) {
+    fat_free_tree(tree);
+    return -ENOMEM;
+  }
+
+  if (jobs > 1 && !fat_pool_init(&pool, jobs)) {
+    walk.pool = &pool;
+    pool.data = &walk;
+    if ((walk.err = fat_pool_submit(&pool, -1, fat_walk_task, &(tree->root))) == 0)
+      fat_pool_wait(&pool);
+    fat_pool_destroy(&pool);
+    goto out;
+  }
+
+  if ((walk.err = fat_stack_push(&(walk.stack), &(tree->root), 0)) < 0)
+    goto out;
+  while (walk.stack.count) {
+    walk.stack.count--;
+    walk.err = fat_walk_dir(&walk, walk.stack.node[walk.stack.count], 0);
+    if (walk.err < 0)
+      break;
+  }
+
+out:
+  fat_stack_free(&(walk.stack));
+  free(walk.visited);
+  if (!walk.err)
+    walk.err = fat_tree_names(tree);
+  if (walk.err < 0)
+    fat_free_tree(tree);
+  return walk.err;
+}
+
+/**
+ * fat_init_tree - initialize empty directory tree.
+ * @tree:   directory tree
+ * @narena: count of threads which add nodes to the tree
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+int fat_init_tree(struct fat_tree *tree, int narena)
+{
+  memset(tree, 0, sizeof(*tree));
+  if (narena < 1)
+    narena = 1;
+  if (!(tree->arena = calloc(narena, sizeof(*tree->arena))))
+    return -ENOMEM;
+  tree->narena = narena;
+  return 0;
+}
+
+static int fat_free_extent(struct fat_node *node, void *arg)
+{
+  free(node->extent);
+  node->extent = NULL;
+  return 0;
+}
+
+/**
+ * fat_free_tree - release directory tree.
+ * @tree: directory tree
+ *
+ * Nodes and names are released at once with the arenas; only extents are
+ * freed one by one.
+ */
+void fat_free_tree(struct fat_tree *tree)
+{
+  int i;
+
+  fat_tree_foreach(tree, fat_free_extent, NULL);
+  free(tree->root.extent);
+  for (i = 0; i < tree->narena; i++)
+    fat_arena_free(&(tree->arena[i]));
+  free(tree->arena);
+  memset(tree, 0, sizeof(*tree));
+}
+
+/**
+ * fat_tree_foreach - call function for each dentry of tree.
+ * @tree: directory tree
+ * @fn:   function to call (stop walking when it returns non-zero)
+ * @arg:  argument of @fn
+ *
+ * Directories are visited in pre-order, and root itself is not visited.
+ *
+ * Return: 0 - all dentries are visited
+ *         otherwise - return value of @fn, or -ENOMEM
+ */
+int fat_tree_foreach(struct fat_tree *tree,
+    int (*fn)(struct fat_node *, void *), void *arg)
+{
+  int ret = 0;
+  size_t i;
+  struct fat_node *dir;
+  struct fat_stack st = {0};
+
+  if ((ret = fat_stack_push(&st, &(tree->root), 0)) < 0)
+    return ret;
+  while (st.count) {
+    dir = st.node[--st.count];
+    for (i = 0; i < dir->nchild; i++)
+      if ((ret = fn(&(dir->child[i]), arg)))
+        goto out;
+    for (i = dir->nchild; i-- > 0;)
+      if (dir->child[i].child
+          && (ret = fat_stack_push(&st, &(dir->child[i]), 0)) < 0)
+        goto out;
+  }
+out:
+  fat_stack_free(&st);
+  return ret;
+}
+
+/**
+ * fat_lookup_path - find node by path.
+ * @tree: directory tree
+ * @path: path from root, such as "/DIR1/FILE.TXT" (case-insensitive)
+ *
+ * Components are matched with long or short name of entries.
+ *
+ * Return: node, or NULL if not found
+ */
+struct fat_node *fat_lookup_path(struct fat_tree *tree, const char *path)
+{
+  size_t i, len;
+  char name[NameSIZE + 2];
+  struct fat_node *node = &(tree->root), *child;
+  struct fat_dentry *d;
+
+  while (*path) {
+    len = strcspn(path, "/");
+    if (!len || (len == 1 && path[0] == '.')) {
+      path += len + !!path[len];
+      continue;
+    }
+    for (i = 0; i < node->nchild; i++) {
+      child = &(node->child[i]);
+      d = &(child->dentry);
+      if ((d->DIR_Attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME)
+        continue;
+      if (child->name && strlen(child->name) == len
+          && !strncasecmp(child->name, path, len))
+        break;
+      fat_format_shortname(d, name);
+      if (strlen(name) == len && !strncasecmp(name, path, len))
+        break;
+    }
+    if (i == node->nchild)
+      return NULL;
+    node = &(node->child[i]);
+    path += len + !!path[len];
+  }
+  return node;
+}
+
+/**
+ * fat_path_append - append "/name" of node to path.
+ * @path:    (in/out) path buffer, reallocated if needed
+ * @pathlen: (in/out) size of @path
+ * @len:     length of path to append to
+ * @node:    dentry node
+ *
+ * Return: length of new path, or -ENOMEM
+ */
+static ssize_t fat_path_append(char **path, size_t *pathlen, size_t len,
+    struct fat_node *node)
+{
+  char buf[NameSIZE + 2];
+  const char *name = fat_node_name(node, buf);
+  char *tmp;
+
+  while (len + strlen(name) + 2 > *pathlen) {
+    if (!(tmp = realloc(*path, *pathlen * 2)))
+      return -ENOMEM;
+    *path = tmp;
+    *pathlen *= 2;
+  }
+  return len + sprintf(*path + len, "/%s", name);
+}
+
+/**
+ * fat_tree_foreach_path - call function for each named dentry of tree.
+ * @tree: directory tree
+ * @fn:   function to call with path, parent directory and dentry node
+ *        (stop walking when it returns non-zero)
+ * @arg:  argument of @fn
+ *
+ * Long file name entries, volume label, "." and ".." are not visited.
+ * Directories are visited in pre-order as by fat_tree_foreach(), and path
+ * is built from long names as by fat_dump_tree().
+ *
+ * Return: 0 - all dentries are visited
+ *         otherwise - return value of @fn, or -ENOMEM
+ */
+int fat_tree_foreach_path(struct fat_tree *tree,
+    int (*fn)(const char *, struct fat_node *, struct fat_node *, void *),
+    void *arg)
+{
+  int ret = 0;
+  size_t i, len, pathlen = PATH_MAX;
+  ssize_t n;
+  char *path;
+  struct fat_node *dir, *node;
+  struct fat_dentry *d;
+  struct fat_stack st = {0};
+
+  if (!(path = malloc(pathlen)))
+    return -ENOMEM;
+  if ((ret = fat_stack_push(&st, &(tree->root), 0)) < 0)
+    goto out;
+  while (st.count) {
+    st.count--;
+    dir = st.node[st.count];
+    len = st.len[st.count];
+    if (dir != &(tree->root)) {
+      if ((n = fat_path_append(&path, &pathlen, len, dir)) < 0) {
+        ret = n;
+        goto out;
+      }
+      len = n;
+    }
+    for (i = 0; i < dir->nchild; i++) {
+      node = &(dir->child[i]);
+      d = &(node->dentry);
+      if ((d->DIR_Attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME
+          || (d->DIR_Attr & ATTR_VOLUME_ID) || d->IR_Name[0] == DENTRY_DOT)
+        continue;
+      if ((n = fat_path_append(&path, &pathlen, len, node)) < 0) {
+        ret = n;
+        goto out;
+      }
+      if ((ret = fn(path, dir, node, arg)))
+        goto out;
+    }
+    for (i = dir->nchild; i-- > 0;) {
+      if (!dir->child[i].child || !fat_is_subdir(&(dir->child[i].dentry)))
+        continue;
+      if ((ret = fat_stack_push(&st, &(dir->child[i]), len)) < 0)
+        goto out;
+    }
+  }
+out:
+  fat_stack_free(&st);
+  free(path);
+  return ret;
+}
+
+/**
+ * fat_dump_tree - print out all directories.
+ * @tree: directory tree
+ * @out:  output sink
+ *
+ * Directories are printed in pre-order, each followed by its entries.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+int fat_dump_tree(struct fat_tree *tree, struct fat_output *out)
+{
+  int err = 0;
+  size_t i;
+  size_t len;
+  size_t pathlen = PATH_MAX;
+  char *path, *tmp;
+  char buf[NameSIZE + 2];
+  const char *name;
+  struct fat_node *dir;
+  struct fat_stack st = {0};
+
+  if (!(path = malloc(pathlen)))
+    return -ENOMEM;
+  path[0] = '\0';
+
+  if ((err = fat_stack_push(&st, &(tree->root), 0)) < 0)
+    goto out;
+  while (st.count) {
+    st.count--;
+    dir = st.node[st.count];
+    len = st.len[st.count];
+    if (dir != &(tree->root)) {
+      name = fat_node_name(dir, buf);
+      if (len + strlen(name) + 2 > pathlen) {
+        pathlen *= 2;
+        if (!(tmp = realloc(path, pathlen))) {
+          err = -ENOMEM;
+          goto out;
+        }
+        path = tmp;
+      }
+      len += sprintf(path + len, "/%s", name);
+    }
+    path[len] = '\0';
+
+    if (!len) {
+      path[0] = '/';
+      path[1] = '\0';
+    }
+    out->ops->dir(out, path, dir);
+    for (i = 0; i < dir->nchild; i++)
+      out->ops->dentry(out, path, dir, &(dir->child[i]));
+    path[len] = '\0';
+    for (i = dir->nchild; i-- > 0;) {
+      if (!dir->child[i].child)
+        continue;
+      if ((err = fat_stack_push(&st, &(dir->child[i]), len)) < 0)
+        goto out;
+    }
+  }
+
+out:
+  fat_stack_free(&st);
+  free(path);
+  return err;
+}
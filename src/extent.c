@@ -0,0 +1,196 @@
+/*
+ * extent.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/**
+ * fat_build_extents - collapse cluster chain into runs of clusters.
+ * @vol:    FAT volume
+ * @start:  first cluster of chain
+ * @extent: array of extents (allocated, caller must free)
+ * @count:  count of extents
+ *
+ * Return: 0 - success
+ *         negative - error (extents until broken cluster are kept)
+ */
+int fat_build_extents(struct fat_volume *vol, u_int32_t start,
+    struct fat_extent **extent, u_int32_t *count)
+{
+  u_int32_t alloc = 0;
+  u_int32_t vcn = 0;
+  struct fat_extent *e = NULL;
+  struct fat_extent *tmp;
+  struct fat_chain ch;
+
+  *count = 0;
+  fat_chain_init(&ch, vol, start);
+  while (fat_chain_next(&ch)) {
+    if (*count && e[*count - 1].cluster + e[*count - 1].count == ch.cluster) {
+      e[*count - 1].count++;
+      vcn++;
+      continue;
+    }
+    if (*count == alloc) {
+      alloc = alloc ? alloc * 2 : 4;
+      if (!(tmp = realloc(e, alloc * sizeof(*e)))) {
+        free(e);
+        *extent = NULL;
+        *count = 0;
+        return -ENOMEM;
+      }
+      e = tmp;
+    }
+    e[*count].offset = vcn++;
+    e[*count].cluster = ch.cluster;
+    e[*count].count = 1;
+    (*count)++;
+  }
+  *extent = e;
+  return ch.err;
+}
+
+/**
+ * fat_node_extents - build extents of dentry once, and cache them.
+ * @vol:  FAT volume
+ * @node: dentry node
+ *
+ * Not thread-safe for the same node.
+ *
+ * Return: 0 - success
+ *         negative - error
+ */
+int fat_node_extents(struct fat_volume *vol, struct fat_node *node)
+{
+  u_int32_t clus;
+
+  if (node->extent || node->dentry.IR_Name[0] == DENTRY_DOT)
+    return 0;
+  if ((node->dentry.DIR_Attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME)
+    return 0;
+  if (!(clus = fat_dentry_cluster(vol, &(node->dentry))))
+    return 0;
+  return fat_build_extents(vol, clus, &(node->extent), &(node->nextent));
+}
+
+static int fat_tree_extents_fn(struct fat_node *node, void *vol)
+{
+  int err = fat_node_extents(vol, node);
+
+  if (err == -ENOMEM)
+    return err;
+  if (err < 0)
+    fprintf(stderr, _("cluster %u: broken cluster chain\n"),
+        fat_dentry_cluster(vol, &(node->dentry)));
+  return 0;
+}
+
+/**
+ * fat_tree_extents - build extents of all dentries in tree.
+ * @vol:  FAT volume
+ * @tree: directory tree
+ */
+int fat_tree_extents(struct fat_volume *vol, struct fat_tree *tree)
+{
+  return fat_tree_foreach(tree, fat_tree_extents_fn, vol);
+}
+
+/**
+ * fat_extent_lookup - find extent which holds cluster of file.
+ * @extent: extents of file
+ * @count:  count of extents
+ * @vcn:    cluster index in file
+ *
+ * Return: extent, or NULL when @vcn is out of file
+ */
+static struct fat_extent *fat_extent_lookup(struct fat_extent *extent,
+    u_int32_t count, u_int32_t vcn)
+{
+  u_int32_t lo = 0;
+  u_int32_t hi = count;
+  u_int32_t mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (vcn < extent[mid].offset)
+      hi = mid;
+    else if (vcn - extent[mid].offset >= extent[mid].count)
+      lo = mid + 1;
+    else
+      return &extent[mid];
+  }
+  return NULL;
+}
+
+/**
+ * fat_node_offset - convert byte offset in file to byte offset in image.
+ * @vol:    FAT volume
+ * @node:   dentry node (extents are built)
+ * @offset: byte offset in file
+ * @len:    length of contiguous bytes from @offset (can be NULL)
+ *
+ * Return: byte offset in image
+ *         0 - @offset is out of file
+ */
+u_int64_t fat_node_offset(struct fat_volume *vol, struct fat_node *node,
+    u_int64_t offset, u_int64_t *len)
+{
+  u_int32_t vcn = offset / vol->geo.cluster_size;
+  struct fat_extent *e;
+
+  if (!(e = fat_extent_lookup(node->extent, node->nextent, vcn)))
+    return 0;
+  if (len)
+    *len = (u_int64_t)(e->offset + e->count) * vol->geo.cluster_size - offset;
+  return fat_cluster_offset(vol, e->cluster + (vcn - e->offset))
+    + offset % vol->geo.cluster_size;
+}
+
+/**
+ * fat_dump_extents - print out extents of dentry.
+ * @node: dentry node
+ * @out:  output stream
+ */
+void fat_dump_extents(struct fat_node *node, FILE *out)
+{
+  u_int32_t i;
+
+  fprintf(out, "%-28s\t: %u", _("Extents"), node->nextent);
+  for (i = 0; i < node->nextent; i++)
+    fprintf(out, " %x-%x", node->extent[i].cluster,
+        node->extent[i].cluster + node->extent[i].count - 1);
+  fputc('\n', out);
+}
@@ -0,0 +1,401 @@
+/*
+ * extract.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+#include "fat.h"
+
+/**
+ * Ways to copy data, tried in this order
+ */
+enum {
+  COPY_FILE_RANGE,
+  COPY_SENDFILE,
+  COPY_READ,
+};
+
+/**
+ * State of copy from image to output file
+ */
+struct fat_copy {
+  int in;
+  int out;
+  int mode;
+  unsigned char *buf;
+};
+
+/**
+ * fat_copy_fallback - whether copy can be retried in next way.
+ * @err: errno of failed copy
+ *
+ * Both system calls refuse some kinds of file (pipe, file opened with
+ * O_APPEND, file on other filesystem on older kernel, and so on).
+ */
+static bool fat_copy_fallback(int err)
+{
+  return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP
+    || err == EBADF;
+}
+
+/**
+ * fat_copy_write - write whole buffer.
+ * @fd:  output file
+ * @buf: data
+ * @len: length of @buf
+ */
+static int fat_copy_write(int fd, const unsigned char *buf, size_t len)
+{
+  ssize_t ret;
+
+  while (len) {
+    if ((ret = write(fd, buf, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+/**
+ * fat_copy_chunk - copy data from image to the end of output file.
+ * @c:      state of copy
+ * @offset: byte offset in image
+ * @len:    length to copy
+ *
+ * Data is copied in kernel if possible, and through one large buffer
+ * otherwise.
+ *
+ * Return: length copied (0 at the end of image)
+ *         -1 - error (errno)
+ */
+static ssize_t fat_copy_chunk(struct fat_copy *c, u_int64_t offset, size_t len)
+{
+  ssize_t ret;
+  off_t pos = offset;
+#ifdef SYS_copy_file_range
+  long long off = offset;
+#endif
+
+  switch (c->mode) {
+    case COPY_FILE_RANGE:
+#ifdef SYS_copy_file_range
+      ret = syscall(SYS_copy_file_range, c->in, &off, c->out, NULL, len, 0);
+      if (ret >= 0 || !fat_copy_fallback(errno))
+        return ret;
+#endif
+      c->mode = COPY_SENDFILE;
+      /* FALLTHROUGH */
+    case COPY_SENDFILE:
+      if ((u_int64_t)pos == offset) {
+        ret = sendfile(c->out, c->in, &pos, len);
+        if (ret >= 0 || !fat_copy_fallback(errno))
+          return ret;
+      }
+      c->mode = COPY_READ;
+      /* FALLTHROUGH */
+    default:
+      if (!c->buf && !(c->buf = malloc(FAT_EXTRACT_BUFSIZE))) {
+        errno = ENOMEM;
+        return -1;
+      }
+      if (len > FAT_EXTRACT_BUFSIZE)
+        len = FAT_EXTRACT_BUFSIZE;
+      ret = pread(c->in, c->buf, len, offset);
+      if (ret > 0 && fat_copy_write(c->out, c->buf, ret) < 0)
+        return -1;
+      return ret;
+  }
+}
+
+/**
+ * fat_copy_node - copy contents of file.
+ * @c:    state of copy
+ * @vol:  FAT volume
+ * @node: dentry node of file
+ *
+ * Each run of contiguous clusters is copied at once, up to DIR_FileSize.
+ * Runs are found by file offset with fat_node_offset(), as any random
+ * read would do.
+ *
+ * Return: 0 - success
+ *         -EIO - cluster chain is shorter than file, or image is truncated
+ *         negative - error (errno)
+ */
+static int fat_copy_node(struct fat_copy *c, struct fat_volume *vol,
+    struct fat_node *node)
+{
+  int err;
+  ssize_t ret;
+  u_int64_t pos, offset, len;
+  u_int64_t size = node->dentry.DIR_FileSize;
+
+  if (node->dentry.DIR_Attr & ATTR_DIRECTORY)
+    return -EISDIR;
+  if (vol->img->seg)
+    return -EOPNOTSUPP;
+  if (!size)
+    return 0;
+  if ((err = fat_node_extents(vol, node)) < 0 && !node->nextent)
+    return err;
+
+  for (pos = 0; pos < size;) {
+    if (!(offset = fat_node_offset(vol, node, pos, &len)))
+      return -EIO;
+    /* file offset, for window of partition */
+    offset += vol->img->base;
+    if (len > size - pos)
+      len = size - pos;
+    pos += len;
+    while (len) {
+      if ((ret = fat_copy_chunk(c, offset, len)) < 0) {
+        if (errno == EINTR)
+          continue;
+        return -errno;
+      }
+      if (!ret)
+        return -EIO;
+      offset += ret;
+      len -= ret;
+    }
+  }
+  return 0;
+}
+
+/**
+ * fat_extract_node - write contents of file to file descriptor.
+ * @vol:  FAT volume
+ * @node: dentry node of file
+ * @fd:   output file
+ *
+ * Return: 0 - success
+ *         -EISDIR - @node is directory
+ *         -EOPNOTSUPP - image is read in single pass
+ *         -EIO - cluster chain is shorter than file, or image is truncated
+ *         negative - error (errno)
+ */
+int fat_extract_node(struct fat_volume *vol, struct fat_node *node, int fd)
+{
+  int err;
+  struct fat_copy c = {
+    .in = vol->img->fd,
+    .out = fd,
+    .mode = COPY_FILE_RANGE,
+  };
+
+  err = fat_copy_node(&c, vol, node);
+  free(c.buf);
+  return err;
+}
+
+/**
+ * fat_extract_time - set modification time of extracted file.
+ * @fd:     extracted file
+ * @dentry: directory entry
+ */
+static void fat_extract_time(int fd, struct fat_dentry *dentry)
+{
+  struct tm tm = {0};
+  struct timespec ts[2];
+
+  fat_dateformat(&tm, dentry->DIR_WrtDate);
+  fat_timeformat(&tm, dentry->DIR_WrtTime);
+  tm.tm_year += 80;
+  tm.tm_mon -= 1;
+  tm.tm_sec *= 2;
+  tm.tm_isdst = -1;
+  ts[0].tv_nsec = UTIME_OMIT;
+  ts[1].tv_sec = mktime(&tm);
+  ts[1].tv_nsec = 0;
+  if (ts[1].tv_sec != (time_t)-1)
+    futimens(fd, ts);
+}
+
+/**
+ * fat_extract_name - make name of extracted file.
+ * @node: dentry node
+ * @name: output buffer (at least FAT_NAME_MAX bytes)
+ *
+ * Long file name is used if any.
+ *
+ * Return: name, or NULL if entry is not extracted
+ */
+static char *fat_extract_name(struct fat_node *node, char *name)
+{
+  char *p;
+  struct fat_dentry *dentry = &(node->dentry);
+
+  if ((dentry->DIR_Attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME
+      || (dentry->DIR_Attr & ATTR_VOLUME_ID)
+      || dentry->IR_Name[0] == DENTRY_DOT)
+    return NULL;
+  if (node->name)
+    snprintf(name, FAT_NAME_MAX, "%s", node->name);
+  else
+    fat_format_shortname(dentry, name);
+  if (!name[0] || !strcmp(name, ".") || !strcmp(name, ".."))
+    return NULL;
+  /* never leave the output directory */
+  for (p = name; *p; p++)
+    if (*p == '/')
+      *p = '_';
+  return name;
+}
+
+/**
+ * fat_extract_file - extract one file into directory.
+ * @c:    state of copy
+ * @vol:  FAT volume
+ * @node: dentry node of file
+ * @path: output file path
+ */
+static int fat_extract_file(struct fat_copy *c, struct fat_volume *vol,
+    struct fat_node *node, const char *path)
+{
+  int err;
+
+  if ((c->out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return -errno;
+  err = fat_copy_node(c, vol, node);
+  fat_extract_time(c->out, &(node->dentry));
+  if (close(c->out) < 0 && !err)
+    err = -errno;
+  /* extents are not used again */
+  free(node->extent);
+  node->extent = NULL;
+  node->nextent = 0;
+  /* next file may be on other filesystem */
+  if (c->mode == COPY_SENDFILE)
+    c->mode = COPY_FILE_RANGE;
+  return err;
+}
+
+/**
+ * fat_extract_tree - extract all files into directory.
+ * @vol:  FAT volume
+ * @tree: directory tree
+ * @dir:  output directory (created if missing)
+ *
+ * Directories are created as in the volume, with long names if any. Files
+ * which cannot be extracted are reported, and the others are still extracted.
+ *
+ * Return: 0 - success
+ *         -EIO - some files are not extracted
+ *         negative - error (errno)
+ */
+int fat_extract_tree(struct fat_volume *vol, struct fat_tree *tree, const char *dir)
+{
+  int err = 0, ret;
+  size_t i, len, head = 0, count = 0, alloc = 0;
+  char name[FAT_NAME_MAX];
+  char *path;
+  struct fat_node *node;
+  struct {
+    struct fat_node *node;
+    char *path;
+  } *queue = NULL, *tmp, item;
+  struct fat_copy c = {
+    .in = vol->img->fd,
+    .mode = COPY_FILE_RANGE,
+  };
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    return -errno;
+  if (!(queue = malloc(sizeof(*queue))) || !(queue[0].path = strdup(dir))) {
+    err = -ENOMEM;
+    goto out;
+  }
+  queue[0].node = &(tree->root);
+  count = alloc = 1;
+
+  while (head < count) {
+    item = queue[head++];
+    for (i = 0; i < item.node->nchild; i++) {
+      node = &(item.node->child[i]);
+      if (!fat_extract_name(node, name))
+        continue;
+      len = strlen(item.path) + strlen(name) + 2;
+      if (!(path = malloc(len))) {
+        err = -ENOMEM;
+        break;
+      }
+      snprintf(path, len, "%s/%s", item.path, name);
+
+      if (!(node->dentry.DIR_Attr & ATTR_DIRECTORY))
+        ret = fat_extract_file(&c, vol, node, path);
+      else if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        ret = -errno;
+      else
+        ret = 0;
+      if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+        err = -EIO;
+      }
+      if (ret < 0 || !node->nchild) {
+        free(path);
+        continue;
+      }
+
+      if (count == alloc) {
+        alloc *= 2;
+        if (!(tmp = realloc(queue, alloc * sizeof(*queue)))) {
+          free(path);
+          err = -ENOMEM;
+          break;
+        }
+        queue = tmp;
+      }
+      queue[count].node = node;
+      queue[count++].path = path;
+    }
+    free(item.path);
+    if (err == -ENOMEM)
+      break;
+  }
+out:
+  if (queue) {
+    for (; head < count; head++)
+      free(queue[head].path);
+  }
+  free(queue);
+  free(c.buf);
+  return err;
+}
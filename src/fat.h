@@ -23,6 +23,9 @@
 #endif
 
 #include <libintl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include <config.h>
 #define _(String) gettext (String)
 
@@ -57,33 +60,70 @@ static inline char *__memcpy(void *dist, unsigned const char *src,
   return dist;
 }
 
+extern const char fat_hexdigit[16];
+extern const unsigned char fat_printable[256];
+
+/**
+ * setcharc - format bytes as printable characters.
+ * @buf: bytes
+ * @ret: output buffer (at least @len + 1 bytes)
+ * @len: count of bytes
+ */
 static inline unsigned char *setcharc(unsigned const char* buf,
                                       unsigned char* ret, size_t len)
 {
-  int i;
-  memset(ret, '\0', len);
-  for (i = 0; i < len; i++) {
-    unsigned char tmp[1 + 1] = ".\0";
-    if (buf[i] >= 0x20 && buf[i] <= 0x7e)
-      sprintf(tmp, "%c", buf[i]);
-    strcat(ret, tmp);
-  }
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    ret[i] = fat_printable[buf[i]];
+  ret[len] = '\0';
   return ret;
 }
 
+/**
+ * setcharx - format bytes as hexadecimal without leading zero.
+ * @buf: bytes
+ * @ret: output buffer (at least 2 * @len + 1 bytes)
+ * @len: count of bytes
+ */
 static inline unsigned char *setcharx(unsigned const char* buf,
                                       unsigned char* ret, size_t len)
 {
-  int i;
-  unsigned char tmp[2 + 1] = "\0";
-  memset(ret, '\0', len);
+  size_t i;
+  unsigned char *p = ret;
+
   for (i = 0; i < len; i++) {
-    sprintf(tmp, "%x", buf[i]);
-    strcat(ret, tmp);
+    if (buf[i] >> 4)
+      *p++ = fat_hexdigit[buf[i] >> 4];
+    *p++ = fat_hexdigit[buf[i] & 0x0f];
   }
+  *p = '\0';
   return ret;
 }
 
+/* bitmap of clusters */
+static inline bool test_and_set_bit(unsigned char *map, u_int32_t n)
+{
+  unsigned char bit = 1 << (n % CHAR_BIT);
+
+  return __atomic_fetch_or(&map[n / CHAR_BIT], bit, __ATOMIC_RELAXED) & bit;
+}
+
+static inline bool test_bit(const unsigned char *map, u_int32_t n)
+{
+  return map[n / CHAR_BIT] & (1 << (n % CHAR_BIT));
+}
+
+static inline void set_bit(unsigned char *map, u_int32_t n)
+{
+  map[n / CHAR_BIT] |= 1 << (n % CHAR_BIT);
+}
+
+static inline void clear_bit(unsigned char *map, u_int32_t n)
+{
+  map[n / CHAR_BIT] &= ~(1 << (n % CHAR_BIT));
+}
+
 /* media of boot sector */
 static inline int fat_valid_media(u_int8_t media)
 {
@@ -206,6 +246,7 @@ enum Fat12Entry
 {
   FAT12_UNUSED = 0x000,
   FAT12_RESERVED = 0x001,
+  FAT12_RSVDSTART = 0xFF0,
   FAT12_BADCLUSTER = 0xFF7,
   FAT12_DATAEND = 0xFF8,
 };
@@ -214,6 +255,7 @@ enum Fat16Entry
 {
   FAT16_UNUSED = 0x0000,
   FAT16_RESERVED = 0x0001,
+  FAT16_RSVDSTART = 0xFFF0,
   FAT16_BADCLUSTER = 0xFFF7,
   FAT16_DATAEND = 0xFFF8,
 };
@@ -222,8 +264,10 @@ enum Fat32Entry
 {
   FAT32_UNUSED = 0x00000000,
   FAT32_RESERVED = 0x00000001,
+  FAT32_RSVDSTART = 0xFFFFFFF0,
   FAT32_BADCLUSTER = 0xFFFFFFF7,
   FAT32_DATAEND = 0xFFFFFFF8,
+  FAT32_ENTRYMASK = 0x0FFFFFFF,
 };
 
 enum {
@@ -241,6 +285,13 @@ enum {
   FileSizeSIZE = 4,
 };
 
+/* first byte of DIR_Name */
+enum {
+  DENTRY_END = 0x00,
+  DENTRY_DOT = 0x2e,
+  DENTRY_DELETED = 0xe5,
+};
+
 struct fat_dentry {
   unsigned char IR_Name[NameSIZE];
   unsigned char DIR_Attr;
@@ -256,6 +307,25 @@ struct fat_dentry {
   u_int32_t DIR_FileSize;
 };
 
+/* long file name entry, placed before its short entry in reverse order */
+enum {
+  LFN_LAST = 0x40,
+  LFN_ORDMASK = 0x3f,
+  LFN_CHARS = 13,
+  LFN_MAXLEN = 255,
+};
+
+struct fat_lfn_dentry {
+  unsigned char LDIR_Ord;
+  unsigned char LDIR_Name1[10];
+  unsigned char LDIR_Attr;
+  unsigned char LDIR_Type;
+  unsigned char LDIR_Chksum;
+  unsigned char LDIR_Name2[12];
+  u_int16_t LDIR_FstClusLO;
+  unsigned char LDIR_Name3[4];
+};
+
 /**
  * Time format
  * 15                    0
@@ -293,17 +363,834 @@ enum {
   ATTR_LONG_FILE_NAME = 0x0f,
 };
 
+/**
+ * Image access
+ */
+#define FAT_STREAM_BUFSIZE (1024 * 1024)
+
+/* region of streamed image kept in memory */
+struct fat_segment {
+  u_int64_t offset;
+  size_t len;
+  unsigned char *data;
+  bool pending;
+};
+
+struct fat_image {
+  int fd;
+  unsigned char *map;
+  u_int64_t size;
+  u_int64_t base;     /* offset in file of window (partition) */
+  bool window;        /* fd and map belong to another image */
+  struct timespec mtime;
+  struct fat_segment *seg;
+  size_t nseg;
+  size_t aseg;
+};
+
+int fat_image_open(struct fat_image *, const char *);
+void fat_image_close(struct fat_image *);
+int fat_image_window(struct fat_image *, struct fat_image *, u_int64_t, u_int64_t);
+unsigned char *fat_image_get(struct fat_image *, u_int64_t, size_t);
+void fat_image_put(struct fat_image *, unsigned char *);
+void fat_image_advise(struct fat_image *, u_int64_t, size_t, int);
+struct fat_segment *fat_image_segment(struct fat_image *, u_int64_t);
+int fat_image_append(struct fat_image *, u_int64_t, unsigned char *, size_t, bool);
+int fat_stream_load(struct fat_image *);
+
+/**
+ * Partition table
+ */
+#define MBR_SECTOR_SIZE 512
+#define MBR_PART_OFFSET 446
+#define MBR_TYPE_GPT 0xee     /* protective MBR */
+#define MBR_PART_COUNT 4
+#define MBR_LOGICAL_FIRST 5   /* number of first logical partition */
+#define GPT_SIGNATURE "EFI PART"
+#define FAT_PART_MAX 128      /* partitions (or EBRs) to look at */
+
+struct fat_mbr_entry {
+  u_int8_t status;
+  u_int8_t chs_first[3];
+  u_int8_t type;
+  u_int8_t chs_last[3];
+  u_int32_t lba;
+  u_int32_t sectors;
+} __attribute__((packed));
+
+struct fat_gpt_header {
+  char signature[8];
+  u_int32_t revision;
+  u_int32_t header_size;
+  u_int32_t header_crc;
+  u_int32_t reserved;
+  u_int64_t current_lba;
+  u_int64_t backup_lba;
+  u_int64_t first_lba;
+  u_int64_t last_lba;
+  u_int8_t disk_guid[16];
+  u_int64_t entry_lba;
+  u_int32_t entry_count;
+  u_int32_t entry_size;
+  u_int32_t entry_crc;
+} __attribute__((packed));
+
+struct fat_gpt_entry {
+  u_int8_t type_guid[16];
+  u_int8_t part_guid[16];
+  u_int64_t first_lba;
+  u_int64_t last_lba;
+  u_int64_t attr;
+  u_int16_t name[36];
+} __attribute__((packed));
+
+/* FAT volume found in partition table */
+struct fat_part {
+  u_int64_t offset;
+  u_int64_t size;
+  unsigned int number;  /* 1-4 primary and 5- logical in MBR, 1- in GPT */
+};
+
+int fat_part_scan(struct fat_image *, struct fat_part **, size_t *);
+
+/**
+ * FAT volume
+ */
+/* byte layout of volume, computed once (volume may be larger than 4 GiB) */
+struct fat_geometry {
+  u_int32_t sector;         /* bytes per sector */
+  u_int32_t cluster_size;   /* bytes per cluster */
+  unsigned int cluster_shift;
+  u_int64_t fat_offset;     /* first FAT */
+  u_int64_t fat_size;       /* one FAT */
+  u_int64_t fats_size;      /* all FATs */
+  u_int64_t root_offset;    /* fixed root directory of FAT12/16 */
+  u_int64_t root_size;
+  u_int64_t data_offset;    /* cluster 2 */
+  u_int64_t data_size;
+  u_int64_t size;           /* whole volume */
+};
+
+struct fat_volume {
+  struct fat_image *img;
+  struct fat_reserved_info resv;
+  struct fat32_fsinfo fsinfo;
+  enum FStype fstype;
+  const struct fat_entry_ops *ops;
+  struct fat_geometry geo;
+  u_int32_t secsPerFat;
+  u_int32_t totSec;
+  u_int32_t FatStartSector;
+  u_int32_t FatSectors;
+  u_int32_t RootDirStartSector;
+  u_int32_t RootDirSectors;
+  u_int32_t DataStartSector;
+  u_int32_t DataSectors;
+  u_int32_t CountofClusters;
+  u_int32_t RootClus;
+  unsigned char *fat;
+  u_int16_t *fat12;
+};
+
+int fat_volume_layout(struct fat_volume *, struct fat_image *);
+int fat_volume_open(struct fat_volume *, struct fat_image *);
+void fat_volume_close(struct fat_volume *);
+void fat_volume_dump(struct fat_volume *, FILE *);
+
+/**
+ * Cluster chain
+ */
+struct fat_chain {
+  struct fat_volume *vol;
+  u_int32_t cluster;
+  u_int32_t next;
+  u_int32_t count;
+  u_int32_t mark;
+  u_int32_t power;
+  bool done;
+  int err;
+};
+
+struct fat_stat;
+
+/*
+ * Entry operations specialized for one FAT type, selected once per volume
+ * (vol->ops), so that loops over entries do not check FAT type.
+ * Special values are kept as data, so that tests of entries are inlined
+ * comparisons rather than calls.
+ */
+struct fat_entry_ops {
+  u_int32_t (*get_entry)(struct fat_volume *, u_int32_t);
+  void (*get_entries)(struct fat_volume *, u_int32_t, u_int32_t, u_int32_t *);
+  u_int32_t eoc;    /* smallest end of chain entry */
+  u_int32_t bad;    /* bad cluster entry */
+  bool (*chain_next)(struct fat_chain *);
+  void (*count)(struct fat_volume *, u_int32_t, u_int32_t, struct fat_stat *);
+};
+
+extern const struct fat_entry_ops fat12_entry_ops;
+extern const struct fat_entry_ops fat16_entry_ops;
+extern const struct fat_entry_ops fat32_entry_ops;
+
+/**
+ * fat_get_entry - get FAT entry of cluster.
+ * @vol:  FAT volume
+ * @clus: cluster number (must be valid)
+ */
+static inline u_int32_t fat_get_entry(struct fat_volume *vol, u_int32_t clus)
+{
+  return vol->ops->get_entry(vol, clus);
+}
+
+/**
+ * fat_get_entries - get FAT entries of consecutive clusters.
+ * @vol:   FAT volume
+ * @first: first cluster number
+ * @n:     count of entries
+ * @out:   (out) entries
+ */
+static inline void fat_get_entries(struct fat_volume *vol, u_int32_t first,
+    u_int32_t n, u_int32_t *out)
+{
+  vol->ops->get_entries(vol, first, n, out);
+}
+
+/**
+ * fat_is_eoc - whether FAT entry is end of cluster chain.
+ * @vol:   FAT volume
+ * @entry: FAT entry
+ */
+static inline bool fat_is_eoc(struct fat_volume *vol, u_int32_t entry)
+{
+  return entry >= vol->ops->eoc;
+}
+
+/**
+ * fat_is_bad - whether FAT entry is marked as bad cluster.
+ * @vol:   FAT volume
+ * @entry: FAT entry
+ */
+static inline bool fat_is_bad(struct fat_volume *vol, u_int32_t entry)
+{
+  return entry == vol->ops->bad;
+}
+
+/**
+ * fat_chain_next - move to next cluster of chain.
+ * @ch: cluster chain iterator
+ *
+ * Return: true  - ch->cluster is next cluster
+ *         false - end of chain (ch->err is set when chain is broken)
+ */
+static inline bool fat_chain_next(struct fat_chain *ch)
+{
+  return ch->vol->ops->chain_next(ch);
+}
+
+/**
+ * fat_valid_cluster - whether cluster number is in data region.
+ * @vol:  FAT volume
+ * @clus: cluster number
+ */
+static inline bool fat_valid_cluster(struct fat_volume *vol, u_int32_t clus)
+{
+  return clus >= 2 && clus - 2 < vol->CountofClusters;
+}
+
+u_int64_t fat_cluster_offset(struct fat_volume *, u_int32_t);
+void fat_chain_init(struct fat_chain *, struct fat_volume *, u_int32_t);
+
+/**
+ * Allocation statistics of FAT
+ */
+struct fat_stat {
+  u_int32_t free;
+  u_int32_t used;
+  u_int32_t bad;
+  u_int32_t reserved;
+  u_int32_t eoc;
+};
+
+void fat_count_fattable(struct fat_volume *, struct fat_stat *);
+void fat_dump_fatstat(struct fat_stat *, FILE *);
+void fat_dump_fattable(struct fat_volume *, FILE *);
+
+/**
+ * Thread pool
+ */
+struct fat_pool;
+
+struct fat_task {
+  void (*fn)(struct fat_pool *, int, void *);
+  void *arg;
+};
+
+struct fat_deque {
+  pthread_mutex_t lock;
+  struct fat_task *task;
+  size_t head;
+  size_t count;
+  size_t alloc;
+};
+
+struct fat_pool {
+  int jobs;
+  int started;
+  pthread_t *thread;
+  struct fat_deque *deque;
+  void *arg;
+  void *data;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t pending;
+  size_t queued;
+  unsigned int next;
+  bool stop;
+};
+
+int fat_pool_init(struct fat_pool *, int);
+int fat_pool_submit(struct fat_pool *, int,
+    void (*)(struct fat_pool *, int, void *), void *);
+void fat_pool_wait(struct fat_pool *);
+void fat_pool_destroy(struct fat_pool *);
+
+/**
+ * Batch of images
+ */
+#define FAT_BATCH_WINDOW 4
+
+struct fat_batch_item {
+  const char *path;
+  char *buf;
+  size_t len;
+  int err;
+  bool done;
+};
+
+struct fat_batch {
+  char **path;
+  size_t count;
+  int (*fn)(const char *, size_t, FILE *, void *);
+  void *arg;
+  FILE *out;
+  struct fat_batch_item *item;
+  size_t submitted;
+  size_t flushed;
+  size_t window;
+  size_t failed;
+  int err;
+  pthread_mutex_t lock;
+};
+
+int fat_batch_run(struct fat_batch *, int);
+int fat_batch_read_list(FILE *, char ***, size_t *);
+
+/**
+ * Arena of small allocations released at once
+ */
+#define FAT_ARENA_BLOCK (1024 * 1024)
+#define FAT_ARENA_ALIGN 8
+
+struct fat_arena_block {
+  struct fat_arena_block *next;
+  size_t size;
+  size_t used;
+  unsigned char data[];
+};
+
+struct fat_arena {
+  struct fat_arena_block *head;
+  size_t total;
+};
+
+void *fat_arena_alloc(struct fat_arena *, size_t, size_t);
+void *fat_arena_calloc(struct fat_arena *, size_t, size_t);
+void *fat_arena_realloc(struct fat_arena *, void *, size_t, size_t);
+char *fat_arena_strndup(struct fat_arena *, const char *, size_t);
+void fat_arena_free(struct fat_arena *);
+
+/**
+ * Directory tree
+ */
+struct fat_output;
+
+struct fat_extent {
+  u_int32_t offset;
+  u_int32_t cluster;
+  u_int32_t count;
+};
+
+/* children and names live in arenas of tree, extents are malloc'ed */
+struct fat_node {
+  struct fat_dentry dentry;
+  u_int64_t offset;
+  const char *name;  /* long file name in UTF-8, NULL if none */
+  struct fat_node *child;
+  struct fat_extent *extent;
+  u_int32_t nchild;
+  u_int32_t nextent;
+};
+
+/* one arena per thread which builds the tree */
+struct fat_tree {
+  struct fat_node root;
+  size_t count;
+  struct fat_arena *arena;
+  int narena;
+};
+
+u_int32_t fat_dentry_cluster(struct fat_volume *, struct fat_dentry *);
+bool fat_is_subdir(struct fat_dentry *);
+int fat_scan_dir(struct fat_volume *, struct fat_node *, unsigned char *,
+    struct fat_arena *);
+void fat_dir_error(struct fat_volume *, struct fat_node *, int);
+int fat_build_tree(struct fat_volume *, struct fat_tree *, int);
+int fat_init_tree(struct fat_tree *, int);
+void fat_free_tree(struct fat_tree *);
+int fat_tree_foreach(struct fat_tree *, int (*)(struct fat_node *, void *), void *);
+int fat_tree_foreach_path(struct fat_tree *,
+    int (*)(const char *, struct fat_node *, struct fat_node *, void *), void *);
+struct fat_node *fat_lookup_path(struct fat_tree *, const char *);
+int fat_dump_tree(struct fat_tree *, struct fat_output *);
+
+/**
+ * Long file name
+ */
+/* UTF-8 of LFN_MAXLEN UCS-2 characters */
+#define FAT_NAME_MAX (LFN_MAXLEN * 3 + 1)
+
+u_int8_t fat_lfn_checksum(const unsigned char *);
+size_t fat_ucs2_to_utf8(const u_int16_t *, size_t, char *);
+int fat_lfn_assemble(struct fat_node *, struct fat_arena *);
+int fat_tree_names(struct fat_tree *);
+const char *fat_node_name(struct fat_node *, char *);
+
+/**
+ * Path lookup index
+ */
+struct fat_lookup_slot {
+  u_int64_t hash;
+  struct fat_node *node;  /* NULL: empty slot */
+  struct fat_node *dir;
+};
+
+struct fat_lookup {
+  struct fat_volume *vol;
+  struct fat_tree *tree;
+  struct fat_lookup_slot *slot;
+  size_t mask;
+  size_t count;
+};
+
+int fat_lookup_init(struct fat_lookup *, struct fat_volume *, struct fat_tree *);
+struct fat_node *fat_lookup_child(struct fat_lookup *, struct fat_node *,
+    const char *, size_t);
+struct fat_node *fat_lookup(struct fat_lookup *, const char *, struct fat_node **);
+void fat_lookup_free(struct fat_lookup *);
+
+/**
+ * Extent of file
+ */
+int fat_build_extents(struct fat_volume *, u_int32_t, struct fat_extent **, u_int32_t *);
+int fat_node_extents(struct fat_volume *, struct fat_node *);
+int fat_tree_extents(struct fat_volume *, struct fat_tree *);
+u_int64_t fat_node_offset(struct fat_volume *, struct fat_node *, u_int64_t, u_int64_t *);
+void fat_dump_extents(struct fat_node *, FILE *);
+
+/**
+ * File extraction
+ */
+#define FAT_EXTRACT_BUFSIZE (1024 * 1024)
+
+int fat_extract_node(struct fat_volume *, struct fat_node *, int);
+int fat_extract_tree(struct fat_volume *, struct fat_tree *, const char *);
+
+/**
+ * Hash of file contents
+ */
+#define FAT_DIGEST_CHUNK (4 * 1024 * 1024)
+#define FAT_DIGEST_BATCH (8 * 1024 * 1024)
+
+int fat_digest_tree(struct fat_volume *, struct fat_tree *, struct fat_output *, int);
+
+/**
+ * Recovery of deleted files
+ */
+#define FAT_RECOVER_CHUNK (64 * 1024 * 1024)
+#define FAT_RECOVER_BLOCK (4 * 1024 * 1024)
+
+enum fat_found_type {
+  FOUND_DELETED,
+  FOUND_ORPHAN,
+};
+
+enum fat_found_state {
+  FOUND_RECOVERABLE,
+  FOUND_PARTIAL,
+  FOUND_OVERWRITTEN,
+  FOUND_EMPTY,
+};
+
+/* deleted dentry, or head of directory which is not in tree */
+struct fat_found {
+  enum fat_found_type type;
+  enum fat_found_state state;
+  u_int64_t offset;
+  u_int32_t cluster;  /* cluster holding dentry (0: root region), or orphan */
+  u_int32_t parent;   /* ".." of orphan */
+  struct fat_dentry dentry;
+  struct fat_extent *extent;
+  u_int32_t nextent;
+};
+
+bool fat_stream_dirlike(const unsigned char *, size_t, bool);
+int fat_recover_runs(struct fat_volume *, struct fat_found *);
+int fat_recover(struct fat_volume *, struct fat_tree *, struct fat_output *, int);
+
+/**
+ * Fragmentation report
+ */
+#define FAT_FRAG_BUCKETS 32 /* free runs of 2^i .. 2^(i+1)-1 clusters */
+#define FAT_FRAG_HEAT 64    /* cells of allocation heat map */
+
+/* fragmentation of volume (also written as is in binary output) */
+struct fat_frag {
+  u_int64_t files;
+  u_int64_t fragmented;   /* files with more than one extent */
+  u_int64_t extents;
+  u_int32_t clusters;
+  u_int32_t free;
+  u_int32_t free_extents;
+  u_int32_t largest_free;
+  u_int32_t histogram[FAT_FRAG_BUCKETS];
+  u_int32_t heat_clusters; /* clusters per cell */
+  u_int8_t heat[FAT_FRAG_HEAT]; /* used clusters of each cell (%) */
+} __attribute__((packed));
+
+int fat_frag_report(struct fat_volume *, struct fat_tree *, struct fat_output *, int);
+
+/**
+ * FAT mirror check
+ */
+#define FAT_MIRROR_BLOCK 64          /* bytes compared at once (cache line) */
+#define FAT_MIRROR_CHUNK (4 << 20)   /* bytes of FAT compared by one task */
+#define FAT_MIRROR_COPIES 32         /* copies in bitmaps of struct fat_mirror */
+#define FAT_MIRROR_ROUNDS 8          /* passes to resolve ranges crossed by one chain */
+
+/* clusters whose entries differ among copies (also written as is in binary output) */
+struct fat_mirror {
+  u_int32_t first;
+  u_int32_t last;
+  u_int32_t differs;  /* copies which differ from first FAT (bit k: FAT k+1) */
+  u_int32_t matches;  /* copies consistent with chains crossing range */
+  u_int32_t chains;   /* chains crossing range */
+  u_int32_t reserved;
+} __attribute__((packed));
+
+/* summary of check (also written as is in binary output) */
+struct fat_mirrorstat {
+  u_int32_t copies;
+  u_int32_t ranges;
+  u_int64_t clusters; /* clusters in differing ranges */
+  u_int64_t bytes;    /* bytes compared of each copy */
+} __attribute__((packed));
+
+int fat_mirror_check(struct fat_volume *, struct fat_tree *, struct fat_output *, int);
+
+/**
+ * Consistency check
+ */
+enum fat_problem_kind {
+  PROBLEM_INVALID,      /* chain points out of data region (value: entry) */
+  PROBLEM_FREE,         /* cluster in chain is marked free */
+  PROBLEM_BAD,          /* cluster in chain is marked bad */
+  PROBLEM_LOOP,         /* chain comes back to itself */
+  PROBLEM_CROSSLINK,    /* cluster is in chain of another dentry */
+  PROBLEM_LENGTH,       /* chain does not match size (value: clusters) */
+  PROBLEM_DOT,          /* "." is missing or wrong (value: its cluster) */
+  PROBLEM_DOTDOT,       /* ".." is missing or wrong (value: its cluster) */
+  PROBLEM_LOST,         /* chain of no dentry (value: clusters) */
+  PROBLEM_MEDIA,        /* FAT[0] does not match media (value: entry) */
+  PROBLEM_FSINFO_FREE,  /* free count (cluster: counted, value: FSInfo) */
+  PROBLEM_FSINFO_NEXT,  /* next free hint is out of volume (value: hint) */
+};
+
+/* one problem (also written as is in binary output) */
+struct fat_problem {
+  u_int64_t offset;     /* dentry in image (0: none) */
+  u_int32_t kind;
+  u_int32_t cluster;
+  u_int32_t value;
+  u_int32_t reserved;
+} __attribute__((packed));
+
+/* result of check (also written as is in binary output) */
+struct fat_verify {
+  u_int64_t files;
+  u_int64_t dirs;
+  u_int64_t problems;
+  u_int32_t clusters;
+  u_int32_t free;
+  u_int32_t bad;
+  u_int32_t invalid;    /* FAT entries out of data region */
+  u_int32_t crosslinked;
+  u_int32_t lost_chains;
+  u_int32_t lost_clusters;
+  u_int32_t reserved;
+} __attribute__((packed));
+
+int fat_verify_volume(struct fat_volume *, struct fat_tree *, struct fat_output *);
+
+/**
+ * Hash of data
+ */
+struct fat_hash {
+  u_int64_t v[4];
+  u_int64_t seed;
+  u_int64_t total;
+  unsigned char buf[32];
+  size_t len;
+};
+
+void fat_hash_init(struct fat_hash *, u_int64_t);
+void fat_hash_update(struct fat_hash *, const void *, size_t);
+u_int64_t fat_hash_final(struct fat_hash *);
+u_int64_t fat_hash64(const void *, size_t, u_int64_t);
+
+/**
+ * Index cache of directory tree
+ */
+#define FAT_INDEX_MAGIC 0x58444946 /* "FIDX" */
+#define FAT_INDEX_VERSION 2
+#define FAT_INDEX_NONE 0xffffffff
+
+struct fat_index_header {
+  u_int32_t magic;
+  u_int16_t version;
+  u_int16_t node_size;
+  u_int64_t image_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  u_int64_t hash;
+  u_int32_t fstype;
+  u_int32_t fat12_count;
+  u_int64_t resv_offset;
+  u_int64_t fat12_offset;
+  u_int64_t node_offset;
+  u_int64_t node_count;
+  u_int64_t entries;
+  u_int64_t fathash_offset;
+  u_int64_t fathash_count;
+  u_int64_t dirhash_offset;
+  u_int64_t dirhash_count;
+} __attribute__((packed));
+
+/* children of a directory are stored contiguously, root is node 0 */
+struct fat_index_node {
+  struct fat_dentry dentry;
+  u_int64_t offset;
+  u_int32_t child;
+  u_int32_t nchild;
+} __attribute__((packed));
+
+struct fat_index_dirhash {
+  u_int32_t cluster;
+  u_int32_t reserved;
+  u_int64_t hash;
+} __attribute__((packed));
+
+struct fat_index {
+  void *map;
+  size_t size;
+  struct fat_index_header *hdr;
+  struct fat_index_node *node;
+  u_int64_t *fathash;
+  struct fat_index_dirhash *dirhash;
+};
+
+u_int64_t fat_volume_hash(struct fat_volume *);
+int fat_cluster_hash(struct fat_volume *, u_int32_t, u_int64_t *);
+char *fat_index_link(const char *, const char *, u_int64_t);
+int fat_index_open(struct fat_index *, const char *);
+void fat_index_close(struct fat_index *);
+bool fat_index_dirhash(struct fat_index *, u_int32_t, u_int64_t *);
+int fat_index_load(struct fat_volume *, const char *, struct fat_tree *);
+int fat_index_save(struct fat_volume *, const char *, struct fat_tree *,
+    const char *);
+
+/**
+ * Incremental rescan and diff of two volumes
+ */
+enum fat_change {
+  CHANGE_CREATED,
+  CHANGE_DELETED,
+  CHANGE_MODIFIED,
+};
+
+/* entry of directory, sorted by long or short name to match the other one */
+struct fat_delta_name {
+  const char *name;
+  size_t index;
+};
+
+bool fat_delta_entry_dirty(struct fat_volume *, const unsigned char *, u_int32_t);
+int fat_delta_names(struct fat_delta_name **, size_t *, struct fat_node *,
+    size_t);
+int fat_rescan(struct fat_volume *, struct fat_index *, struct fat_tree *,
+    struct fat_output *);
+int fat_diff(struct fat_volume *, struct fat_volume *, struct fat_output *);
+
+/**
+ * Output sink
+ */
+#define FAT_OUTPUT_BUFSIZE (1024 * 1024)
+
+enum fat_output_format {
+  FORMAT_TEXT,
+  FORMAT_JSON,
+  FORMAT_BINARY,
+};
+
+struct fat_output_ops {
+  void (*image)(struct fat_output *, const char *);
+  void (*volume)(struct fat_output *, struct fat_volume *);
+  void (*dir)(struct fat_output *, const char *, struct fat_node *);
+  void (*dentry)(struct fat_output *, const char *, struct fat_node *,
+      struct fat_node *);
+  void (*delta)(struct fat_output *, enum fat_change, const char *,
+      struct fat_node *, struct fat_node *);
+  void (*digest)(struct fat_output *, const char *, struct fat_node *,
+      u_int64_t);
+  void (*found)(struct fat_output *, struct fat_found *);
+  void (*frag)(struct fat_output *, const char *, struct fat_node *,
+      u_int32_t, u_int32_t);
+  void (*fragstat)(struct fat_output *, struct fat_frag *);
+  void (*mirror)(struct fat_output *, struct fat_mirror *);
+  void (*mirrorstat)(struct fat_output *, struct fat_mirrorstat *);
+  void (*problem)(struct fat_output *, const char *, struct fat_problem *);
+  void (*verifystat)(struct fat_output *, struct fat_verify *);
+};
+
+struct fat_output {
+  FILE *fp;
+  const struct fat_output_ops *ops;
+};
+
+/* binary output: header, and then one record per dentry */
+#define FAT_BINARY_MAGIC 0x52544146 /* "FATR" */
+#define FAT_BINARY_VERSION 1
+
+struct fat_binary_header {
+  u_int32_t magic;
+  u_int16_t version;
+  u_int16_t record_size;
+  u_int32_t fstype;
+  u_int32_t bytes_per_sector;
+  u_int32_t cluster_size;
+  u_int32_t clusters;
+  u_int32_t root_cluster;
+  u_int32_t reserved;
+  u_int64_t data_offset;
+} __attribute__((packed));
+
+struct fat_binary_record {
+  u_int64_t offset;
+  u_int64_t parent;
+  u_int32_t cluster;
+  u_int32_t size;
+  u_int16_t crt_time;
+  u_int16_t crt_date;
+  u_int16_t acc_date;
+  u_int16_t wrt_time;
+  u_int16_t wrt_date;
+  u_int8_t attr;
+  u_int8_t crt_tenth;
+  unsigned char name[NameSIZE];
+  unsigned char change; /* '+', '-' or 'M' in delta, 'D' or 'O' in recovery */
+  unsigned char reserved[4];
+} __attribute__((packed));
+
+/* binary output of --frag: one record per file, and then struct fat_frag */
+struct fat_binary_frag {
+  u_int64_t offset;
+  u_int32_t extents;
+  u_int32_t clusters;
+} __attribute__((packed));
+
+/* binary output of --hash: one record per file, without header */
+struct fat_binary_digest {
+  u_int64_t offset;
+  u_int64_t digest;
+  u_int32_t size;
+  u_int32_t reserved;
+} __attribute__((packed));
+
+int fat_output_format(const char *);
+void fat_output_open(struct fat_output *, FILE *, enum fat_output_format);
+int fat_output_close(struct fat_output *);
+
+/**
+ * FAT common structure
+ */
+bool check_dentryfree(const unsigned char *);
+char *fat_format_shortname(struct fat_dentry *, char *);
+void fat_dump_reservedinfo(struct fat_reserved_info *, FILE *);
+int fat_load_reservedinfo(struct fat_reserved_info *, unsigned char *);
+bool fat_probe_bpb(unsigned char *);
+void fat_dateformat(struct tm *, u_int16_t);
+void fat_timeformat(struct tm *, u_int16_t);
+int fat_attrformat(unsigned char *, unsigned char);
+int fat_load_dentry(struct fat_dentry *, const void *);
+
 /**
  * FAT12 structure
  */
 void fat12_dump_reservedinfo(struct fat_reserved_info *, FILE *);
 int fat12_load_reservedinfo(struct fat_reserved_info *, unsigned char *, size_t);
+void fat12_unpack(const unsigned char *, size_t, u_int16_t *, size_t);
+int fat12_load_fattable(struct fat_volume *);
+
+/**
+ * fat12_get_entry - get FAT12 entry.
+ * @vol:  FAT volume
+ * @clus: cluster number
+ *
+ * Two 12-bit entries are packed into three bytes, unless FAT is expanded
+ * by fat12_load_fattable().
+ */
+static inline u_int32_t fat12_get_entry(struct fat_volume *vol, u_int32_t clus)
+{
+  size_t offset = clus + clus / 2;
+  u_int16_t entry;
+
+  if (vol->fat12)
+    return vol->fat12[clus];
+
+  entry = vol->fat[offset] | (vol->fat[offset + 1] << 8);
+  if (clus & 1)
+    return entry >> 4;
+  return entry & 0x0fff;
+}
 
 /**
  * FAT16 structure
  */
-void fat16_dump_fattable(void *);
-int fat16_load_fattable(void *);
+bool fat16_check_fattable(struct fat_volume *);
+size_t fat16_count_fattable(struct fat_volume *, u_int32_t, size_t, struct fat_stat *);
+void fat16_dump_fattable(struct fat_volume *, struct fat_stat *, FILE *);
+
+/**
+ * fat16_get_entry - get FAT16 entry.
+ * @vol:  FAT volume
+ * @clus: cluster number
+ */
+static inline u_int32_t fat16_get_entry(struct fat_volume *vol, u_int32_t clus)
+{
+  u_int16_t entry;
+
+  memcpy(&entry, vol->fat + (size_t)clus * sizeof(entry), sizeof(entry));
+  return entry;
+}
 
 /**
  * FAT32 structure
@@ -314,4 +1201,22 @@ int fat32_load_reservedinfo(struct fat_reserved_info *, unsigned char *, size_t)
 void fat32_dump_fsinfo(struct fat32_fsinfo *, FILE *);
 int fat32_load_fsinfo(struct fat32_fsinfo *, unsigned char *);
 
+/**
+ * fat32_get_entry - get FAT32 entry.
+ * @vol:  FAT volume
+ * @clus: cluster number
+ *
+ * Upper 4 bits are reserved, and ignored.
+ */
+static inline u_int32_t fat32_get_entry(struct fat_volume *vol, u_int32_t clus)
+{
+  u_int32_t entry;
+
+  memcpy(&entry, vol->fat + (size_t)clus * sizeof(entry), sizeof(entry));
+  return entry & FAT32_ENTRYMASK;
+}
+bool fat32_check_fattable(struct fat_volume *);
+size_t fat32_count_fattable(struct fat_volume *, u_int32_t, size_t, struct fat_stat *);
+void fat32_dump_fattable(struct fat_volume *, struct fat_stat *, FILE *);
+
 #endif /*_FAT12_H */
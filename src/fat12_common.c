@@ -34,14 +34,19 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT12_SIMD 1
+#endif
 
 #include "fat.h"
 
 void fat12_dump_reservedinfo(struct fat_reserved_info *info, FILE *out)
 {
-  unsigned char ret[RESVAREA_SIZE + 1] = {0};
+  unsigned char ret[2 * RESVAREA_SIZE + 1];
   struct fat12_reserved_info *fat12_info = (struct fat12_reserved_info *)(info->reserved1);
 
   fprintf(out, "%-28s\t: %x\n", _("BootStrap"), fat12_info->BS_DrvNum);
@@ -69,3 +74,116 @@ int fat12_load_reservedinfo(struct fat_reserved_info *info, unsigned char *buf,
 
   return offset;
 }
+
+/**
+ * fat12_unpack_scalar - expand 12-bit entries to 16-bit array.
+ * @src: FAT12 table
+ * @dst: output array
+ * @i:   first entry to expand (must be even)
+ * @n:   count of entries in @dst
+ */
+static void fat12_unpack_scalar(const unsigned char *src, u_int16_t *dst,
+    size_t i, size_t n)
+{
+  const unsigned char *p;
+
+  for (; i + 1 < n; i += 2) {
+    p = src + i / 2 * 3;
+    dst[i] = p[0] | ((p[1] & 0x0f) << 8);
+    dst[i + 1] = (p[1] >> 4) | (p[2] << 4);
+  }
+  if (i < n) {
+    p = src + i / 2 * 3;
+    dst[i] = p[0] | ((p[1] & 0x0f) << 8);
+  }
+}
+
+#ifdef FAT12_SIMD
+/*
+ * Every 16-bit lane gets the two bytes which hold its entry:
+ * even lane (3k, 3k+1) is masked, odd lane (3k+1, 3k+2) is shifted.
+ */
+#define FAT12_SHUFFLE 11, 10, 10, 9, 8, 7, 7, 6, 5, 4, 4, 3, 2, 1, 1, 0
+#define FAT12_LANEMASK 0x0fff, 0, 0x0fff, 0, 0x0fff, 0, 0x0fff, 0
+
+__attribute__((target("ssse3")))
+static size_t fat12_unpack_ssse3(const unsigned char *src, size_t len,
+    u_int16_t *dst, size_t n)
+{
+  size_t i;
+  __m128i x;
+  const __m128i shuf = _mm_set_epi8(FAT12_SHUFFLE);
+  const __m128i odd = _mm_set_epi16(FAT12_LANEMASK);
+  const __m128i low = _mm_set1_epi16(0x0fff);
+
+  for (i = 0; i + 8 <= n && i / 2 * 3 + 16 <= len; i += 8) {
+    x = _mm_loadu_si128((const __m128i *)(src + i / 2 * 3));
+    x = _mm_shuffle_epi8(x, shuf);
+    x = _mm_or_si128(_mm_andnot_si128(odd, _mm_and_si128(x, low)),
+        _mm_and_si128(odd, _mm_srli_epi16(x, 4)));
+    _mm_storeu_si128((__m128i *)(dst + i), x);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t fat12_unpack_avx2(const unsigned char *src, size_t len,
+    u_int16_t *dst, size_t n)
+{
+  size_t i;
+  __m256i x;
+  const __m256i shuf = _mm256_set_epi8(FAT12_SHUFFLE, FAT12_SHUFFLE);
+  const __m256i odd = _mm256_set_epi16(FAT12_LANEMASK, FAT12_LANEMASK);
+  const __m256i low = _mm256_set1_epi16(0x0fff);
+
+  /* pshufb does not cross 128-bit lanes, so each lane loads 12 bytes */
+  for (i = 0; i + 16 <= n && i / 2 * 3 + 28 <= len; i += 16) {
+    x = _mm256_inserti128_si256(_mm256_castsi128_si256(
+          _mm_loadu_si128((const __m128i *)(src + i / 2 * 3))),
+        _mm_loadu_si128((const __m128i *)(src + i / 2 * 3 + 12)), 1);
+    x = _mm256_shuffle_epi8(x, shuf);
+    x = _mm256_or_si256(_mm256_andnot_si256(odd, _mm256_and_si256(x, low)),
+        _mm256_and_si256(odd, _mm256_srli_epi16(x, 4)));
+    _mm256_storeu_si256((__m256i *)(dst + i), x);
+  }
+  return i;
+}
+#endif
+
+/**
+ * fat12_unpack - expand FAT12 table to 16-bit array.
+ * @src: FAT12 table
+ * @len: byte length of @src
+ * @dst: output array
+ * @n:   count of entries to expand (@src must hold them)
+ *
+ * Use AVX2 or SSSE3 when CPU supports, and scalar code for the rest.
+ */
+void fat12_unpack(const unsigned char *src, size_t len, u_int16_t *dst, size_t n)
+{
+  size_t i = 0;
+
+#ifdef FAT12_SIMD
+  if (__builtin_cpu_supports("avx2"))
+    i = fat12_unpack_avx2(src, len, dst, n);
+  else if (__builtin_cpu_supports("ssse3"))
+    i = fat12_unpack_ssse3(src, len, dst, n);
+#endif
+  fat12_unpack_scalar(src, dst, i, n);
+}
+
+/**
+ * fat12_load_fattable - expand first FAT of volume.
+ * @vol: FAT volume (FAT is already loaded)
+ *
+ * After that, fat12_get_entry() is plain array indexing.
+ */
+int fat12_load_fattable(struct fat_volume *vol)
+{
+  size_t n = (size_t)vol->CountofClusters + 2;
+
+  if (!(vol->fat12 = malloc(n * sizeof(*(vol->fat12)))))
+    return -ENOMEM;
+  fat12_unpack(vol->fat, vol->geo.fat_size, vol->fat12, n);
+  return 0;
+}
@@ -36,19 +36,98 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT16_SIMD 1
+#endif
 
 #include "fat.h"
 
-int fat16_check_fattable(void *area)
+/**
+ * fat16_check_fattable - check reserved entries of FAT16 table.
+ * @vol: FAT volume
+ *
+ * FAT[0] holds media type in low byte. FAT[1] is not checked, because
+ * its upper bits are used as dirty flags.
+ */
+bool fat16_check_fattable(struct fat_volume *vol)
 {
-  return 0;
+  return fat16_get_entry(vol, 0) == (0xff00 | vol->resv.BPB_Media);
 }
 
-void fat16_dump_fattable(void *area)
+#ifdef FAT16_SIMD
+__attribute__((target("avx2")))
+static size_t fat16_count_avx2(const unsigned char *fat, size_t n,
+    struct fat_stat *st)
 {
+  size_t i;
+  u_int32_t sum[8];
+  __m256i x, acc_free, acc_bad, acc_eoc, acc_rsv;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi16(1);
+  const __m256i bad = _mm256_set1_epi16((short)FAT16_BADCLUSTER);
+  const __m256i eoc = _mm256_set1_epi16((short)FAT16_DATAEND);
+  const __m256i rsvlo = _mm256_set1_epi16((short)FAT16_RSVDSTART);
+  const __m256i rsvhi = _mm256_set1_epi16((short)(FAT16_BADCLUSTER - 1));
+
+  acc_free = acc_bad = acc_eoc = acc_rsv = zero;
+  /* at most 4096 loops, so 16-bit lanes never overflow */
+  for (i = 0; i + 16 <= n; i += 16) {
+    x = _mm256_loadu_si256((const __m256i *)(fat + i * 2));
+    acc_free = _mm256_sub_epi16(acc_free, _mm256_cmpeq_epi16(x, zero));
+    acc_bad = _mm256_sub_epi16(acc_bad, _mm256_cmpeq_epi16(x, bad));
+    acc_eoc = _mm256_sub_epi16(acc_eoc,
+        _mm256_cmpeq_epi16(_mm256_max_epu16(x, eoc), x));
+    acc_rsv = _mm256_sub_epi16(acc_rsv, _mm256_or_si256(_mm256_cmpeq_epi16(x, one),
+          _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_max_epu16(x, rsvlo), x),
+            _mm256_cmpeq_epi16(_mm256_min_epu16(x, rsvhi), x))));
+  }
+
+#define FAT16_HSUM(acc, field)                                   \
+  do {                                                           \
+    int k;                                                       \
+    _mm256_storeu_si256((__m256i *)sum, _mm256_madd_epi16(acc, one)); \
+    for (k = 0; k < 8; k++)                                      \
+      st->field += sum[k];                                       \
+  } while (0)
+
+  FAT16_HSUM(acc_free, free);
+  FAT16_HSUM(acc_bad, bad);
+  FAT16_HSUM(acc_eoc, eoc);
+  FAT16_HSUM(acc_rsv, reserved);
+#undef FAT16_HSUM
+  return i;
 }
+#endif
 
-int fat16_load_fattable(void *area)
+/**
+ * fat16_count_fattable - count free, bad, reserved and end of chain entries.
+ * @vol:   FAT volume
+ * @first: first cluster to count
+ * @n:     count of entries
+ * @st:    statistics to add to
+ *
+ * Return: count of entries which are counted (the rest is left for caller)
+ */
+size_t fat16_count_fattable(struct fat_volume *vol, u_int32_t first, size_t n,
+    struct fat_stat *st)
 {
+#ifdef FAT16_SIMD
+  if (__builtin_cpu_supports("avx2"))
+    return fat16_count_avx2(vol->fat + (size_t)first * 2, n, st);
+#endif
   return 0;
 }
+
+/**
+ * fat16_dump_fattable - print out allocation statistics of FAT16 table.
+ * @vol: FAT volume
+ * @st:  statistics of table
+ * @out: output stream
+ */
+void fat16_dump_fattable(struct fat_volume *vol, struct fat_stat *st, FILE *out)
+{
+  fprintf(out, "%-28s\t: %s\n", _("Reserved FAT entries"),
+      fat16_check_fattable(vol) ? _("valid") : _("invalid"));
+  fat_dump_fatstat(st, out);
+}
@@ -36,6 +36,10 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT32_SIMD 1
+#endif
 
 #include "fat.h"
 
@@ -46,7 +50,7 @@ bool is_fat32format(struct fat_reserved_info *info)
 
 void fat32_dump_reservedinfo(struct fat_reserved_info *info, FILE *out)
 {
-  unsigned char ret[RESVAREA_SIZE + 1] = {0};
+  unsigned char ret[2 * RESVAREA_SIZE + 1];
   struct fat32_reserved_info *fat32_info = (struct fat32_reserved_info *)(info->reserved1);
 
   fprintf(out, "%-28s\t: %x\n", _("Sectors Per FAT table"), fat32_info->BPB_FATSz32);
@@ -92,7 +96,7 @@ int fat32_load_reservedinfo(struct fat_reserved_info *info, unsigned char *buf,
 
 void fat32_dump_fsinfo(struct fat32_fsinfo *info, FILE *out)
 {
-  unsigned char ret[RESVAREA_SIZE + 1] = {0};
+  unsigned char ret[2 * RESVAREA_SIZE + 1];
 
   fprintf(out, "\n%s\n", _("FSINFO"));
 
@@ -118,3 +122,101 @@ int fat32_load_fsinfo(struct fat32_fsinfo *info, unsigned char *buf)
 
   return offset;
 }
+
+/**
+ * fat32_check_fattable - check reserved entries of FAT32 table.
+ * @vol: FAT volume
+ *
+ * FAT[0] holds media type in low byte. FAT[1] is not checked, because
+ * its upper bits are used as dirty flags.
+ */
+bool fat32_check_fattable(struct fat_volume *vol)
+{
+  return fat32_get_entry(vol, 0) == (0x0fffff00 | vol->resv.BPB_Media);
+}
+
+#ifdef FAT32_SIMD
+__attribute__((target("avx2")))
+static size_t fat32_count_avx2(const unsigned char *fat, size_t n,
+    struct fat_stat *st)
+{
+  size_t i;
+  u_int32_t sum[8];
+  __m256i x, acc_free, acc_bad, acc_eoc, acc_rsv;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i mask = _mm256_set1_epi32(FAT32_ENTRYMASK);
+  const __m256i bad = _mm256_set1_epi32(FAT32_BADCLUSTER & FAT32_ENTRYMASK);
+  const __m256i eoc = _mm256_set1_epi32(FAT32_DATAEND & FAT32_ENTRYMASK);
+  const __m256i rsvlo = _mm256_set1_epi32(FAT32_RSVDSTART & FAT32_ENTRYMASK);
+  const __m256i rsvhi = _mm256_set1_epi32((FAT32_BADCLUSTER & FAT32_ENTRYMASK) - 1);
+
+  acc_free = acc_bad = acc_eoc = acc_rsv = zero;
+  for (i = 0; i + 8 <= n; i += 8) {
+    x = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(fat + i * 4)), mask);
+    acc_free = _mm256_sub_epi32(acc_free, _mm256_cmpeq_epi32(x, zero));
+    acc_bad = _mm256_sub_epi32(acc_bad, _mm256_cmpeq_epi32(x, bad));
+    acc_eoc = _mm256_sub_epi32(acc_eoc,
+        _mm256_cmpeq_epi32(_mm256_max_epu32(x, eoc), x));
+    acc_rsv = _mm256_sub_epi32(acc_rsv, _mm256_or_si256(_mm256_cmpeq_epi32(x, one),
+          _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(x, rsvlo), x),
+            _mm256_cmpeq_epi32(_mm256_min_epu32(x, rsvhi), x))));
+  }
+
+#define FAT32_HSUM(acc, field)                                   \
+  do {                                                           \
+    int k;                                                       \
+    _mm256_storeu_si256((__m256i *)sum, acc);                    \
+    for (k = 0; k < 8; k++)                                      \
+      st->field += sum[k];                                       \
+  } while (0)
+
+  FAT32_HSUM(acc_free, free);
+  FAT32_HSUM(acc_bad, bad);
+  FAT32_HSUM(acc_eoc, eoc);
+  FAT32_HSUM(acc_rsv, reserved);
+#undef FAT32_HSUM
+  return i;
+}
+#endif
+
+/**
+ * fat32_count_fattable - count free, bad, reserved and end of chain entries.
+ * @vol:   FAT volume
+ * @first: first cluster to count
+ * @n:     count of entries
+ * @st:    statistics to add to
+ *
+ * Return: count of entries which are counted (the rest is left for caller)
+ */
+size_t fat32_count_fattable(struct fat_volume *vol, u_int32_t first, size_t n,
+    struct fat_stat *st)
+{
+#ifdef FAT32_SIMD
+  if (__builtin_cpu_supports("avx2"))
+    return fat32_count_avx2(vol->fat + (size_t)first * 4, n, st);
+#endif
+  return 0;
+}
+
+/**
+ * fat32_dump_fattable - print out allocation statistics of FAT32 table.
+ * @vol: FAT volume
+ * @st:  statistics of table
+ * @out: output stream
+ *
+ * Free cluster count in FSINFO is only a hint, so compare it.
+ */
+void fat32_dump_fattable(struct fat_volume *vol, struct fat_stat *st, FILE *out)
+{
+  u_int32_t hint = vol->fsinfo.FSI_Free_Count;
+
+  fprintf(out, "%-28s\t: %s\n", _("Reserved FAT entries"),
+      fat32_check_fattable(vol) ? _("valid") : _("invalid"));
+  fat_dump_fatstat(st, out);
+  if (hint == 0xffffffff)
+    fprintf(out, "%-28s\t: %s\n", _("FSINFO free count"), _("unknown"));
+  else
+    fprintf(out, "%-28s\t: %u (%s)\n", _("FSINFO free count"), hint,
+        hint == st->free ? _("match") : _("mismatch"));
+}
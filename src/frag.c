@@ -0,0 +1,352 @@
+/*
+ * frag.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/**
+ * Cell of heat map, scanned by one task
+ */
+struct fat_frag_cell {
+  u_int32_t first;
+  u_int32_t count;
+  u_int32_t used;
+  u_int32_t head;     /* free run touching start of cell */
+  u_int32_t tail;     /* free run touching end of cell */
+  u_int32_t runs;     /* free runs inside of cell */
+  u_int32_t largest;
+  u_int32_t histogram[FAT_FRAG_BUCKETS];
+};
+
+/**
+ * State of fragmentation report
+ */
+struct fat_frag_state {
+  struct fat_volume *vol;
+  u_int64_t *brk;     /* bit (cluster - 2): chain does not go on to next cluster */
+  struct fat_frag_cell cell[FAT_FRAG_HEAT];
+  struct fat_output *out;
+  struct fat_frag *frag;
+  int err;            /* -EIO if some chains are broken */
+};
+
+/**
+ * fat_frag_bucket - get histogram bucket of free run.
+ * @len: length of free run (not 0)
+ */
+static inline int fat_frag_bucket(u_int32_t len)
+{
+  return 31 - __builtin_clz(len);
+}
+
+/**
+ * fat_frag_scan - scan FAT entries of one cell.
+ * @pool:   thread pool
+ * @worker: index of worker
+ * @arg:    cell to scan
+ *
+ * Counts used clusters and free runs, and marks the end of every
+ * contiguous extent in break bitmap. Cells are aligned on 64 clusters,
+ * so that each word of the bitmap is written by one task only, and
+ * entries are decoded a word at a time.
+ */
+static void fat_frag_scan(struct fat_pool *pool, int worker, void *arg)
+{
+  struct fat_frag_state *s = pool->data;
+  struct fat_frag_cell *c = arg;
+  struct fat_volume *vol = s->vol;
+  u_int32_t buf[64];
+  u_int32_t clus, entry, i, n, run = 0;
+  u_int32_t last = vol->CountofClusters + 1;
+  u_int32_t end = c->first + c->count;
+  u_int64_t word;
+  bool head = true;
+
+  for (clus = c->first; clus < end; clus += n) {
+    n = end - clus < 64 ? end - clus : 64;
+    fat_get_entries(vol, clus, n, buf);
+    word = 0;
+    for (i = 0; i < n; i++) {
+      entry = buf[i];
+      if (entry != clus + i + 1 || clus + i == last)
+        word |= 1ULL << i;
+      if (!entry) {
+        run++;
+        continue;
+      }
+      c->used++;
+      if (head) {
+        c->head = run;
+        head = false;
+      } else if (run) {
+        c->runs++;
+        c->histogram[fat_frag_bucket(run)]++;
+        if (run > c->largest)
+          c->largest = run;
+      }
+      run = 0;
+    }
+    s->brk[(clus - 2) / 64] = word;
+  }
+  if (head)
+    c->head = run;
+  else
+    c->tail = run;
+}
+
+/**
+ * fat_frag_next_break - find end of extent.
+ * @s:    state of report
+ * @clus: cluster in extent
+ *
+ * Return: last cluster of extent which includes @clus
+ */
+static u_int32_t fat_frag_next_break(struct fat_frag_state *s, u_int32_t clus)
+{
+  u_int32_t i = (clus - 2) / 64;
+  u_int64_t word = s->brk[i] & (~0ULL << ((clus - 2) % 64));
+
+  /* last cluster of volume is always marked */
+  while (!word)
+    word = s->brk[++i];
+  return 2 + i * 64 + __builtin_ctzll(word);
+}
+
+/**
+ * fat_frag_chain - count extents of cluster chain.
+ * @s:        state of report
+ * @clus:     first cluster
+ * @extents:  (out) count of extents
+ * @clusters: (out) count of clusters
+ *
+ * Chain is followed from extent to extent by break bitmap, instead of
+ * cluster by cluster.
+ *
+ * Return: 0 - success
+ *         -EINVAL - chain has invalid cluster
+ *         -ELOOP - chain has loop
+ */
+static int fat_frag_chain(struct fat_frag_state *s, u_int32_t clus,
+    u_int32_t *extents, u_int32_t *clusters)
+{
+  struct fat_volume *vol = s->vol;
+  u_int32_t end, next;
+  u_int32_t count = 0, power = 1, mark = 0;
+
+  *extents = 0;
+  *clusters = 0;
+  if (!clus)
+    return 0;
+  while (true) {
+    if (!fat_valid_cluster(vol, clus))
+      return -EINVAL;
+    if (clus == mark)
+      return -ELOOP;
+    if (++count == power) {
+      mark = clus;
+      power *= 2;
+    }
+    end = fat_frag_next_break(s, clus);
+    (*extents)++;
+    *clusters += end - clus + 1;
+    next = fat_get_entry(vol, end);
+    if (fat_is_eoc(vol, next))
+      return 0;
+    clus = next;
+  }
+}
+
+/**
+ * fat_frag_file - report extents of one file.
+ * @path: path of file
+ * @dir:  parent directory node
+ * @node: dentry node of file
+ * @arg:  state of report
+ *
+ * Broken chain is printed out to stderr, and the walk goes on.
+ */
+static int fat_frag_file(const char *path, struct fat_node *dir,
+    struct fat_node *node, void *arg)
+{
+  int ret;
+  u_int32_t extents, clusters;
+  struct fat_frag_state *s = arg;
+
+  ret = fat_frag_chain(s, fat_dentry_cluster(s->vol, &(node->dentry)),
+      &extents, &clusters);
+  if (ret < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+    s->err = -EIO;
+    return 0;
+  }
+  s->out->ops->frag(s->out, path, node, extents, clusters);
+  s->frag->files++;
+  s->frag->extents += extents;
+  if (extents > 1)
+    s->frag->fragmented++;
+  return 0;
+}
+
+/**
+ * fat_frag_files - report extents of every file.
+ * @s:    state of report
+ * @tree: directory tree
+ * @out:  output sink
+ * @frag: fragmentation of volume to add to
+ *
+ * Files are printed in order of directory walk, as in fat_dump_tree().
+ *
+ * Return: 0 - success
+ *         -EIO - some chains are broken
+ *         -ENOMEM - out of memory
+ */
+static int fat_frag_files(struct fat_frag_state *s, struct fat_tree *tree,
+    struct fat_output *out, struct fat_frag *frag)
+{
+  int err;
+
+  s->out = out;
+  s->frag = frag;
+  s->err = 0;
+  if ((err = fat_tree_foreach_path(tree, fat_frag_file, s)) < 0)
+    return err;
+  return s->err;
+}
+
+/**
+ * fat_frag_report - report fragmentation of files and free space.
+ * @vol:  FAT volume
+ * @tree: directory tree
+ * @out:  output sink
+ * @jobs: count of threads
+ *
+ * FAT is scanned once, split into FAT_FRAG_HEAT cells on thread pool.
+ * The scan gives free space histogram and heat map, and a bitmap of
+ * extent ends, with which extents of each file are counted without
+ * following chains cluster by cluster.
+ *
+ * Return: 0 - success
+ *         -EIO - some chains are broken
+ *         negative - error (errno)
+ */
+int fat_frag_report(struct fat_volume *vol, struct fat_tree *tree,
+    struct fat_output *out, int jobs)
+{
+  int err = 0;
+  int i, j;
+  u_int32_t size, run = 0;
+  u_int32_t n = vol->CountofClusters;
+  struct fat_pool pool;
+  struct fat_frag frag = {0};
+  struct fat_frag_state *s;
+  struct fat_frag_cell *c;
+
+  if (!(s = calloc(1, sizeof(*s))))
+    return -ENOMEM;
+  s->vol = vol;
+  if (!(s->brk = malloc(((size_t)n / 64 + 1) * sizeof(u_int64_t)))) {
+    err = -ENOMEM;
+    goto out;
+  }
+
+  /* cells of whole words of bitmap */
+  size = ((n + FAT_FRAG_HEAT - 1) / FAT_FRAG_HEAT + 63) & ~63U;
+  for (i = 0; i < FAT_FRAG_HEAT; i++) {
+    c = &(s->cell[i]);
+    c->first = 2 + i * size;
+    if ((u_int64_t)i * size < n)
+      c->count = n - i * size < size ? n - i * size : size;
+  }
+
+  if (jobs > 1 && n > FAT_FRAG_HEAT * 1024 && !fat_pool_init(&pool, jobs)) {
+    pool.data = s;
+    for (i = 0; i < FAT_FRAG_HEAT; i++) {
+      if (!s->cell[i].count)
+        break;
+      if ((err = fat_pool_submit(&pool, -1, fat_frag_scan, &(s->cell[i]))) < 0)
+        break;
+    }
+    fat_pool_wait(&pool);
+    fat_pool_destroy(&pool);
+    if (err < 0)
+      goto out;
+  } else {
+    pool.data = s;
+    for (i = 0; i < FAT_FRAG_HEAT && s->cell[i].count; i++)
+      fat_frag_scan(&pool, 0, &(s->cell[i]));
+  }
+
+  /* join free runs across cells */
+  frag.clusters = n;
+  frag.heat_clusters = size;
+  for (i = 0; i < FAT_FRAG_HEAT; i++) {
+    c = &(s->cell[i]);
+    if (!c->count)
+      break;
+    frag.free += c->count - c->used;
+    frag.heat[i] = ((u_int64_t)c->used * 100 + c->count - 1) / c->count;
+    if (c->head == c->count) {
+      run += c->count;
+      continue;
+    }
+    run += c->head;
+    if (run) {
+      frag.free_extents++;
+      frag.histogram[fat_frag_bucket(run)]++;
+      if (run > frag.largest_free)
+        frag.largest_free = run;
+    }
+    frag.free_extents += c->runs;
+    for (j = 0; j < FAT_FRAG_BUCKETS; j++)
+      frag.histogram[j] += c->histogram[j];
+    if (c->largest > frag.largest_free)
+      frag.largest_free = c->largest;
+    run = c->tail;
+  }
+  if (run) {
+    frag.free_extents++;
+    frag.histogram[fat_frag_bucket(run)]++;
+    if (run > frag.largest_free)
+      frag.largest_free = run;
+  }
+
+  err = fat_frag_files(s, tree, out, &frag);
+  out->ops->fragstat(out, &frag);
+out:
+  free(s->brk);
+  free(s);
+  return err;
+}
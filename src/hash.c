@@ -0,0 +1,197 @@
+/*
+ * hash.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/**
+ * 64-bit hash of XXH64 algorithm (little endian host)
+ */
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3 0x165667b19e3779f9ULL
+#define PRIME64_4 0x85ebca77c2b2ae63ULL
+#define PRIME64_5 0x27d4eb2f165667c5ULL
+
+static inline u_int64_t fat_rotl64(u_int64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline u_int64_t fat_read64(const unsigned char *p)
+{
+  u_int64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline u_int32_t fat_read32(const unsigned char *p)
+{
+  u_int32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline u_int64_t fat_hash_round(u_int64_t acc, u_int64_t input)
+{
+  acc += input * PRIME64_2;
+  acc = fat_rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline u_int64_t fat_hash_merge(u_int64_t acc, u_int64_t val)
+{
+  acc ^= fat_hash_round(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+/**
+ * fat_hash_init - start hash.
+ * @h:    hash state
+ * @seed: seed
+ */
+void fat_hash_init(struct fat_hash *h, u_int64_t seed)
+{
+  h->v[0] = seed + PRIME64_1 + PRIME64_2;
+  h->v[1] = seed + PRIME64_2;
+  h->v[2] = seed;
+  h->v[3] = seed - PRIME64_1;
+  h->seed = seed;
+  h->total = 0;
+  h->len = 0;
+}
+
+/**
+ * fat_hash_update - feed data to hash.
+ * @h:   hash state
+ * @buf: data
+ * @len: length of @buf
+ */
+void fat_hash_update(struct fat_hash *h, const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+  const unsigned char *end = p + len;
+  size_t fill;
+
+  h->total += len;
+  if (h->len) {
+    fill = sizeof(h->buf) - h->len;
+    if (len < fill) {
+      memcpy(h->buf + h->len, p, len);
+      h->len += len;
+      return;
+    }
+    memcpy(h->buf + h->len, p, fill);
+    p += fill;
+    h->v[0] = fat_hash_round(h->v[0], fat_read64(h->buf));
+    h->v[1] = fat_hash_round(h->v[1], fat_read64(h->buf + 8));
+    h->v[2] = fat_hash_round(h->v[2], fat_read64(h->buf + 16));
+    h->v[3] = fat_hash_round(h->v[3], fat_read64(h->buf + 24));
+    h->len = 0;
+  }
+  for (; p + 32 <= end; p += 32) {
+    h->v[0] = fat_hash_round(h->v[0], fat_read64(p));
+    h->v[1] = fat_hash_round(h->v[1], fat_read64(p + 8));
+    h->v[2] = fat_hash_round(h->v[2], fat_read64(p + 16));
+    h->v[3] = fat_hash_round(h->v[3], fat_read64(p + 24));
+  }
+  if (p < end) {
+    memcpy(h->buf, p, end - p);
+    h->len = end - p;
+  }
+}
+
+/**
+ * fat_hash_final - get digest of hash.
+ * @h: hash state
+ *
+ * Return: 64-bit digest
+ */
+u_int64_t fat_hash_final(struct fat_hash *h)
+{
+  u_int64_t acc;
+  const unsigned char *p = h->buf;
+  const unsigned char *end = p + h->len;
+
+  if (h->total >= 32) {
+    acc = fat_rotl64(h->v[0], 1) + fat_rotl64(h->v[1], 7)
+      + fat_rotl64(h->v[2], 12) + fat_rotl64(h->v[3], 18);
+    acc = fat_hash_merge(acc, h->v[0]);
+    acc = fat_hash_merge(acc, h->v[1]);
+    acc = fat_hash_merge(acc, h->v[2]);
+    acc = fat_hash_merge(acc, h->v[3]);
+  } else {
+    acc = h->seed + PRIME64_5;
+  }
+  acc += h->total;
+
+  for (; p + 8 <= end; p += 8) {
+    acc ^= fat_hash_round(0, fat_read64(p));
+    acc = fat_rotl64(acc, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    acc ^= (u_int64_t)fat_read32(p) * PRIME64_1;
+    acc = fat_rotl64(acc, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    acc ^= *p * PRIME64_5;
+    acc = fat_rotl64(acc, 11) * PRIME64_1;
+  }
+
+  acc ^= acc >> 33;
+  acc *= PRIME64_2;
+  acc ^= acc >> 29;
+  acc *= PRIME64_3;
+  acc ^= acc >> 32;
+  return acc;
+}
+
+/**
+ * fat_hash64 - get hash of buffer.
+ * @buf:  data
+ * @len:  length of @buf
+ * @seed: seed
+ *
+ * Return: 64-bit digest
+ */
+u_int64_t fat_hash64(const void *buf, size_t len, u_int64_t seed)
+{
+  struct fat_hash h;
+
+  fat_hash_init(&h, seed);
+  fat_hash_update(&h, buf, len);
+  return fat_hash_final(&h);
+}
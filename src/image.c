@@ -0,0 +1,323 @@
+/*
+ * image.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "fat.h"
+
+/**
+ * fat_image_size - get size of image.
+ * @fd: opened image
+ * @st: stat of @fd
+ *
+ * Block devices report st_size as 0, so ask the end of file instead.
+ */
+static off_t fat_image_size(int fd, struct stat *st)
+{
+  if (S_ISREG(st->st_mode))
+    return st->st_size;
+  return lseek(fd, 0, SEEK_END);
+}
+
+/**
+ * fat_image_open - open image and map it to memory.
+ * @img:  image to initialize
+ * @path: image file path
+ *
+ * Regular files and block devices are mapped read-only. If mapping is not
+ * possible, fat_image_get() falls back to pread(2).
+ * Standard input ("-") and other non-seekable files are read in a single
+ * pass by fat_stream_load().
+ *
+ * Return: 0 - success
+ *         negative - error (errno)
+ */
+int fat_image_open(struct fat_image *img, const char *path)
+{
+  struct stat st;
+  off_t size;
+  void *map;
+
+  img->map = NULL;
+  img->size = 0;
+  img->base = 0;
+  img->window = false;
+  img->mtime.tv_sec = 0;
+  img->mtime.tv_nsec = 0;
+  img->seg = NULL;
+  img->nseg = 0;
+  img->aseg = 0;
+  if (!strcmp(path, "-"))
+    img->fd = dup(STDIN_FILENO);
+  else
+    img->fd = open(path, O_RDONLY);
+  if (img->fd < 0)
+    return -errno;
+
+  if (fstat(img->fd, &st) < 0)
+    goto err_close;
+
+  if ((size = fat_image_size(img->fd, &st)) < 0) {
+    if (errno != ESPIPE)
+      goto err_close;
+    if ((size = fat_stream_load(img)) < 0) {
+      fat_image_close(img);
+      return size;
+    }
+    return 0;
+  }
+  img->size = size;
+  img->mtime = st.st_mtim;
+  if (!size)
+    return 0;
+
+  map = mmap(NULL, size, PROT_READ, MAP_SHARED, img->fd, 0);
+  if (map == MAP_FAILED) {
+    fatracer_debug("mmap failed(%d), use pread\n", errno);
+    return 0;
+  }
+  img->map = map;
+  madvise(img->map, img->size, MADV_RANDOM);
+
+  return 0;
+
+err_close:
+  size = -errno;
+  close(img->fd);
+  img->fd = -1;
+  return size;
+}
+
+/**
+ * fat_image_close - release image.
+ * @img: image
+ */
+void fat_image_close(struct fat_image *img)
+{
+  size_t i;
+
+  if (img->window) {
+    img->map = NULL;
+    img->fd = -1;
+    return;
+  }
+  if (img->map)
+    munmap(img->map, img->size);
+  if (img->fd >= 0)
+    close(img->fd);
+  for (i = 0; i < img->nseg; i++)
+    free(img->seg[i].data);
+  free(img->seg);
+  img->map = NULL;
+  img->fd = -1;
+  img->seg = NULL;
+  img->nseg = 0;
+  img->aseg = 0;
+}
+
+/**
+ * fat_image_window - make image of region of another image.
+ * @win:  image to initialize
+ * @img:  opened image
+ * @off:  byte offset of region, such as start of partition
+ * @size: byte length of region (cut at the end of @img)
+ *
+ * @win shares file and mapping of @img, so it must be closed before
+ * @img. Streamed image can not be windowed.
+ *
+ * Return: 0 - success
+ *         -EOPNOTSUPP - @img is streamed
+ *         -EINVAL - @off is out of image
+ */
+int fat_image_window(struct fat_image *win, struct fat_image *img,
+    u_int64_t off, u_int64_t size)
+{
+  if (img->seg)
+    return -EOPNOTSUPP;
+  if (off >= img->size)
+    return -EINVAL;
+  *win = *img;
+  win->map = img->map ? img->map + off : NULL;
+  win->base = img->base + off;
+  win->size = size < img->size - off ? size : img->size - off;
+  win->window = true;
+  return 0;
+}
+
+/**
+ * fat_image_get - get region of image.
+ * @img: image
+ * @off: byte offset of region
+ * @len: byte length of region
+ *
+ * When image is mapped or streamed, return pointer in memory without
+ * copying. Otherwise read region to allocated buffer.
+ * Caller must release the region by fat_image_put().
+ *
+ * Return: pointer of region
+ *         NULL - out of image, or read error
+ */
+unsigned char *fat_image_get(struct fat_image *img, u_int64_t off, size_t len)
+{
+  unsigned char *buf;
+  size_t done = 0;
+  ssize_t n;
+  struct fat_segment *seg;
+
+  if (off > img->size || len > img->size - off) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (img->map)
+    return img->map + off;
+  if (img->seg) {
+    seg = fat_image_segment(img, off);
+    if (!seg || seg->pending || len > seg->len - (off - seg->offset)) {
+      /* region was not kept while streaming */
+      errno = EIO;
+      return NULL;
+    }
+    return seg->data + (off - seg->offset);
+  }
+
+  if ((buf = malloc(len + 1)) == NULL)
+    return NULL;
+  while (done < len) {
+    n = pread(img->fd, buf + done, len - done, img->base + off + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (!n)
+        errno = EIO;
+      free(buf);
+      return NULL;
+    }
+    done += n;
+  }
+  return buf;
+}
+
+/**
+ * fat_image_put - release region of image.
+ * @img: image
+ * @buf: region returned by fat_image_get()
+ */
+void fat_image_put(struct fat_image *img, unsigned char *buf)
+{
+  if (!img->map && !img->seg)
+    free(buf);
+}
+
+/**
+ * fat_image_advise - give advice about use of region.
+ * @img:    image
+ * @off:    byte offset of region
+ * @len:    byte length of region
+ * @advice: madvise(2) advice
+ */
+void fat_image_advise(struct fat_image *img, u_int64_t off, size_t len, int advice)
+{
+  long pagesize = sysconf(_SC_PAGESIZE);
+  uintptr_t addr, start;
+
+  if (!img->map || off >= img->size)
+    return;
+  if (len > img->size - off)
+    len = img->size - off;
+  /* window of partition may not start on page boundary */
+  addr = (uintptr_t)(img->map + off);
+  start = addr & ~((uintptr_t)pagesize - 1);
+  madvise((void *)start, len + (addr - start), advice);
+}
+
+/**
+ * fat_image_segment - find segment of streamed image.
+ * @img: streamed image
+ * @off: byte offset in image
+ *
+ * Return: segment which contains @off
+ *         NULL - @off was not kept
+ */
+struct fat_segment *fat_image_segment(struct fat_image *img, u_int64_t off)
+{
+  size_t lo = 0, hi = img->nseg, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (off < img->seg[mid].offset)
+      hi = mid;
+    else if (off - img->seg[mid].offset >= img->seg[mid].len)
+      lo = mid + 1;
+    else
+      return &(img->seg[mid]);
+  }
+  return NULL;
+}
+
+/**
+ * fat_image_append - keep region of streamed image.
+ * @img:     streamed image
+ * @off:     byte offset of region (after all kept regions)
+ * @data:    allocated data, owned by @img after success
+ * @len:     byte length of region
+ * @pending: region may be dropped later
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+int fat_image_append(struct fat_image *img, u_int64_t off,
+    unsigned char *data, size_t len, bool pending)
+{
+  size_t alloc;
+  struct fat_segment *seg;
+
+  if (img->nseg == img->aseg) {
+    alloc = img->aseg ? img->aseg * 2 : 64;
+    if (!(seg = realloc(img->seg, alloc * sizeof(*seg))))
+      return -ENOMEM;
+    img->seg = seg;
+    img->aseg = alloc;
+  }
+  seg = &(img->seg[img->nseg++]);
+  seg->offset = off;
+  seg->data = data;
+  seg->len = len;
+  seg->pending = pending;
+  return 0;
+}
@@ -0,0 +1,608 @@
+/*
+ * index.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "fat.h"
+
+/**
+ * Index file
+ *
+ * struct fat_index_header
+ * boot sector and FSInfo sector (2 * RESVAREA_SIZE bytes)
+ * decoded FAT12 entries (FAT12 only, u_int16_t each)
+ * struct fat_index_node, root first and then directories in BFS order
+ * hash of each sector of first FAT (u_int64_t each)
+ * struct fat_index_dirhash of each directory cluster, sorted by cluster
+ *
+ * The file is named after hash of boot sector and FAT, and is used only
+ * when size and mtime of image match too. "path-<hash of image path and
+ * partition offset>.idx" links to the last index written for that image,
+ * for incremental rescan.
+ */
+
+/**
+ * fat_volume_hash - get hash of boot sector and FAT.
+ * @vol: FAT volume
+ *
+ * Return: 64-bit hash
+ */
+u_int64_t fat_volume_hash(struct fat_volume *vol)
+{
+  unsigned char *boot;
+  struct fat_hash h;
+
+  fat_hash_init(&h, 0);
+  if ((boot = fat_image_get(vol->img, 0, RESVAREA_SIZE))) {
+    fat_hash_update(&h, boot, RESVAREA_SIZE);
+    fat_image_put(vol->img, boot);
+  }
+  fat_hash_update(&h, vol->fat, vol->geo.fats_size);
+  return fat_hash_final(&h);
+}
+
+/**
+ * fat_index_path - get path of index file.
+ * @dir:  cache directory
+ * @hash: hash of volume
+ *
+ * Return: allocated path (with room for suffix of temporary file)
+ *         NULL - out of memory
+ */
+static char *fat_index_path(const char *dir, u_int64_t hash)
+{
+  char *path;
+  size_t len = strlen(dir) + sizeof("/0123456789abcdef.idx.XXXXXX");
+
+  if ((path = malloc(len)))
+    snprintf(path, len, "%s/%016llx.idx", dir, (unsigned long long)hash);
+  return path;
+}
+
+/**
+ * fat_index_link - get path of link to last index of image.
+ * @dir:   cache directory
+ * @image: image file path
+ * @base:  offset of partition in image (0: whole image)
+ *
+ * Return: allocated path
+ *         NULL - out of memory, or image does not exist
+ */
+char *fat_index_link(const char *dir, const char *image, u_int64_t base)
+{
+  char *real, *path;
+  size_t len = strlen(dir) + sizeof("/path-0123456789abcdef.idx");
+
+  if (!(real = realpath(image, NULL)))
+    return NULL;
+  if ((path = malloc(len)))
+    snprintf(path, len, "%s/path-%016llx.idx", dir,
+        (unsigned long long)fat_hash64(real, strlen(real), base));
+  free(real);
+  return path;
+}
+
+/**
+ * fat_cluster_hash - get hash of directory cluster.
+ * @vol:     FAT volume
+ * @cluster: cluster (0: fixed root directory)
+ * @hash:    (out) hash
+ *
+ * Return: 0 - success
+ *         -EIO - read error
+ */
+int fat_cluster_hash(struct fat_volume *vol, u_int32_t cluster, u_int64_t *hash)
+{
+  u_int64_t offset;
+  size_t len;
+  unsigned char *buf;
+
+  if (!cluster) {
+    offset = vol->geo.root_offset;
+    len = vol->geo.root_size;
+  } else {
+    offset = fat_cluster_offset(vol, cluster);
+    len = vol->geo.cluster_size;
+  }
+  if (!(buf = fat_image_get(vol->img, offset, len)))
+    return -EIO;
+  *hash = fat_hash64(buf, len, 0);
+  fat_image_put(vol->img, buf);
+  return 0;
+}
+
+static int fat_index_cmp_dirhash(const void *a, const void *b)
+{
+  const struct fat_index_dirhash *x = a, *y = b;
+
+  return (x->cluster > y->cluster) - (x->cluster < y->cluster);
+}
+
+/**
+ * fat_index_hashdirs - get hash of all directory clusters.
+ * @vol:   FAT volume
+ * @dirs:  directories
+ * @ndirs: count of @dirs
+ * @hash:  (out) allocated hashes, sorted by cluster
+ * @count: (out) count of @hash
+ */
+static int fat_index_hashdirs(struct fat_volume *vol, struct fat_node **dirs,
+    size_t ndirs, struct fat_index_dirhash **hash, size_t *count)
+{
+  size_t i, n = 0, alloc = 64;
+  struct fat_index_dirhash *h, *tmp;
+  struct fat_chain ch;
+  u_int32_t clus;
+  u_int64_t digest;
+
+  if (!(h = malloc(alloc * sizeof(*h))))
+    return -ENOMEM;
+  for (i = 0; i < ndirs; i++) {
+    clus = fat_dentry_cluster(vol, &(dirs[i]->dentry));
+    fat_chain_init(&ch, vol, clus);
+    while (!clus || fat_chain_next(&ch)) {
+      if (n == alloc) {
+        alloc *= 2;
+        if (!(tmp = realloc(h, alloc * sizeof(*h)))) {
+          free(h);
+          return -ENOMEM;
+        }
+        h = tmp;
+      }
+      h[n].cluster = clus ? ch.cluster : 0;
+      h[n].reserved = 0;
+      if (!fat_cluster_hash(vol, h[n].cluster, &digest)) {
+        h[n].hash = digest;
+        n++;
+      }
+      if (!clus)
+        break;
+    }
+  }
+  qsort(h, n, sizeof(*h), fat_index_cmp_dirhash);
+  *hash = h;
+  *count = n;
+  return 0;
+}
+
+/**
+ * fat_index_dirs - list directories in BFS order.
+ * @tree:  directory tree
+ * @dirs:  (out) allocated array of directories, root first
+ * @ndirs: (out) count of @dirs
+ */
+static int fat_index_dirs(struct fat_tree *tree, struct fat_node ***dirs,
+    size_t *ndirs)
+{
+  size_t i, j, n = 0, alloc = 64;
+  struct fat_node **d, **tmp;
+
+  if (!(d = malloc(alloc * sizeof(*d))))
+    return -ENOMEM;
+  d[n++] = &(tree->root);
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < d[i]->nchild; j++) {
+      if (!d[i]->child[j].nchild)
+        continue;
+      if (n == alloc) {
+        alloc *= 2;
+        if (!(tmp = realloc(d, alloc * sizeof(*d)))) {
+          free(d);
+          return -ENOMEM;
+        }
+        d = tmp;
+      }
+      d[n++] = &(d[i]->child[j]);
+    }
+  }
+  *dirs = d;
+  *ndirs = n;
+  return 0;
+}
+
+/**
+ * fat_index_node - convert node to index record.
+ * @node:  node
+ * @child: index of first child
+ */
+static void fat_index_node(struct fat_index_node *rec, struct fat_node *node,
+    u_int32_t child)
+{
+  rec->dentry = node->dentry;
+  rec->offset = node->offset;
+  rec->nchild = node->nchild;
+  rec->child = node->nchild ? child : FAT_INDEX_NONE;
+}
+
+/**
+ * fat_index_save - write index file of volume.
+ * @vol:   FAT volume
+ * @dir:   cache directory
+ * @tree:  directory tree of @vol
+ * @image: image file path
+ *
+ * Index is written to temporary file and renamed, so readers never see
+ * partially written index. Link of @image is updated to the new index.
+ *
+ * Return: 0 - success
+ *         negative - error (errno)
+ */
+int fat_index_save(struct fat_volume *vol, const char *dir, struct fat_tree *tree,
+    const char *image)
+{
+  int fd, err = 0;
+  FILE *fp;
+  char *path = NULL, *tmp = NULL, *link;
+  size_t i, j, ndirs, next, ndirhash = 0;
+  u_int64_t fathash;
+  struct fat_index_dirhash *dirhash = NULL;
+  unsigned char *sect;
+  unsigned char resv[2 * RESVAREA_SIZE] = {0};
+  struct fat_node **dirs;
+  struct fat_index_node rec;
+  struct fat32_reserved_info *fat32_info = (struct fat32_reserved_info *)(vol->resv.reserved1);
+  struct fat_index_header hdr = {
+    .magic = FAT_INDEX_MAGIC,
+    .version = FAT_INDEX_VERSION,
+    .node_size = sizeof(struct fat_index_node),
+    .image_size = vol->img->size,
+    .mtime_sec = vol->img->mtime.tv_sec,
+    .mtime_nsec = vol->img->mtime.tv_nsec,
+    .hash = fat_volume_hash(vol),
+    .fstype = vol->fstype,
+    .fat12_count = vol->fat12 ? vol->CountofClusters + 2 : 0,
+    .entries = tree->count,
+  };
+
+  if ((err = fat_index_dirs(tree, &dirs, &ndirs)) < 0)
+    return err;
+  if ((err = fat_index_hashdirs(vol, dirs, ndirs, &dirhash, &ndirhash)) < 0)
+    goto out;
+  hdr.resv_offset = sizeof(hdr);
+  hdr.fat12_offset = hdr.resv_offset + sizeof(resv);
+  hdr.node_offset = hdr.fat12_offset + (u_int64_t)hdr.fat12_count * sizeof(u_int16_t);
+
+  if ((sect = fat_image_get(vol->img, 0, RESVAREA_SIZE))) {
+    memcpy(resv, sect, RESVAREA_SIZE);
+    fat_image_put(vol->img, sect);
+  }
+  if (vol->fstype == FAT32_FILESYSTEM && (sect = fat_image_get(vol->img,
+          (u_int64_t)fat32_info->BPB_FSInfo * vol->geo.sector, RESVAREA_SIZE))) {
+    memcpy(resv + RESVAREA_SIZE, sect, RESVAREA_SIZE);
+    fat_image_put(vol->img, sect);
+  }
+
+  if (!(path = fat_index_path(dir, hdr.hash))
+      || !(tmp = fat_index_path(dir, hdr.hash))) {
+    err = -ENOMEM;
+    goto out;
+  }
+  strcat(tmp, ".XXXXXX");
+  if ((fd = mkstemp(tmp)) < 0) {
+    err = -errno;
+    goto out;
+  }
+  if (!(fp = fdopen(fd, "w"))) {
+    err = -errno;
+    close(fd);
+    unlink(tmp);
+    goto out;
+  }
+
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  fwrite(resv, sizeof(resv), 1, fp);
+  if (hdr.fat12_count)
+    fwrite(vol->fat12, sizeof(u_int16_t), hdr.fat12_count, fp);
+
+  /* children of dirs[i] start right after children of dirs[0..i-1] */
+  next = 1;
+  fat_index_node(&rec, &(tree->root), next);
+  fwrite(&rec, sizeof(rec), 1, fp);
+  next += tree->root.nchild;
+  for (i = 0; i < ndirs; i++) {
+    for (j = 0; j < dirs[i]->nchild; j++) {
+      fat_index_node(&rec, &(dirs[i]->child[j]), next);
+      fwrite(&rec, sizeof(rec), 1, fp);
+      next += dirs[i]->child[j].nchild;
+    }
+  }
+
+  /* count of records is known only now */
+  hdr.node_count = next;
+  hdr.fathash_offset = hdr.node_offset + next * sizeof(rec);
+  hdr.fathash_count = vol->secsPerFat;
+  for (i = 0; i < vol->secsPerFat; i++) {
+    fathash = fat_hash64(vol->fat + i * vol->geo.sector, vol->geo.sector, 0);
+    fwrite(&fathash, sizeof(fathash), 1, fp);
+  }
+  hdr.dirhash_offset = hdr.fathash_offset + hdr.fathash_count * sizeof(fathash);
+  hdr.dirhash_count = ndirhash;
+  fwrite(dirhash, sizeof(*dirhash), ndirhash, fp);
+  rewind(fp);
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  if (ferror(fp) | fclose(fp)) {
+    err = -errno;
+    unlink(tmp);
+    goto out;
+  }
+  if (rename(tmp, path) < 0) {
+    err = -errno;
+    unlink(tmp);
+    goto out;
+  }
+
+  /* link is replaced atomically as well */
+  if ((link = fat_index_link(dir, image, vol->img->base))) {
+    free(tmp);
+    if ((tmp = malloc(strlen(link) + sizeof(".lnk")))) {
+      sprintf(tmp, "%s.lnk", link);
+      unlink(tmp);
+      if (symlink(strrchr(path, '/') + 1, tmp) < 0 || rename(tmp, link) < 0) {
+        err = -errno;
+        unlink(tmp);
+      }
+    }
+    free(link);
+  }
+out:
+  free(tmp);
+  free(path);
+  free(dirs);
+  free(dirhash);
+  return err;
+}
+
+/**
+ * fat_index_restore - build directory tree from index records.
+ * @tree:  directory tree to initialize
+ * @rec:   index records
+ * @count: count of @rec
+ */
+static int fat_index_restore(struct fat_tree *tree, struct fat_index_node *rec,
+    u_int64_t count)
+{
+  size_t i, j, n = 0, alloc = 64;
+  u_int64_t next = 1;
+  struct fat_node **dirs, *dir, *child;
+  struct fat_index_node *r;
+  u_int32_t *first;
+  void *tmp;
+  int err = 0;
+
+  dirs = malloc(alloc * sizeof(*dirs));
+  first = malloc(alloc * sizeof(*first));
+  if (!dirs || !first) {
+    err = -ENOMEM;
+    goto out;
+  }
+
+  tree->root.dentry = rec[0].dentry;
+  tree->root.offset = rec[0].offset;
+  dirs[n] = &(tree->root);
+  first[n++] = 0;
+  for (i = 0; i < n; i++) {
+    dir = dirs[i];
+    r = &(rec[first[i]]);
+    if (r->child == FAT_INDEX_NONE)
+      continue;
+    /* children must follow in the order they were written */
+    if (r->child != next || next + r->nchild > count) {
+      err = -ESTALE;
+      goto out;
+    }
+    next += r->nchild;
+    if (!(dir->child = fat_arena_calloc(tree->arena, r->nchild, sizeof(*child)))) {
+      err = -ENOMEM;
+      goto out;
+    }
+    dir->nchild = r->nchild;
+    for (j = 0; j < dir->nchild; j++) {
+      child = &(dir->child[j]);
+      child->dentry = rec[r->child + j].dentry;
+      child->offset = rec[r->child + j].offset;
+      if (rec[r->child + j].child == FAT_INDEX_NONE)
+        continue;
+      if (n == alloc) {
+        alloc *= 2;
+        if (!(tmp = realloc(dirs, alloc * sizeof(*dirs)))) {
+          err = -ENOMEM;
+          goto out;
+        }
+        dirs = tmp;
+        if (!(tmp = realloc(first, alloc * sizeof(*first)))) {
+          err = -ENOMEM;
+          goto out;
+        }
+        first = tmp;
+      }
+      dirs[n] = child;
+      first[n++] = r->child + j;
+    }
+  }
+  if (next != count)
+    err = -ESTALE;
+out:
+  free(dirs);
+  free(first);
+  return err;
+}
+
+/**
+ * fat_index_section - check that section is in index file.
+ * @idx:    index
+ * @offset: byte offset of section
+ * @count:  count of elements
+ * @size:   size of element
+ */
+static bool fat_index_section(struct fat_index *idx, u_int64_t offset,
+    u_int64_t count, size_t size)
+{
+  return offset <= idx->size && count <= (idx->size - offset) / size;
+}
+
+/**
+ * fat_index_open - map index file.
+ * @idx:  index to initialize
+ * @path: path of index file
+ *
+ * Return: 0 - success
+ *         -ESTALE - not a valid index
+ *         negative - error (errno)
+ */
+int fat_index_open(struct fat_index *idx, const char *path)
+{
+  int fd;
+  struct stat st;
+  struct fat_index_header *hdr;
+
+  memset(idx, 0, sizeof(*idx));
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -errno;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+    close(fd);
+    return -ESTALE;
+  }
+  idx->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (idx->map == MAP_FAILED) {
+    idx->map = NULL;
+    return -errno;
+  }
+  idx->size = st.st_size;
+
+  hdr = idx->hdr = idx->map;
+  if (hdr->magic != FAT_INDEX_MAGIC || hdr->version != FAT_INDEX_VERSION
+      || hdr->node_size != sizeof(struct fat_index_node) || !hdr->node_count
+      || !fat_index_section(idx, hdr->node_offset, hdr->node_count,
+        sizeof(struct fat_index_node))
+      || !fat_index_section(idx, hdr->fathash_offset, hdr->fathash_count,
+        sizeof(u_int64_t))
+      || !fat_index_section(idx, hdr->dirhash_offset, hdr->dirhash_count,
+        sizeof(struct fat_index_dirhash))) {
+    fat_index_close(idx);
+    return -ESTALE;
+  }
+  idx->node = (struct fat_index_node *)((char *)idx->map + hdr->node_offset);
+  idx->fathash = (u_int64_t *)((char *)idx->map + hdr->fathash_offset);
+  idx->dirhash = (struct fat_index_dirhash *)((char *)idx->map + hdr->dirhash_offset);
+  return 0;
+}
+
+/**
+ * fat_index_close - unmap index file.
+ * @idx: index
+ */
+void fat_index_close(struct fat_index *idx)
+{
+  if (idx->map)
+    munmap(idx->map, idx->size);
+  memset(idx, 0, sizeof(*idx));
+}
+
+/**
+ * fat_index_dirhash - find hash of directory cluster.
+ * @idx:     index
+ * @cluster: cluster (0: fixed root directory)
+ * @hash:    (out) hash of cluster
+ *
+ * Return: true - found
+ */
+bool fat_index_dirhash(struct fat_index *idx, u_int32_t cluster, u_int64_t *hash)
+{
+  size_t lo = 0, hi = idx->hdr->dirhash_count, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (idx->dirhash[mid].cluster < cluster) {
+      lo = mid + 1;
+    } else if (idx->dirhash[mid].cluster > cluster) {
+      hi = mid;
+    } else {
+      *hash = idx->dirhash[mid].hash;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * fat_index_load - read directory tree from index file.
+ * @vol:  FAT volume
+ * @dir:  cache directory
+ * @tree: directory tree to initialize
+ *
+ * Return: 0 - success
+ *         -ENOENT - no index for this image
+ *         -ESTALE - index does not match image
+ *         negative - error (errno)
+ */
+int fat_index_load(struct fat_volume *vol, const char *dir, struct fat_tree *tree)
+{
+  int err;
+  char *path;
+  struct fat_index idx;
+  u_int64_t hash = fat_volume_hash(vol);
+
+  memset(tree, 0, sizeof(*tree));
+  if (!(path = fat_index_path(dir, hash)))
+    return -ENOMEM;
+  err = fat_index_open(&idx, path);
+  free(path);
+  if (err < 0)
+    return err;
+  if ((err = fat_init_tree(tree, 1)) < 0)
+    goto out;
+
+  if (idx.hdr->image_size != vol->img->size
+      || idx.hdr->mtime_sec != vol->img->mtime.tv_sec
+      || idx.hdr->mtime_nsec != vol->img->mtime.tv_nsec
+      || idx.hdr->hash != hash || idx.hdr->fstype != vol->fstype) {
+    err = -ESTALE;
+    goto out;
+  }
+
+  err = fat_index_restore(tree, idx.node, idx.hdr->node_count);
+  tree->count = idx.hdr->entries;
+  if (!err)
+    err = fat_tree_names(tree);
+out:
+  if (err < 0)
+    fat_free_tree(tree);
+  fat_index_close(&idx);
+  return err;
+}
@@ -0,0 +1,227 @@
+/*
+ * lfn.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/* any of 4 UCS-2 characters in 64 bits is not ASCII */
+#define UCS2_NONASCII 0xff80ff80ff80ff80ULL
+
+/**
+ * fat_lfn_checksum - compute checksum of short name.
+ * @name: DIR_Name (11 bytes)
+ *
+ * Each long file name entry carries this checksum of its short entry.
+ */
+u_int8_t fat_lfn_checksum(const unsigned char *name)
+{
+  int i;
+  u_int8_t sum = 0;
+
+  for (i = 0; i < NameSIZE; i++)
+    sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+  return sum;
+}
+
+/**
+ * fat_ucs2_to_utf8 - convert UCS-2 name to UTF-8.
+ * @ucs: UCS-2 characters
+ * @n:   count of characters
+ * @out: output buffer (at least @n * 3 + 1 bytes)
+ *
+ * Surrogate pairs are combined, and unpaired surrogates are replaced with
+ * U+FFFD. Runs of ASCII, which most names are, are copied 4 characters at
+ * once.
+ *
+ * Return: length of @out
+ */
+size_t fat_ucs2_to_utf8(const u_int16_t *ucs, size_t n, char *out)
+{
+  size_t i = 0, len = 0;
+  u_int64_t v;
+  u_int32_t c;
+
+  while (i < n) {
+    if (i + 4 <= n) {
+      memcpy(&v, ucs + i, sizeof(v));
+      if (!(v & UCS2_NONASCII)) {
+        out[len] = ucs[i];
+        out[len + 1] = ucs[i + 1];
+        out[len + 2] = ucs[i + 2];
+        out[len + 3] = ucs[i + 3];
+        i += 4;
+        len += 4;
+        continue;
+      }
+    }
+
+    c = ucs[i++];
+    if (c < 0x80) {
+      out[len++] = c;
+    } else if (c < 0x800) {
+      out[len++] = 0xc0 | (c >> 6);
+      out[len++] = 0x80 | (c & 0x3f);
+    } else if (c >= 0xd800 && c < 0xdc00 && i < n
+        && ucs[i] >= 0xdc00 && ucs[i] < 0xe000) {
+      c = 0x10000 + ((c - 0xd800) << 10) + (ucs[i++] - 0xdc00);
+      out[len++] = 0xf0 | (c >> 18);
+      out[len++] = 0x80 | ((c >> 12) & 0x3f);
+      out[len++] = 0x80 | ((c >> 6) & 0x3f);
+      out[len++] = 0x80 | (c & 0x3f);
+    } else {
+      if (c >= 0xd800 && c < 0xe000)
+        c = 0xfffd;
+      out[len++] = 0xe0 | (c >> 12);
+      out[len++] = 0x80 | ((c >> 6) & 0x3f);
+      out[len++] = 0x80 | (c & 0x3f);
+    }
+  }
+  out[len] = '\0';
+  return len;
+}
+
+/**
+ * fat_lfn_chars - copy characters of long file name entry.
+ * @l:   long file name entry
+ * @ucs: output (LFN_CHARS characters)
+ */
+static void fat_lfn_chars(const struct fat_lfn_dentry *l, u_int16_t *ucs)
+{
+  int i;
+
+  for (i = 0; i < 5; i++)
+    ucs[i] = l->LDIR_Name1[i * 2] | (l->LDIR_Name1[i * 2 + 1] << 8);
+  for (i = 0; i < 6; i++)
+    ucs[5 + i] = l->LDIR_Name2[i * 2] | (l->LDIR_Name2[i * 2 + 1] << 8);
+  for (i = 0; i < 2; i++)
+    ucs[11 + i] = l->LDIR_Name3[i * 2] | (l->LDIR_Name3[i * 2 + 1] << 8);
+}
+
+/**
+ * fat_lfn_assemble - attach long file names to children of directory.
+ * @dir:   directory node
+ * @arena: arena to store names in
+ *
+ * Long file name entries must run from the last ordinal down to 1, all with
+ * the checksum of the short entry right after them. Otherwise the short
+ * entry keeps no long name, as the entries are orphaned by other system.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+int fat_lfn_assemble(struct fat_node *dir, struct fat_arena *arena)
+{
+  size_t i, len;
+  int ord, count = 0, expect = 0;
+  bool complete = false;
+  u_int8_t sum = 0;
+  u_int16_t ucs[LFN_ORDMASK * LFN_CHARS];
+  char utf8[FAT_NAME_MAX];
+  struct fat_node *node;
+  const struct fat_lfn_dentry *l;
+
+  for (i = 0; i < dir->nchild; i++) {
+    node = &(dir->child[i]);
+    node->name = NULL;
+    if ((node->dentry.DIR_Attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME) {
+      l = (const struct fat_lfn_dentry *)&(node->dentry);
+      ord = l->LDIR_Ord & LFN_ORDMASK;
+      complete = false;
+      if (l->LDIR_Ord & LFN_LAST) {
+        count = expect = ord;
+        sum = l->LDIR_Chksum;
+      } else if (!expect || ord != expect || l->LDIR_Chksum != sum) {
+        expect = 0;
+        continue;
+      }
+      if (!ord || (ord - 1) * LFN_CHARS >= LFN_MAXLEN) {
+        expect = 0;
+        continue;
+      }
+      fat_lfn_chars(l, ucs + (ord - 1) * LFN_CHARS);
+      complete = !--expect;
+      continue;
+    }
+
+    if (complete && fat_lfn_checksum(node->dentry.IR_Name) == sum) {
+      for (len = 0; len < (size_t)count * LFN_CHARS && ucs[len]; len++)
+        ;
+      if (len > LFN_MAXLEN)
+        len = LFN_MAXLEN;
+      if (len) {
+        len = fat_ucs2_to_utf8(ucs, len, utf8);
+        if (!(node->name = fat_arena_strndup(arena, utf8, len)))
+          return -ENOMEM;
+      }
+    }
+    complete = false;
+    expect = 0;
+  }
+  return 0;
+}
+
+static int fat_tree_names_dir(struct fat_node *node, void *arg)
+{
+  return node->child ? fat_lfn_assemble(node, arg) : 0;
+}
+
+/**
+ * fat_tree_names - attach long file names to all entries of tree.
+ * @tree: directory tree
+ *
+ * Names are stored in the first arena of tree, and released with the tree.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+int fat_tree_names(struct fat_tree *tree)
+{
+  int err;
+
+  if ((err = fat_lfn_assemble(&(tree->root), tree->arena)) < 0)
+    return err;
+  return fat_tree_foreach(tree, fat_tree_names_dir, tree->arena);
+}
+
+/**
+ * fat_node_name - get name of entry.
+ * @node: dentry node
+ * @buf:  output buffer for short name (at least NameSIZE + 2 bytes)
+ *
+ * Return: long file name if any, otherwise short name in @buf
+ */
+const char *fat_node_name(struct fat_node *node, char *buf)
+{
+  return node->name ? node->name : fat_format_shortname(&(node->dentry), buf);
+}
@@ -0,0 +1,293 @@
+/*
+ * lookup.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/**
+ * fat_lookup_fold - fold name to key of index.
+ * @name: name
+ * @len:  length of @name
+ * @buf:  output buffer (at least FAT_NAME_MAX bytes)
+ *
+ * Only ASCII letters are folded, as FAT itself does for short names.
+ *
+ * Return: length of folded name (0 if too long)
+ */
+static size_t fat_lookup_fold(const char *name, size_t len, char *buf)
+{
+  size_t i;
+
+  if (len >= FAT_NAME_MAX)
+    return 0;
+  for (i = 0; i < len; i++)
+    buf[i] = (name[i] >= 'a' && name[i] <= 'z') ? name[i] - 'a' + 'A' : name[i];
+  return len;
+}
+
+/**
+ * fat_lookup_hash - hash key of index.
+ * @clus: first cluster of parent directory
+ * @name: name
+ * @len:  length of @name
+ */
+static u_int64_t fat_lookup_hash(u_int32_t clus, const char *name, size_t len)
+{
+  char buf[FAT_NAME_MAX];
+
+  len = fat_lookup_fold(name, len, buf);
+  return fat_hash64(buf, len, clus);
+}
+
+/**
+ * fat_lookup_match - whether entry has name.
+ * @node: dentry node
+ * @name: name (case-insensitive)
+ * @len:  length of @name
+ */
+static bool fat_lookup_match(struct fat_node *node, const char *name, size_t len)
+{
+  char buf[NameSIZE + 2];
+
+  if (node->name && strlen(node->name) == len && !strncasecmp(node->name, name, len))
+    return true;
+  fat_format_shortname(&(node->dentry), buf);
+  return strlen(buf) == len && !strncasecmp(buf, name, len);
+}
+
+/**
+ * fat_lookup_indexed - whether entry is put in index.
+ * @dentry: directory entry
+ */
+static bool fat_lookup_indexed(struct fat_dentry *dentry)
+{
+  if ((dentry->DIR_Attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME)
+    return false;
+  return !(dentry->DIR_Attr & ATTR_VOLUME_ID) && dentry->IR_Name[0] != DENTRY_DOT;
+}
+
+/**
+ * fat_lookup_insert - put name of entry in index.
+ * @l:    path lookup index
+ * @dir:  parent directory node
+ * @node: dentry node
+ * @name: name
+ */
+static void fat_lookup_insert(struct fat_lookup *l, struct fat_node *dir,
+    struct fat_node *node, const char *name)
+{
+  size_t i;
+  u_int64_t hash;
+
+  hash = fat_lookup_hash(fat_dentry_cluster(l->vol, &(dir->dentry)), name, strlen(name));
+  for (i = hash & l->mask; l->slot[i].node; i = (i + 1) & l->mask)
+    ;
+  l->slot[i].hash = hash;
+  l->slot[i].node = node;
+  l->slot[i].dir = dir;
+  l->count++;
+}
+
+/**
+ * fat_lookup_walk - call function for each directory of tree.
+ * @tree: directory tree
+ * @fn:   function to call
+ * @arg:  argument of @fn
+ */
+static int fat_lookup_walk(struct fat_tree *tree,
+    void (*fn)(struct fat_node *, void *), void *arg)
+{
+  size_t i, head = 0, count = 1, alloc = 64;
+  struct fat_node **queue, **tmp, *dir;
+
+  if (!(queue = malloc(alloc * sizeof(*queue))))
+    return -ENOMEM;
+  queue[0] = &(tree->root);
+  while (head < count) {
+    dir = queue[head++];
+    fn(dir, arg);
+    for (i = 0; i < dir->nchild; i++) {
+      if (!dir->child[i].child || !fat_lookup_indexed(&(dir->child[i].dentry)))
+        continue;
+      if (count == alloc) {
+        alloc *= 2;
+        if (!(tmp = realloc(queue, alloc * sizeof(*queue)))) {
+          free(queue);
+          return -ENOMEM;
+        }
+        queue = tmp;
+      }
+      queue[count++] = &(dir->child[i]);
+    }
+  }
+  free(queue);
+  return 0;
+}
+
+static void fat_lookup_count(struct fat_node *dir, void *arg)
+{
+  size_t i, *keys = arg;
+  char buf[NameSIZE + 2];
+  struct fat_node *node;
+
+  for (i = 0; i < dir->nchild; i++) {
+    node = &(dir->child[i]);
+    if (!fat_lookup_indexed(&(node->dentry)))
+      continue;
+    (*keys)++;
+    if (node->name && strcasecmp(node->name, fat_format_shortname(&(node->dentry), buf)))
+      (*keys)++;
+  }
+}
+
+static void fat_lookup_fill(struct fat_node *dir, void *arg)
+{
+  size_t i;
+  char buf[NameSIZE + 2];
+  struct fat_lookup *l = arg;
+  struct fat_node *node;
+
+  for (i = 0; i < dir->nchild; i++) {
+    node = &(dir->child[i]);
+    if (!fat_lookup_indexed(&(node->dentry)))
+      continue;
+    fat_format_shortname(&(node->dentry), buf);
+    fat_lookup_insert(l, dir, node, buf);
+    if (node->name && strcasecmp(node->name, buf))
+      fat_lookup_insert(l, dir, node, node->name);
+  }
+}
+
+/**
+ * fat_lookup_init - build path lookup index of tree.
+ * @l:    path lookup index
+ * @vol:  FAT volume
+ * @tree: directory tree (must live as long as index)
+ *
+ * Every entry is keyed by first cluster of its parent directory and its
+ * case-folded name, both long and short, in one open addressing table.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+int fat_lookup_init(struct fat_lookup *l, struct fat_volume *vol, struct fat_tree *tree)
+{
+  int err;
+  size_t keys = 0, size = 16;
+
+  memset(l, 0, sizeof(*l));
+  l->vol = vol;
+  l->tree = tree;
+  if ((err = fat_lookup_walk(tree, fat_lookup_count, &keys)) < 0)
+    return err;
+  /* load factor is kept under 2/3 */
+  while (size < keys + keys / 2)
+    size *= 2;
+  if (!(l->slot = calloc(size, sizeof(*l->slot))))
+    return -ENOMEM;
+  l->mask = size - 1;
+  if ((err = fat_lookup_walk(tree, fat_lookup_fill, l)) < 0)
+    fat_lookup_free(l);
+  return err;
+}
+
+/**
+ * fat_lookup_child - find entry in directory.
+ * @l:    path lookup index
+ * @dir:  directory node
+ * @name: name (case-insensitive)
+ * @len:  length of @name
+ *
+ * Return: node, or NULL if not found
+ */
+struct fat_node *fat_lookup_child(struct fat_lookup *l, struct fat_node *dir,
+    const char *name, size_t len)
+{
+  size_t i;
+  u_int32_t clus = fat_dentry_cluster(l->vol, &(dir->dentry));
+  u_int64_t hash = fat_lookup_hash(clus, name, len);
+  struct fat_lookup_slot *s;
+
+  for (i = hash & l->mask; (s = &(l->slot[i]))->node; i = (i + 1) & l->mask) {
+    if (s->hash != hash || fat_dentry_cluster(l->vol, &(s->dir->dentry)) != clus)
+      continue;
+    if (fat_lookup_match(s->node, name, len))
+      return s->node;
+  }
+  return NULL;
+}
+
+/**
+ * fat_lookup - find node by path.
+ * @l:    path lookup index
+ * @path: path from root, such as "/DCIM/100MEDIA/IMG_1234.JPG"
+ * @dir:  (out) parent directory node (optional)
+ *
+ * Components are matched with long or short name, case-insensitive.
+ *
+ * Return: node, or NULL if not found
+ */
+struct fat_node *fat_lookup(struct fat_lookup *l, const char *path, struct fat_node **dir)
+{
+  size_t len;
+  struct fat_node *node = &(l->tree->root), *parent = node;
+
+  while (*path) {
+    len = strcspn(path, "/");
+    if (!len || (len == 1 && path[0] == '.')) {
+      path += len + !!path[len];
+      continue;
+    }
+    if (node != &(l->tree->root) && !fat_is_subdir(&(node->dentry)))
+      return NULL;
+    parent = node;
+    if (!(node = fat_lookup_child(l, node, path, len)))
+      return NULL;
+    path += len + !!path[len];
+  }
+  if (dir)
+    *dir = parent;
+  return node;
+}
+
+/**
+ * fat_lookup_free - release path lookup index.
+ * @l: path lookup index
+ */
+void fat_lookup_free(struct fat_lookup *l)
+{
+  free(l->slot);
+  memset(l, 0, sizeof(*l));
+}
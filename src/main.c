@@ -30,7 +30,9 @@
 #include <stdbool.h>
 #include <config.h>
 #include <getopt.h>
+#include <locale.h>
 #include <limits.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
@@ -47,17 +49,79 @@
 enum
 {
   GETOPT_HELP_CHAR = (CHAR_MIN - 2),
-  GETOPT_VERSION_CHAR = (CHAR_MIN - 3)
+  GETOPT_VERSION_CHAR = (CHAR_MIN - 3),
+  GETOPT_DIFF_CHAR = (CHAR_MIN - 4),
+  GETOPT_HASH_CHAR = (CHAR_MIN - 5),
+  GETOPT_RECOVER_CHAR = (CHAR_MIN - 6),
+  GETOPT_FRAG_CHAR = (CHAR_MIN - 7),
+  GETOPT_CHECK_FATS_CHAR = (CHAR_MIN - 8),
+  GETOPT_VERIFY_CHAR = (CHAR_MIN - 9),
 };
 
 /* option data {"long name", needs argument, flags, "short name"} */
 static struct option const longopts[] =
 {
+  {"cache",required_argument, NULL, 'C'},
+  {"check-fats",no_argument, NULL, GETOPT_CHECK_FATS_CHAR},
+  {"delta",no_argument, NULL, 'd'},
+  {"diff",no_argument, NULL, GETOPT_DIFF_CHAR},
+  {"extents",no_argument, NULL, 'e'},
+  {"extract",required_argument, NULL, 'x'},
+  {"extract-all",required_argument, NULL, 'X'},
+  {"format",required_argument, NULL, 'f'},
+  {"frag",no_argument, NULL, GETOPT_FRAG_CHAR},
+  {"files-from",required_argument, NULL, 'T'},
+  {"hash",no_argument, NULL, GETOPT_HASH_CHAR},
+  {"jobs",required_argument, NULL, 'j'},
+  {"recover",no_argument, NULL, GETOPT_RECOVER_CHAR},
+  {"stat",required_argument, NULL, 's'},
+  {"verify",no_argument, NULL, GETOPT_VERIFY_CHAR},
   {"help",no_argument, NULL, GETOPT_HELP_CHAR},
   {"version",no_argument, NULL, GETOPT_VERSION_CHAR},
   {0,0,0,0}
 };
 
+/* count of threads to read directories */
+static int jobs = 1;
+/* print out extents of each file */
+static bool show_extents = false;
+/* format of output */
+static enum fat_output_format format = FORMAT_TEXT;
+/* read many images at once */
+static bool batch = false;
+/* list of images ("-": standard input) */
+static const char *files_from = NULL;
+/* directory of index cache */
+static const char *cache_dir = NULL;
+/* print out only changes since last index */
+static bool show_delta = false;
+/* compare two images */
+static bool show_diff = false;
+/* print out hash of contents of each file */
+static bool show_hash = false;
+/* print out deleted files and orphan directories */
+static bool show_recover = false;
+/* print out fragmentation of files and free space */
+static bool show_frag = false;
+/* compare copies of FAT */
+static bool check_fats = false;
+/* check consistency of chains and directories */
+static bool verify = false;
+/* file to write out to standard output */
+static const char *extract_path = NULL;
+/* directory to extract all files into */
+static const char *extract_dir = NULL;
+/* paths to print out entry of ("-": read from standard input) */
+static char **stat_path = NULL;
+static size_t stat_count = 0;
+/* aggregate of batch */
+static struct {
+  size_t volumes[3];
+  size_t entries;
+} summary;
+/* buffer of standard output */
+static char outbuf[FAT_OUTPUT_BUFSIZE];
+
 /**
  * usage - print out usage.
  * @status: Status code
@@ -72,8 +136,30 @@ void usage(int status)
     default:
       out = stdout;
   }
-  fprintf(out, _("Usage: %s [OPTION]... [FILE]\n"),
+  fprintf(out, _("Usage: %s [OPTION]... [FILE]...\n"),
+      PROGRAM_NAME);
+  fprintf(out, _("  or:  %s --diff [OPTION]... FILE1 FILE2\n"),
       PROGRAM_NAME);
+  fprintf(out, _("With FILE of -, read standard input in a single pass.\n"));
+  fprintf(out, "\n");
+  fprintf(out, _("  -C, --cache=DIR\tkeep index of directory tree in DIR\n"));
+  fprintf(out, _("      --check-fats\tprint out clusters whose entries differ among copies of FAT\n"));
+  fprintf(out, _("  -d, --delta\tprint out changes since last run with --cache\n"));
+  fprintf(out, _("      --diff\tprint out changes from FILE1 to FILE2\n"));
+  fprintf(out, _("  -e, --extents\tprint out cluster runs of each file\n"));
+  fprintf(out, _("  -x, --extract=PATH\twrite out contents of file PATH to standard output\n"));
+  fprintf(out, _("  -X, --extract-all=DIR\textract all files into DIR\n"));
+  fprintf(out, _("  -f, --format=FORMAT\toutput as text, json or binary\n"));
+  fprintf(out, _("      --frag\tprint out extent count of each file, and free space map\n"));
+  fprintf(out, _("      --hash\tprint out XXH64 hash, size and path of each file\n"));
+  fprintf(out, _("  -j, --jobs=N\tread directories with N threads (0: all CPUs)\n"));
+  fprintf(out, _("\t\twith many FILEs, read N images at once\n"));
+  fprintf(out, _("      --recover\tprint out deleted files and orphan directories\n"));
+  fprintf(out, _("  -s, --stat=PATH\tprint out entry of PATH (-: paths from standard input)\n"));
+  fprintf(out, _("  -T, --files-from=LIST\tread images listed in LIST, one per line (-: stdin)\n"));
+  fprintf(out, _("      --verify\tcheck chains, directories and FSInfo, and print out problems\n"));
+  fprintf(out, _("      --help\tdisplay this help and exit\n"));
+  fprintf(out, _("      --version\toutput version information and exit\n"));
 
   exit(status);
 }
@@ -125,7 +211,7 @@ void fat_timeformat(struct tm *t, u_int16_t time)
 
 int fat_attrformat(unsigned char *buf, unsigned char attr)
 {
-  if (attr & ATTR_LONG_FILE_NAME) {
+  if ((attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME) {
     strcat(buf ,_("LFN "));
     return 0;
   }
@@ -146,32 +232,64 @@ int fat_attrformat(unsigned char *buf, unsigned char attr)
   return 0;
 }
 
-bool check_dentryfree(const char *buf)
+bool check_dentryfree(const unsigned char *buf)
 {
   if (!buf)
     return true;
-  if ((buf[0] == 0xe5) || (buf[0] == 0x00))
+  if ((buf[0] == DENTRY_DELETED) || (buf[0] == DENTRY_END))
     return true;
   return false;
 }
 
+/**
+ * fat_format_shortname - format 8.3 name as "NAME.EXT".
+ * @dentry: directory entry
+ * @buf:    output buffer (at least NameSIZE + 2 bytes)
+ */
+char *fat_format_shortname(struct fat_dentry *dentry, char *buf)
+{
+  int i;
+  int len = 0;
+  int base = 8;
+  int ext = NameSIZE;
+
+  while (base > 0 && dentry->IR_Name[base - 1] == ' ')
+    base--;
+  while (ext > 8 && dentry->IR_Name[ext - 1] == ' ')
+    ext--;
+
+  for (i = 0; i < base; i++)
+    buf[len++] = dentry->IR_Name[i];
+  /* 0x05 stands for 0xe5 of the first character */
+  if (len && (unsigned char)buf[0] == 0x05)
+    buf[0] = (char)DENTRY_DELETED;
+  if (ext > 8)
+    buf[len++] = '.';
+  for (i = 8; i < ext; i++)
+    buf[len++] = dentry->IR_Name[i];
+  buf[len] = '\0';
+  return buf;
+}
+
   static inline __attribute__((const))
 bool is_power_of_2(unsigned long n)
 {
   return (n != 0 && ((n & (n - 1)) == 0));
 }
 
-static bool check_fat_bpb(struct fat_reserved_info *info)
+static bool check_fat_bpb(struct fat_reserved_info *info, bool quiet)
 {
   bool ret = false;
 
   /* Validate this looks like a FAT filesystem BPB */
   if (!info->BPB_RevdSecCnt) {
-    fprintf(stderr, "bogus number of reserved sectors");
+    if (!quiet)
+      fprintf(stderr, "bogus number of reserved sectors");
     goto out;
   }
   if (!info->BPB_NumFATs) {
-    fprintf(stderr, "bogus number of FAT structure");
+    if (!quiet)
+      fprintf(stderr, "bogus number of FAT structure");
     goto out;
   }
 
@@ -181,21 +299,25 @@ static bool check_fat_bpb(struct fat_reserved_info *info)
    */
 
   if (!fat_valid_media(info->BPB_Media)) {
-    fprintf(stderr, "invalid media value (0x%02x)", (unsigned)info->BPB_Media);
+    if (!quiet)
+      fprintf(stderr, "invalid media value (0x%02x)",
+          (unsigned)info->BPB_Media);
     goto out;
   }
 
   if (!is_power_of_2(info->BPB_BytesPerSec)
       || (info->BPB_BytesPerSec < 512)
       || (info->BPB_BytesPerSec > 4096)) {
-    fprintf(stderr, "bogus logical sector size %u",
-        (unsigned)info->BPB_BytesPerSec);
+    if (!quiet)
+      fprintf(stderr, "bogus logical sector size %u",
+          (unsigned)info->BPB_BytesPerSec);
     goto out;
   }
 
   if (!is_power_of_2(info->BPB_SecPerClus)) {
-    fprintf(stderr, "bogus sectors per cluster %u",
-        (unsigned)info->BPB_SecPerClus);
+    if (!quiet)
+      fprintf(stderr, "bogus sectors per cluster %u",
+          (unsigned)info->BPB_SecPerClus);
     goto out;
   }
 
@@ -241,47 +363,34 @@ int fat_load_reservedinfo(struct fat_reserved_info *info, unsigned char *buf)
   __memcpy(&(info->BPB_HiddSec), buf, &offset, HiddSecSIZE);
   __memcpy(&(info->BPB_TotSec32), buf, &offset, TotSec32SIZE);
 
-  if (!check_fat_bpb(info))
+  if (!check_fat_bpb(info, false))
     offset = -EINVAL;
 
   return offset;
 }
 
-void fat_dump_dentry(struct fat_dentry *info, FILE *out)
-{
-  unsigned char attrbuf[ATTR_ONELINE] = {0};
-  unsigned char ret[DENTRY_SIZE + 1] = {0};
-  struct tm mtime, atime, ctime;
-  u_int16_t msec = 0;
-
-  fat_timeformat(&mtime, info->DIR_WrtTime);
-  fat_dateformat(&mtime, info->DIR_WrtDate);
-  fat_dateformat(&atime, info->DIR_LstAccDate);
-  fat_timeformat(&ctime, info->DIR_CrtTime);
-  fat_dateformat(&ctime, info->DIR_CrtDate);
-  fat_attrformat(attrbuf, info->DIR_Attr);
-
-  fprintf(out, "%-28s\t: %s\n", _("FileName"), setcharc(info->IR_Name, ret, NameSIZE));
-  fprintf(out, "%-28s\t: %s\n", _("File Attribute"), attrbuf);
-  fprintf(out, "%-28s\t: %x\n", _("Smaller information"), info->DIR_NTRes);
-  msec = info->DIR_CrtTimeTenth;
-  fprintf(out, "%-28s\t: %d-%02d-%02d %02d:%02d:%02d.%02d\n", _("Create Time (ms)"),
-      1980 + ctime.tm_year, ctime.tm_mon, ctime.tm_mday,
-      ctime.tm_hour, ctime.tm_min,
-      (ctime.tm_sec * 2) + (msec / 100),
-      msec % 100);
-  fprintf(out, "%-28s\t: %d-%02d-%02d %02d:%02d:%02d.%02d\n", _("Access Time (ms)"),
-      1980 + atime.tm_year, atime.tm_mon, atime.tm_mday,
-      atime.tm_hour, atime.tm_min, atime.tm_sec * 2, 0);
-  fprintf(out, "%-28s\t: %d-%02d-%02d %02d:%02d:%02d.%02d\n", _("Modify Time (ms)"),
-      1980 + mtime.tm_year, mtime.tm_mon, mtime.tm_mday,
-      mtime.tm_hour, mtime.tm_min, mtime.tm_sec * 2, 0);
-
-  fprintf(out, "%-28s\t: %02x %02x\n", _("First Sector"), info->DIR_FstClusHI,
-      info->DIR_FstClusLO);
-  fprintf(out, "%-28s\t: %x\n", _("File size"), info->DIR_FileSize);
-}
+/**
+ * fat_probe_bpb - whether sector looks like FAT boot sector.
+ * @buf: first sector (RESVAREA_SIZE bytes)
+ *
+ * Same as check of fat_load_reservedinfo(), without messages.
+ */
+bool fat_probe_bpb(unsigned char *buf)
+{
+  size_t offset = 0;
+  struct fat_reserved_info info;
 
+  __memcpy(&(info.BS_JmpBoot), buf, &offset, JmpBootSIZE);
+  __memcpy(&(info.BS_ORMName), buf, &offset, ORMNameSIZE);
+  __memcpy(&(info.BPB_BytesPerSec), buf, &offset, BytesPerSecSIZE);
+  __memcpy(&(info.BPB_SecPerClus), buf, &offset, SecPerClusSIZE);
+  __memcpy(&(info.BPB_RevdSecCnt), buf, &offset, RevdSecCntSIZE);
+  __memcpy(&(info.BPB_NumFATs), buf, &offset, NumFATsSIZE);
+  __memcpy(&(info.BPB_RootEntCnt), buf, &offset, RootEntCntSIZE);
+  __memcpy(&(info.BPB_TotSec16), buf, &offset, TotSec16SIZE);
+  __memcpy(&(info.BPB_Media), buf, &offset, MediaSIZE);
+  return check_fat_bpb(&info, true);
+}
 
 int fat_load_dentry(struct fat_dentry *dentry, const void *buf)
 {
@@ -303,139 +412,655 @@ int fat_load_dentry(struct fat_dentry *dentry, const void *buf)
   return offset;
 }
 
+/**
+ * read_error - print out error of image.
+ * @path: image file path
+ * @msg:  what failed
+ * @err:  errno
+ */
+static void read_error(const char *path, const char *msg, int err)
+{
+  fprintf(stderr, "%s: %s: %s\n", path, msg, strerror(err));
+}
+
+/**
+ * read_tree - get directory tree of image, from index cache if possible.
+ * @path: image file path
+ * @vol:  FAT volume
+ * @tree: directory tree to initialize
+ * @jobs: count of threads to read directories
+ *
+ * Return: 0 - success
+ *         negative - error (errno)
+ */
+static int read_tree(const char *path, struct fat_volume *vol,
+    struct fat_tree *tree, int jobs)
+{
+  int err;
+
+  if (cache_dir && !vol->img->seg && !fat_index_load(vol, cache_dir, tree))
+    return 0;
+  if ((err = fat_build_tree(vol, tree, jobs)) < 0)
+    return err;
+  if (cache_dir && !vol->img->seg && (err = fat_index_save(vol, cache_dir, tree, path)) < 0)
+    read_error(path, _("index write error"), -err);
+  return 0;
+}
+
+/**
+ * read_delta - rescan image against its last index.
+ * @path: image file path
+ * @vol:  FAT volume
+ * @tree: directory tree to build
+ * @out:  output sink of changes
+ *
+ * Without last index, every entry is reported as created.
+ * New index is written, so that next run reports changes since this one.
+ *
+ * Return: 0 - success
+ *         negative - error (errno)
+ */
+static int read_delta(const char *path, struct fat_volume *vol,
+    struct fat_tree *tree, struct fat_output *out)
+{
+  int err;
+  char *link;
+  struct fat_index idx;
+  bool found = false;
+
+  if (!vol->img->seg && (link = fat_index_link(cache_dir, path, vol->img->base))) {
+    found = !fat_index_open(&idx, link);
+    free(link);
+  }
+  err = fat_rescan(vol, found ? &idx : NULL, tree, out);
+  if (found)
+    fat_index_close(&idx);
+  if (err < 0)
+    return err;
+
+  if (!vol->img->seg && (err = fat_index_save(vol, cache_dir, tree, path)) < 0)
+    read_error(path, _("index write error"), -err);
+  return 0;
+}
+
+/**
+ * read_volume - read FAT volume to output.
+ * @path:   image file path
+ * @label:  name of volume in output and messages
+ * @img:    image, or window of partition
+ * @fp:     output stream
+ * @jobs:   count of threads to read directories
+ * @header: print out @label before volume
+ *
+ * Return: 0 - success
+ *         otherwise - error(show ERROR STATUS CODE)
+ */
+static int read_volume(const char *path, const char *label,
+    struct fat_image *img, FILE *fp, int jobs, bool header)
+{
+  int err = 0;
+  struct fat_volume vol;
+  struct fat_tree tree;
+  struct fat_output out;
+
+  fat_output_open(&out, fp, format);
+  if (header)
+    out.ops->image(&out, label);
+
+  if ((err = fat_volume_open(&vol, img)) < 0) {
+    if (err == -EIO)
+      read_error(label, _("file read error"), EIO);
+    err = -EINVAL;
+    goto out;
+  }
+  if (!show_hash && !show_recover && !show_frag && !check_fats
+      && !verify)
+    out.ops->volume(&out, &vol);
+  /* FAT12, FAT16, FAT32 -> 0, 1, 2 */
+  __atomic_fetch_add(&(summary.volumes[vol.fstype / 16]), 1, __ATOMIC_RELAXED);
+
+  if (show_delta) {
+    if ((err = read_delta(path, &vol, &tree, &out)) < 0) {
+      read_error(label, _("directory read error"), -err);
+      goto vol_end;
+    }
+    __atomic_fetch_add(&(summary.entries), tree.count, __ATOMIC_RELAXED);
+    goto tree_end;
+  }
+
+  if ((err = read_tree(path, &vol, &tree, jobs)) < 0) {
+    read_error(label, _("directory read error"), -err);
+    goto vol_end;
+  }
+  __atomic_fetch_add(&(summary.entries), tree.count, __ATOMIC_RELAXED);
+  if (show_hash) {
+    if ((err = fat_digest_tree(&vol, &tree, &out, jobs)) < 0 && err != -EIO)
+      read_error(label, _("hash error"), -err);
+    goto tree_end;
+  }
+  if (show_recover) {
+    if ((err = fat_recover(&vol, &tree, &out, jobs)) < 0)
+      read_error(label, _("recovery error"), -err);
+    goto tree_end;
+  }
+  if (show_frag) {
+    if ((err = fat_frag_report(&vol, &tree, &out, jobs)) < 0 && err != -EIO)
+      read_error(label, _("fragmentation error"), -err);
+    goto tree_end;
+  }
+  if (check_fats) {
+    if ((err = fat_mirror_check(&vol, &tree, &out, jobs)) < 0 && err != -EIO)
+      read_error(label, _("FAT check error"), -err);
+    goto tree_end;
+  }
+  if (verify) {
+    if ((err = fat_verify_volume(&vol, &tree, &out)) < 0 && err != -EIO)
+      read_error(label, _("verify error"), -err);
+    goto tree_end;
+  }
+  if (show_extents && (err = fat_tree_extents(&vol, &tree)) < 0)
+    goto tree_end;
+  err = fat_dump_tree(&tree, &out);
+tree_end:
+  fat_free_tree(&tree);
+vol_end:
+  fat_volume_close(&vol);
+out:
+  if (fat_output_close(&out) < 0 && !err) {
+    read_error(label, _("write error"), EIO);
+    err = -EIO;
+  }
+  return err;
+}
+
+/**
+ * Partitions of one image, read as batch
+ */
+struct read_part {
+  const char *path;
+  struct fat_image *img;
+  struct fat_part *part;
+  int jobs;             /* threads to read directories of each partition */
+};
+
+/**
+ * read_partition - read FAT volume in one partition.
+ * @label: name of partition
+ * @index: index of partition
+ * @fp:    output stream of this partition
+ * @arg:   partitions of image
+ */
+static int read_partition(const char *label, size_t index, FILE *fp, void *arg)
+{
+  int err;
+  struct read_part *rp = arg;
+  struct fat_image win;
+
+  if ((err = fat_image_window(&win, rp->img, rp->part[index].offset,
+          rp->part[index].size)) < 0) {
+    read_error(label, _("file read error"), -err);
+    return err;
+  }
+  err = read_volume(rp->path, label, &win, fp, rp->jobs, true);
+  fat_image_close(&win);
+  return err;
+}
+
+/**
+ * read_partitions - read FAT volumes of all partitions.
+ * @path:  image file path
+ * @img:   image
+ * @part:  partitions holding FAT volume
+ * @count: count of @part
+ * @fp:    output stream
+ * @jobs:  count of threads
+ *
+ * Each partition is a window of @img, named "PATH:pN". With many threads,
+ * partitions are read at once, sharing the threads, and printed out in
+ * order of partition table. One after another, each gets all threads.
+ *
+ * Return: 0 - success
+ *         otherwise - error(show ERROR STATUS CODE)
+ */
+static int read_partitions(const char *path, struct fat_image *img,
+    struct fat_part *part, size_t count, FILE *fp, int jobs)
+{
+  int err = 0;
+  size_t i, len = strlen(path) + sizeof(":p4294967295");
+  char **label;
+  struct read_part rp = {
+    .path = path,
+    .img = img,
+    .part = part,
+    .jobs = jobs,
+  };
+  struct fat_batch b = {
+    .count = count,
+    .fn = read_partition,
+    .arg = &rp,
+    .out = fp,
+  };
+
+  if (!(label = calloc(count, sizeof(*label))))
+    return -ENOMEM;
+  for (i = 0; i < count; i++) {
+    if (!(label[i] = malloc(len))) {
+      err = -ENOMEM;
+      goto out;
+    }
+    snprintf(label[i], len, "%s:p%u", path, part[i].number);
+  }
+
+  if (jobs > 1 && count > 1) {
+    b.path = label;
+    rp.jobs = jobs / count > 1 ? jobs / count : 1;
+    if ((err = fat_batch_run(&b, jobs)) < 0)
+      read_error(path, _("file read error"), -err);
+    else if (err)
+      err = -EINVAL;
+    goto out;
+  }
+  for (i = 0; i < count; i++)
+    if (read_partition(label[i], i, fp, &rp))
+      err = -EINVAL;
+out:
+  for (i = 0; i < count; i++)
+    free(label[i]);
+  free(label);
+  return err;
+}
+
 /**
  * read_file - read file to output Hexadecimal.
+ * @path: image file path
+ * @fp:   output stream
+ * @jobs: count of threads to read directories
+ *
+ * Whole disk image is read partition by partition.
  *
  * Return: 0 - success
  *         otherwise - error(show ERROR STATUS CODE)
  */
-int read_file(const char *path)
+int read_file(const char *path, FILE *fp, int jobs)
 {
   int err = 0;
-  int secv;
-  int offset = 0;
   size_t count = 0;
-  unsigned char resv_area[RESVAREA_SIZE + 1];
-  unsigned char fsinfo_area[RESVAREA_SIZE + 1];
-  unsigned char *fat_area;
-  unsigned char *root_area;
-  FILE *fin;
-  FILE *fout = stdout;
-  enum FStype fstype;
-  u_int16_t sector;
-  u_int32_t secsPerFat;
-  u_int32_t totSec;
-  u_int32_t CountofClusters;
-  u_int16_t FatStartSector;
-  u_int32_t FatSectors;
-  u_int32_t RootDirStartSector;
-  u_int32_t RootDirSectors;
-  u_int32_t DataStartSector;
-  u_int32_t DataSectors;
-
-  struct fat_reserved_info resv_info = {0};
-  struct fat_dentry dentry = {0};
-  struct fat32_fsinfo fs_info = {0};
-
-  if ((fin = fopen(path, "rb")) == NULL) {
-    perror(_("file open error"));
-    err = EXIT_FAILURE;
-    goto out;
+  struct fat_image img;
+  struct fat_part *part = NULL;
+  struct fat_output out;
+
+  if ((err = fat_image_open(&img, path)) < 0) {
+    fat_output_open(&out, fp, format);
+    if (batch)
+      out.ops->image(&out, path);
+    read_error(path, _("file open error"), -err);
+    fat_output_close(&out);
+    return EXIT_FAILURE;
   }
 
-  count = fread(resv_area, sizeof(resv_area[0]), RESVAREA_SIZE, fin);
-  if (count < RESVAREA_SIZE) {
-    perror(_("file read error"));
-    err = -EINVAL;
-    goto fin_end;
+  if (!img.seg && (err = fat_part_scan(&img, &part, &count)) < 0)
+    read_error(path, _("partition table error"), -err);
+  else if (count)
+    err = read_partitions(path, &img, part, count, fp, jobs);
+  else
+    err = read_volume(path, path, &img, fp, jobs, batch);
+  free(part);
+  fat_image_close(&img);
+  return err;
+}
+
+/**
+ * open_image - open image, or one partition of whole disk image.
+ * @label: image file path, or "PATH:pN" for partition N of PATH
+ * @file:  image file path (output, to be freed)
+ * @img:   image to initialize
+ * @win:   window of partition to initialize
+ * @vimg:  image holding FAT volume (output, @img or @win)
+ *
+ * ":pN" is taken as partition only when @label itself does not exist.
+ * A whole disk image with a single FAT partition may be given without it.
+ * On success, @win and then @img must be closed.
+ *
+ * Return: 0 - success
+ *         otherwise - error(show ERROR STATUS CODE)
+ */
+static int open_image(const char *label, char **file, struct fat_image *img,
+    struct fat_image *win, struct fat_image **vimg)
+{
+  int err;
+  size_t i, count = 0;
+  unsigned long number = 0;
+  const char *p;
+  char *end;
+  struct fat_part *part = NULL;
+
+  p = strrchr(label, ':');
+  if (p && p[1] == 'p' && isdigit((unsigned char)p[2])
+      && access(label, F_OK) < 0) {
+    number = strtoul(p + 2, &end, 10);
+    if (*end || !number || number > UINT_MAX)
+      number = 0;
+  }
+  if (!(*file = number ? strndup(label, p - label) : strdup(label))) {
+    read_error(label, _("file open error"), ENOMEM);
+    return EXIT_FAILURE;
+  }
+  if ((err = fat_image_open(img, *file)) < 0) {
+    read_error(label, _("file open error"), -err);
+    goto err_free;
   }
 
-  offset = fat_load_reservedinfo(&resv_info, resv_area);
-  if (offset < 0) {
-    err = -EINVAL;
-    goto fin_end;
+  *vimg = img;
+  if (!img->seg && (err = fat_part_scan(img, &part, &count)) < 0) {
+    read_error(label, _("partition table error"), -err);
+    goto err_close;
+  }
+  if (!count && !number)
+    return 0;
+  for (i = 0; i < count; i++)
+    if (part[i].number == number || (!number && count == 1))
+      break;
+  if (i == count) {
+    if (number)
+      read_error(label, _("partition table error"), ENOENT);
+    else
+      fprintf(stderr, _("%s: %zu FAT partitions, select one as %s:pN\n"),
+          label, count, label);
+    goto err_close;
+  }
+  if ((err = fat_image_window(win, img, part[i].offset, part[i].size)) < 0) {
+    read_error(label, _("file read error"), -err);
+    goto err_close;
   }
+  free(part);
+  *vimg = win;
+  return 0;
 
-  fat_dump_reservedinfo(&resv_info, fout);
-  sector = resv_info.BPB_BytesPerSec;
+err_close:
+  free(part);
+  fat_image_close(img);
+err_free:
+  free(*file);
+  *file = NULL;
+  return EXIT_FAILURE;
+}
+
+/**
+ * close_image - release image opened by open_image().
+ * @file: image file path
+ * @img:  image
+ * @vimg: image holding FAT volume
+ */
+static void close_image(char *file, struct fat_image *img, struct fat_image *vimg)
+{
+  if (vimg != img)
+    fat_image_close(vimg);
+  fat_image_close(img);
+  free(file);
+}
+
+/**
+ * diff_files - print out changed entries between two images.
+ * @path: two image file paths
+ *
+ * Return: 0 - success
+ *         otherwise - error(show ERROR STATUS CODE)
+ */
+static int diff_files(char **path)
+{
+  int i, n, err = 0;
+  char *file[2];
+  struct fat_image img[2], win[2], *vimg[2];
+  struct fat_volume vol[2];
+  struct fat_output out;
 
-  if (is_fat32format(&resv_info)) {
-    /* RESERVED AREA */
-    fat32_load_reservedinfo(&resv_info, resv_area, offset);
-    fat32_dump_reservedinfo(&resv_info, fout);
-    /* FSIFNO AREA */
-    count = fread(fsinfo_area, sizeof(fsinfo_area[0]), RESVAREA_SIZE, fin);
-    if (count < RESVAREA_SIZE) {
-      perror(_("file read error"));
+  fat_output_open(&out, stdout, format);
+  for (n = 0; n < 2; n++) {
+    if ((err = open_image(path[n], &file[n], &img[n], &win[n], &vimg[n])))
+      goto out;
+    if ((err = fat_volume_open(&vol[n], vimg[n])) < 0) {
+      if (err == -EIO)
+        read_error(path[n], _("file read error"), EIO);
+      close_image(file[n], &img[n], vimg[n]);
       err = -EINVAL;
-      goto fin_end;
+      goto out;
     }
-    fat32_load_fsinfo(&fs_info, fsinfo_area);
-    fat32_dump_fsinfo(&fs_info, fout);
+  }
+
+  if ((err = fat_diff(&vol[0], &vol[1], &out)) < 0)
+    read_error(path[1], _("directory read error"), -err);
+out:
+  for (i = 0; i < n; i++) {
+    fat_volume_close(&vol[i]);
+    close_image(file[i], &img[i], vimg[i]);
+  }
+  if (fat_output_close(&out) < 0 && !err) {
+    fprintf(stderr, "%s\n", strerror(EIO));
+    err = -EIO;
+  }
+  return err;
+}
+
+/**
+ * extract_file - write out files of image.
+ * @path: image file path
+ *
+ * Return: 0 - success
+ *         otherwise - error(show ERROR STATUS CODE)
+ */
+static int extract_file(const char *path)
+{
+  int err = 0;
+  char *file;
+  struct fat_image img, win, *vimg;
+  struct fat_volume vol;
+  struct fat_tree tree;
+  struct fat_node *node;
 
-    secsPerFat = ((struct fat32_reserved_info *)(resv_info.reserved1))->BPB_FATSz32;
-    totSec = resv_info.BPB_TotSec32;
+  if ((err = open_image(path, &file, &img, &win, &vimg)))
+    return err;
+  if ((err = fat_volume_open(&vol, vimg)) < 0) {
+    if (err == -EIO)
+      read_error(path, _("file read error"), EIO);
+    err = -EINVAL;
+    goto img_end;
+  }
+  if ((err = read_tree(file, &vol, &tree, jobs)) < 0) {
+    read_error(path, _("directory read error"), -err);
+    goto vol_end;
+  }
+
+  if (extract_dir) {
+    if ((err = fat_extract_tree(&vol, &tree, extract_dir)) < 0)
+      read_error(extract_dir, _("extract error"), -err);
+  } else if (!(node = fat_lookup_path(&tree, extract_path))) {
+    read_error(extract_path, _("extract error"), ENOENT);
+    err = -ENOENT;
   } else {
-    fat12_load_reservedinfo(&resv_info, resv_area, offset);
-    fat12_dump_reservedinfo(&resv_info, fout);
-    secsPerFat = resv_info.BPB_FATSz16;
-    totSec = resv_info.BPB_TotSec16;
-  }
-
-  FatStartSector = resv_info.BPB_RevdSecCnt;
-  FatSectors = secsPerFat * resv_info.BPB_NumFATs;
-  RootDirStartSector = FatStartSector + FatSectors;
-  RootDirSectors = (32 * resv_info.BPB_RootEntCnt + resv_info.BPB_BytesPerSec - 1)
-    / resv_info.BPB_BytesPerSec;
-  DataStartSector = RootDirStartSector + RootDirSectors;
-  DataSectors = totSec - DataStartSector;
-
-  fprintf(fout, "%-28s\t: %08x - %08x\n", _("Fat Table Sector"), FatStartSector * sector,
-      FatStartSector * sector +  FatSectors * sector - 1);
-  fprintf(fout, "%-28s\t: %08x - %08x\n", _("Root Directory Sector"), RootDirStartSector * sector,
-      RootDirStartSector * sector +  RootDirSectors * sector - 1);
-  fprintf(fout, "%-28s\t: %08x - %08x\n", _("Data Directory Sector"), DataStartSector * sector,
-      DataStartSector * sector +  DataSectors * sector - 1);
-
-  CountofClusters = DataSectors / resv_info.BPB_SecPerClus;
-  if (CountofClusters < FAT16_CLUSTERS)
-    fstype = FAT12_FILESYSTEM;
-  else if (CountofClusters < FAT32_CLUSTERS)
-    fstype = FAT16_FILESYSTEM;
-  else
-    fstype = FAT32_FILESYSTEM;
+    fflush(stdout);
+    if ((err = fat_extract_node(&vol, node, STDOUT_FILENO)) < 0)
+      read_error(extract_path, _("extract error"), -err);
+  }
+
+  fat_free_tree(&tree);
+vol_end:
+  fat_volume_close(&vol);
+img_end:
+  close_image(file, &img, vimg);
+  return err;
+}
+
+/**
+ * stat_one - print out entry of one path.
+ * @l:     path lookup index
+ * @out:   output sink
+ * @query: path from root
+ *
+ * Root directory has no directory entry, so it is rejected.
+ *
+ * Return: 0 - success
+ *         -ENOENT - no such entry
+ *         -EINVAL - root directory
+ *         -ENOMEM - out of memory
+ */
+static int stat_one(struct fat_lookup *l, struct fat_output *out, const char *query)
+{
+  size_t len;
+  char *parent;
+  struct fat_node *dir, *node;
 
-  fat_area = malloc(FatSectors * sector);
-  fseek(fin, FatStartSector * sector ,SEEK_SET);
-  count = fread(fat_area, sizeof(fat_area[0]), FatSectors * sector, fin);
-  if (count < FatStartSector * sector) {
-    perror(_("file read error"));
+  if (!(node = fat_lookup(l, query, &dir))) {
+    read_error(query, _("stat error"), ENOENT);
+    return -ENOENT;
+  }
+  if (node == &(l->tree->root)) {
+    fprintf(stderr, _("%s: stat error: root directory has no directory entry\n"),
+        query);
+    return -EINVAL;
+  }
+  /* parent as given, without the last component */
+  len = strlen(query);
+  while (len && query[len - 1] == '/')
+    len--;
+  while (len && query[len - 1] != '/')
+    len--;
+  while (len > 1 && query[len - 1] == '/')
+    len--;
+  if (!(parent = len ? strndup(query, len) : strdup("/")))
+    return -ENOMEM;
+  out->ops->dir(out, query, node);
+  out->ops->dentry(out, parent, dir, node);
+  free(parent);
+  return 0;
+}
+
+/**
+ * stat_file - print out entries of paths in image.
+ * @path: image file path
+ *
+ * Paths are looked up in an index built once per image, so that each
+ * path costs a hash lookup per component.
+ *
+ * Return: 0 - success
+ *         otherwise - error(show ERROR STATUS CODE)
+ */
+static int stat_file(const char *path)
+{
+  int err = 0, ret;
+  size_t i, j, n;
+  char **list, *file;
+  struct fat_image img, win, *vimg;
+  struct fat_volume vol;
+  struct fat_tree tree;
+  struct fat_lookup l;
+  struct fat_output out;
+
+  if ((err = open_image(path, &file, &img, &win, &vimg)))
+    return err;
+  if ((err = fat_volume_open(&vol, vimg)) < 0) {
+    if (err == -EIO)
+      read_error(path, _("file read error"), EIO);
     err = -EINVAL;
-    goto fat_end;
+    goto img_end;
+  }
+  if ((err = read_tree(file, &vol, &tree, jobs)) < 0) {
+    read_error(path, _("directory read error"), -err);
+    goto vol_end;
+  }
+  if ((err = fat_lookup_init(&l, &vol, &tree)) < 0) {
+    read_error(path, _("directory read error"), -err);
+    goto tree_end;
   }
 
-  fprintf(fout, "\n%s:\n", "/");
-  root_area = malloc(sizeof(struct fat_dentry) + 1);
-  fseek(fin, RootDirStartSector * sector, SEEK_SET);
-  for(secv = 0; secv < RootDirSectors * sector; secv += sizeof(struct fat_dentry)) {
-    count = fread(root_area, sizeof(root_area[0]), sizeof(struct fat_dentry), fin);
-    if (count < sizeof(struct fat_dentry))
-      break;
-    if (check_dentryfree(root_area))
+  fat_output_open(&out, stdout, format);
+  for (i = 0; i < stat_count && err != -ENOMEM; i++) {
+    if (strcmp(stat_path[i], "-")) {
+      if ((ret = stat_one(&l, &out, stat_path[i])) < 0)
+        err = ret;
       continue;
-    fat_load_dentry(&dentry, root_area);
-    fat_dump_dentry(&dentry, fout);
-    putchar('\n');
-  }
-  free(root_area);
-fat_end:
-  free(fat_area);
-fin_end:
-  fclose(fin);
-out:
+    }
+    if (fat_batch_read_list(stdin, &list, &n) < 0) {
+      read_error("-", _("file read error"), ENOMEM);
+      err = -ENOMEM;
+      break;
+    }
+    for (j = 0; j < n; j++) {
+      if (err != -ENOMEM && (ret = stat_one(&l, &out, list[j])) < 0)
+        err = ret;
+      free(list[j]);
+    }
+    free(list);
+  }
+  if (fat_output_close(&out) < 0 && !err) {
+    read_error(path, _("write error"), EIO);
+    err = -EIO;
+  }
+
+  fat_lookup_free(&l);
+tree_end:
+  fat_free_tree(&tree);
+vol_end:
+  fat_volume_close(&vol);
+img_end:
+  close_image(file, &img, vimg);
   return err;
 }
 
+/**
+ * read_batch - read one image of batch.
+ * @path:  image file path
+ * @index: unused
+ * @fp:    output stream of this image
+ * @arg:   unused
+ */
+static int read_batch(const char *path, size_t index, FILE *fp, void *arg)
+{
+  return read_file(path, fp, 1);
+}
+
+/**
+ * dump_summary - print out aggregate summary of batch.
+ * @count:  count of images
+ * @failed: count of failed images
+ * @out:    output stream
+ */
+static void dump_summary(size_t count, size_t failed, FILE *out)
+{
+  fprintf(out, "%-28s\t: %zu\n", _("Images"), count);
+  fprintf(out, "%-28s\t: %zu\n", _("Failed images"), failed);
+  fprintf(out, "%-28s\t: %zu\n", _("FAT12 volumes"), summary.volumes[0]);
+  fprintf(out, "%-28s\t: %zu\n", _("FAT16 volumes"), summary.volumes[1]);
+  fprintf(out, "%-28s\t: %zu\n", _("FAT32 volumes"), summary.volumes[2]);
+  fprintf(out, "%-28s\t: %zu\n", _("Directory entries"), summary.entries);
+}
+
+/**
+ * read_files - read many images on thread pool.
+ * @path:  image file paths
+ * @count: count of @path
+ *
+ * Return: 0 - success
+ *         otherwise - error(show ERROR STATUS CODE)
+ */
+static int read_files(char **path, size_t count)
+{
+  int err;
+  struct fat_batch b = {
+    .path = path,
+    .count = count,
+    .fn = read_batch,
+    .out = stdout,
+  };
+
+  if ((err = fat_batch_run(&b, jobs)) < 0) {
+    fprintf(stderr, "%s\n", strerror(-err));
+    return EXIT_FAILURE;
+  }
+  fflush(stdout);
+  dump_summary(count, err, stderr);
+  return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 /**
  * main - make a hexdump or do the reverse
  * @argc: count of arguments
@@ -447,18 +1072,82 @@ int main(int argc, char *argv[])
   int longindex;
   int n_files;
   int ret = 0;
+  FILE *list;
+  char **path, *end;
+  long val;
+  size_t i, count;
 
   setlocale (LC_ALL, "");
   bindtextdomain (PACKAGE, LOCALEDIR);
   textdomain (PACKAGE);
+  setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
   /**
    * Initialize Phase.
    * parse option, argument. set flags.
    */
   while ((opt = getopt_long(argc, argv,
-          "o:",
+          "C:def:j:o:s:T:x:X:",
           longopts, &longindex)) != -1) {
     switch (opt) {
+      case 'C':
+        cache_dir = optarg;
+        break;
+      case 'd':
+        show_delta = true;
+        break;
+      case 'e':
+        show_extents = true;
+        break;
+      case 'f':
+        if ((ret = fat_output_format(optarg)) < 0)
+          usage(CMDLINE_FAILURE);
+        format = ret;
+        ret = 0;
+        break;
+      case 'j':
+        errno = 0;
+        val = strtol(optarg, &end, 10);
+        if (errno || end == optarg || *end || val < 0 || val > INT_MAX)
+          usage(CMDLINE_FAILURE);
+        jobs = val;
+        if (!jobs)
+          jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        break;
+      case 's':
+        if (!(path = realloc(stat_path, (stat_count + 1) * sizeof(*path)))) {
+          perror(argv[0]);
+          exit(EXIT_FAILURE);
+        }
+        stat_path = path;
+        stat_path[stat_count++] = optarg;
+        break;
+      case 'T':
+        files_from = optarg;
+        break;
+      case 'x':
+        extract_path = optarg;
+        break;
+      case 'X':
+        extract_dir = optarg;
+        break;
+      case GETOPT_DIFF_CHAR:
+        show_diff = true;
+        break;
+      case GETOPT_HASH_CHAR:
+        show_hash = true;
+        break;
+      case GETOPT_RECOVER_CHAR:
+        show_recover = true;
+        break;
+      case GETOPT_FRAG_CHAR:
+        show_frag = true;
+        break;
+      case GETOPT_CHECK_FATS_CHAR:
+        check_fats = true;
+        break;
+      case GETOPT_VERIFY_CHAR:
+        verify = true;
+        break;
       case 'o':
       case GETOPT_HELP_CHAR:
         usage(EXIT_SUCCESS);
@@ -472,12 +1161,63 @@ int main(int argc, char *argv[])
     }
   }
 
+  if ((show_delta && !cache_dir) || (show_delta && show_hash)
+      || (show_recover && (show_delta || show_hash))
+      || (show_frag && (show_delta || show_hash || show_recover))
+      || (check_fats && (show_delta || show_hash || show_recover || show_frag))
+      || (verify && (show_delta || show_hash || show_recover || show_frag
+          || check_fats)))
+    usage(CMDLINE_FAILURE);
+
   n_files = argc - optind;
+  if (show_diff) {
+    if (n_files != 2 || files_from || show_delta)
+      usage(CMDLINE_FAILURE);
+    return diff_files(argv + optind);
+  }
+  if (extract_path || extract_dir) {
+    if (n_files != 1 || files_from || show_delta || (extract_path && extract_dir))
+      usage(CMDLINE_FAILURE);
+    return extract_file(argv[optind]);
+  }
+  if (stat_count) {
+    if (n_files != 1 || files_from || show_delta)
+      usage(CMDLINE_FAILURE);
+    ret = stat_file(argv[optind]);
+    free(stat_path);
+    return ret;
+  }
+  if (files_from) {
+    if (n_files)
+      usage(CMDLINE_FAILURE);
+    list = strcmp(files_from, "-") ? fopen(files_from, "r") : stdin;
+    if (!list) {
+      perror(files_from);
+      exit(EXIT_FAILURE);
+    }
+    ret = fat_batch_read_list(list, &path, &count);
+    if (list != stdin)
+      fclose(list);
+    if (ret < 0) {
+      perror(files_from);
+      exit(EXIT_FAILURE);
+    }
+    batch = true;
+    ret = read_files(path, count);
+    for (i = 0; i < count; i++)
+      free(path[i]);
+    free(path);
+    return ret;
+  }
   if (!n_files) {
     usage(CMDLINE_FAILURE);
     exit(EXIT_FAILURE);
   }
+  if (n_files > 1) {
+    batch = true;
+    return read_files(argv + optind, n_files);
+  }
 
-  ret = read_file(argv[optind]);
+  ret = read_file(argv[optind], stdout, jobs);
   return ret;
 }
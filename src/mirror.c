@@ -0,0 +1,584 @@
+/*
+ * mirror.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_MIRROR_SIMD 1
+#endif
+
+#include "fat.h"
+
+/**
+ * Range of differing clusters, with result of chain check
+ */
+struct fat_mirror_range {
+  struct fat_mirror m;
+  u_int32_t choice; /* copy assumed to be right while checking other ranges */
+  u_int32_t stamp;  /* last chain which crossed this range */
+};
+
+/**
+ * Chain which crosses some differing ranges
+ */
+struct fat_mirror_walk {
+  u_int32_t cluster;
+  u_int32_t expect;   /* clusters of file (0: any) */
+  size_t first;       /* crossed ranges in state */
+  size_t count;
+};
+
+/**
+ * Part of FAT compared by one task
+ */
+struct fat_mirror_chunk {
+  size_t start;
+  size_t end;
+  struct fat_mirror_range *range;
+  u_int32_t count;
+  u_int32_t alloc;
+  int err;
+};
+
+/**
+ * State of check
+ */
+struct fat_mirror_state {
+  struct fat_volume *vol;
+  struct fat_volume *copy; /* volume reading each copy of FAT */
+  unsigned int copies;
+  u_int32_t last;          /* last cluster which has FAT entry */
+  struct fat_mirror_chunk all;
+  unsigned char *dirty;    /* clusters in differing ranges */
+  u_int32_t seq;
+  struct fat_mirror_walk *walk;
+  size_t nwalk;
+  size_t walk_alloc;
+  u_int32_t *crossed;      /* ranges crossed by each chain */
+  size_t ncrossed;
+  size_t crossed_alloc;
+};
+
+#ifdef FAT_MIRROR_SIMD
+__attribute__((target("avx2")))
+static size_t fat_mirror_same_avx2(const unsigned char *a,
+    const unsigned char *b, size_t len)
+{
+  size_t i;
+  __m256i lo, hi;
+
+  for (i = 0; i + FAT_MIRROR_BLOCK <= len; i += FAT_MIRROR_BLOCK) {
+    lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+        _mm256_loadu_si256((const __m256i *)(b + i)));
+    hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i + 32)),
+        _mm256_loadu_si256((const __m256i *)(b + i + 32)));
+    if (_mm256_movemask_epi8(_mm256_and_si256(lo, hi)) != -1)
+      break;
+  }
+  return i;
+}
+#endif
+
+/**
+ * fat_mirror_same - skip same blocks of two buffers.
+ * @a:   first buffer
+ * @b:   second buffer
+ * @len: length of buffers
+ *
+ * Buffers are compared in FAT_MIRROR_BLOCK bytes (one cache line) blocks,
+ * by AVX2 when possible.
+ *
+ * Return: offset of first differing block, or @len if buffers are same
+ */
+static size_t fat_mirror_same(const unsigned char *a, const unsigned char *b,
+    size_t len)
+{
+  size_t i = 0;
+
+#ifdef FAT_MIRROR_SIMD
+  if (__builtin_cpu_supports("avx2"))
+    i = fat_mirror_same_avx2(a, b, len);
+  else
+#endif
+    for (; i + FAT_MIRROR_BLOCK <= len; i += FAT_MIRROR_BLOCK)
+      if (memcmp(a + i, b + i, FAT_MIRROR_BLOCK))
+        break;
+
+  if (i + FAT_MIRROR_BLOCK <= len)
+    return i;
+  return memcmp(a + i, b + i, len - i) ? i : len;
+}
+
+/**
+ * fat_mirror_add - add differing clusters to ranges.
+ * @c:     ranges in order of cluster
+ * @first: first cluster
+ * @last:  last cluster
+ * @mask:  copies which differ
+ *
+ * Clusters next to, or overlapping with, last range are joined to it.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+static int fat_mirror_add(struct fat_mirror_chunk *c, u_int32_t first,
+    u_int32_t last, u_int32_t mask)
+{
+  struct fat_mirror_range *r = c->count ? &(c->range[c->count - 1]) : NULL;
+
+  if (r && first <= r->m.last + 1) {
+    if (last > r->m.last)
+      r->m.last = last;
+    r->m.differs |= mask;
+    return 0;
+  }
+  if (c->count == c->alloc) {
+    c->alloc = c->alloc ? c->alloc * 2 : 16;
+    if (!(r = realloc(c->range, c->alloc * sizeof(*r))))
+      return -ENOMEM;
+    c->range = r;
+  }
+  r = &(c->range[c->count++]);
+  memset(r, 0, sizeof(*r));
+  r->m.first = first;
+  r->m.last = last;
+  r->m.differs = mask;
+  return 0;
+}
+
+/**
+ * fat_mirror_scan - compare copies of FAT in one chunk.
+ * @pool:   thread pool
+ * @worker: index of worker
+ * @arg:    chunk to compare
+ *
+ * Same blocks of all copies are skipped, and bytes of differing block are
+ * compared one by one to find clusters whose entries have differing bits.
+ */
+static void fat_mirror_scan(struct fat_pool *pool, int worker, void *arg)
+{
+  struct fat_mirror_state *s = pool->data;
+  struct fat_mirror_chunk *c = arg;
+  const unsigned char *fat = s->vol->fat;
+  size_t size = s->vol->geo.fat_size;
+  size_t pos = c->start, next, i, n;
+  u_int32_t bits = s->vol->fstype;
+  u_int32_t first, last, mask, diff;
+  unsigned int k;
+
+  while (pos < c->end) {
+    next = c->end;
+    for (k = 1; k < s->copies; k++)
+      next = pos + fat_mirror_same(fat + pos, fat + k * size + pos, next - pos);
+    if (next == c->end)
+      break;
+
+    n = c->end - next < FAT_MIRROR_BLOCK ? c->end - next : FAT_MIRROR_BLOCK;
+    for (i = next; i < next + n; i++) {
+      mask = 0;
+      diff = 0;
+      for (k = 1; k < s->copies; k++) {
+        if (fat[i] == fat[k * size + i])
+          continue;
+        diff |= fat[i] ^ fat[k * size + i];
+        mask |= 1U << k;
+      }
+      if (!mask)
+        continue;
+      /* entries are little endian bit stream, FAT12 entries share byte */
+      first = ((u_int64_t)i * 8 + __builtin_ctz(diff)) / bits;
+      last = ((u_int64_t)i * 8 + 31 - __builtin_clz(diff)) / bits;
+      if (last > s->last)
+        last = s->last;
+      if (first <= last && fat_mirror_add(c, first, last, mask) < 0) {
+        c->err = -ENOMEM;
+        return;
+      }
+    }
+    pos = next + n;
+  }
+}
+
+/**
+ * fat_mirror_find - find range which holds cluster.
+ * @s:    state of check
+ * @clus: cluster in some range
+ *
+ * Return: index of range
+ */
+static u_int32_t fat_mirror_find(struct fat_mirror_state *s, u_int32_t clus)
+{
+  u_int32_t lo = 0, hi = s->all.count, mid = 0;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (clus < s->all.range[mid].m.first)
+      hi = mid;
+    else if (clus > s->all.range[mid].m.last)
+      lo = mid + 1;
+    else
+      break;
+  }
+  return mid;
+}
+
+/**
+ * fat_mirror_cross - record that current chain crosses differing cluster.
+ * @s:    state of check
+ * @clus: cluster in some range
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+static int fat_mirror_cross(struct fat_mirror_state *s, u_int32_t clus)
+{
+  u_int32_t i = fat_mirror_find(s, clus);
+  u_int32_t *tmp;
+
+  if (s->all.range[i].stamp == s->seq)
+    return 0;
+  s->all.range[i].stamp = s->seq;
+  if (s->ncrossed == s->crossed_alloc) {
+    s->crossed_alloc = s->crossed_alloc ? s->crossed_alloc * 2 : 64;
+    if (!(tmp = realloc(s->crossed, s->crossed_alloc * sizeof(*tmp))))
+      return -ENOMEM;
+    s->crossed = tmp;
+  }
+  s->crossed[s->ncrossed++] = i;
+  return 0;
+}
+
+/**
+ * fat_mirror_chain - find differing ranges which chain crosses.
+ * @s:      state of check
+ * @clus:   first cluster
+ * @expect: count of clusters of file (0: any, such as directory)
+ *
+ * Chain is walked with each copy of FAT, and kept to check later if it
+ * crosses some ranges.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+static int fat_mirror_chain(struct fat_mirror_state *s, u_int32_t clus,
+    u_int32_t expect)
+{
+  int err;
+  size_t i, first = s->ncrossed;
+  unsigned int k;
+  struct fat_chain ch;
+  struct fat_mirror_walk *w;
+
+  s->seq++;
+  for (k = 0; k < s->copies; k++) {
+    fat_chain_init(&ch, &(s->copy[k]), clus);
+    while (fat_chain_next(&ch))
+      if (test_bit(s->dirty, ch.cluster)
+          && (err = fat_mirror_cross(s, ch.cluster)) < 0)
+        return err;
+  }
+  if (s->ncrossed == first)
+    return 0;
+
+  if (s->nwalk == s->walk_alloc) {
+    s->walk_alloc = s->walk_alloc ? s->walk_alloc * 2 : 64;
+    if (!(w = realloc(s->walk, s->walk_alloc * sizeof(*w))))
+      return -ENOMEM;
+    s->walk = w;
+  }
+  w = &(s->walk[s->nwalk++]);
+  w->cluster = clus;
+  w->expect = expect;
+  w->first = first;
+  w->count = s->ncrossed - first;
+  for (i = first; i < s->ncrossed; i++)
+    s->all.range[s->crossed[i]].m.chains++;
+  return 0;
+}
+
+/**
+ * fat_mirror_follow - whether chain is consistent with one copy in range.
+ * @s:     state of check
+ * @w:     chain
+ * @range: index of range
+ * @copy:  copy of FAT to read entries in @range from
+ *
+ * Entries in other ranges are read from copy chosen for them so far, and
+ * the rest from first FAT. Chain is consistent if it ends without invalid
+ * cluster or loop, and its length matches size of file.
+ */
+static bool fat_mirror_follow(struct fat_mirror_state *s,
+    struct fat_mirror_walk *w, u_int32_t range, unsigned int copy)
+{
+  struct fat_volume *vol = s->vol;
+  u_int32_t clus = w->cluster, i, k;
+  u_int32_t count = 0, power = 1, mark = 0;
+
+  while (true) {
+    if (!fat_valid_cluster(vol, clus) || clus == mark)
+      return false;
+    if (++count == power) {
+      mark = clus;
+      power *= 2;
+    }
+    k = 0;
+    if (test_bit(s->dirty, clus)) {
+      i = fat_mirror_find(s, clus);
+      k = i == range ? copy : s->all.range[i].choice;
+    }
+    clus = fat_get_entry(&(s->copy[k]), clus);
+    if (fat_is_eoc(vol, clus))
+      break;
+  }
+  return !w->expect || count == w->expect;
+}
+
+/**
+ * fat_mirror_resolve - find copies which are consistent in each range.
+ * @s:   state of check
+ * @all: all copies
+ *
+ * When a chain crosses some ranges, whether it is consistent with a copy
+ * in one range depends on copies used in others. Each range assumes first
+ * FAT at first, and then the only consistent copy, until no assumption
+ * changes.
+ */
+static void fat_mirror_resolve(struct fat_mirror_state *s, u_int32_t all)
+{
+  int round;
+  size_t i, j;
+  unsigned int k;
+  bool changed = true;
+  struct fat_mirror_walk *w;
+  struct fat_mirror_range *r;
+
+  for (round = 0; changed && round < FAT_MIRROR_ROUNDS; round++) {
+    for (j = 0; j < s->all.count; j++)
+      s->all.range[j].m.matches = all;
+    for (i = 0; i < s->nwalk; i++) {
+      w = &(s->walk[i]);
+      for (j = w->first; j < w->first + w->count; j++) {
+        r = &(s->all.range[s->crossed[j]]);
+        for (k = 0; k < s->copies; k++)
+          if ((r->m.matches & (1U << k))
+              && !fat_mirror_follow(s, w, s->crossed[j], k))
+            r->m.matches &= ~(1U << k);
+      }
+    }
+
+    changed = false;
+    for (j = 0; j < s->all.count; j++) {
+      r = &(s->all.range[j]);
+      if (!r->m.chains || __builtin_popcount(r->m.matches) != 1)
+        continue;
+      k = __builtin_ctz(r->m.matches);
+      if (r->choice != k) {
+        r->choice = k;
+        changed = true;
+      }
+    }
+  }
+}
+
+static int fat_mirror_node(struct fat_node *node, void *arg)
+{
+  struct fat_mirror_state *s = arg;
+  struct fat_dentry *d = &(node->dentry);
+  u_int32_t clus, cluster_size = s->vol->geo.cluster_size;
+
+  if ((d->DIR_Attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME
+      || (d->DIR_Attr & ATTR_VOLUME_ID) || d->IR_Name[0] == DENTRY_DOT)
+    return 0;
+  if (!(clus = fat_dentry_cluster(s->vol, d)))
+    return 0;
+  if (d->DIR_Attr & ATTR_DIRECTORY)
+    return fat_mirror_chain(s, clus, 0);
+  return fat_mirror_chain(s, clus,
+      ((u_int64_t)d->DIR_FileSize + cluster_size - 1) / cluster_size);
+}
+
+/**
+ * fat_mirror_free - which copies mark all clusters of range as free.
+ * @s: state of check
+ * @r: range which no chain crosses
+ */
+static u_int32_t fat_mirror_free(struct fat_mirror_state *s,
+    struct fat_mirror_range *r)
+{
+  u_int32_t clus, mask = 0;
+  unsigned int k;
+
+  for (k = 0; k < s->copies; k++) {
+    for (clus = r->m.first; clus <= r->m.last; clus++)
+      if (fat_get_entry(&(s->copy[k]), clus))
+        break;
+    if (clus > r->m.last)
+      mask |= 1U << k;
+  }
+  return mask;
+}
+
+/**
+ * fat_mirror_check - compare copies of FAT.
+ * @vol:  FAT volume
+ * @tree: directory tree
+ * @out:  output sink
+ * @jobs: count of threads
+ *
+ * Copies are compared with first FAT in FAT_MIRROR_CHUNK bytes chunks on
+ * thread pool. Then chains of files and directories crossing differing
+ * ranges are walked, to tell which copy is consistent in each range:
+ * crossing chains are not broken with it, or, if no chain crosses the
+ * range, clusters are free in it.
+ *
+ * Return: 0 - all copies are same
+ *         -EIO - some copies differ
+ *         negative - error (errno)
+ */
+int fat_mirror_check(struct fat_volume *vol, struct fat_tree *tree,
+    struct fat_output *out, int jobs)
+{
+  int err = 0;
+  size_t i, nchunk = 0;
+  u_int32_t j, clus, all;
+  unsigned int k;
+  struct fat_pool pool;
+  struct fat_mirrorstat stat = {0};
+  struct fat_mirror_state s = {
+    .vol = vol,
+    .copies = vol->resv.BPB_NumFATs,
+    .last = vol->CountofClusters + 1,
+  };
+  struct fat_mirror_chunk *chunk = NULL, *c;
+  struct fat_mirror_range *r;
+
+  if (s.copies > FAT_MIRROR_COPIES) {
+    fprintf(stderr, _("only first %d copies of FAT are compared\n"),
+        FAT_MIRROR_COPIES);
+    s.copies = FAT_MIRROR_COPIES;
+  }
+  all = s.copies == 32 ? ~0U : (1U << s.copies) - 1;
+  stat.copies = s.copies;
+  stat.bytes = (((u_int64_t)s.last + 1) * vol->fstype + 7) / 8;
+  if (stat.bytes > vol->geo.fat_size)
+    stat.bytes = vol->geo.fat_size;
+  if (s.copies < 2)
+    goto report;
+
+  nchunk = (stat.bytes + FAT_MIRROR_CHUNK - 1) / FAT_MIRROR_CHUNK;
+  if (!(chunk = calloc(nchunk, sizeof(*chunk)))) {
+    err = -ENOMEM;
+    goto out;
+  }
+  for (i = 0; i < nchunk; i++) {
+    chunk[i].start = i * FAT_MIRROR_CHUNK;
+    chunk[i].end = i + 1 < nchunk ? (i + 1) * FAT_MIRROR_CHUNK : stat.bytes;
+  }
+  if (jobs > 1 && nchunk > 1 && !fat_pool_init(&pool, jobs)) {
+    pool.data = &s;
+    for (i = 0; i < nchunk; i++)
+      if ((err = fat_pool_submit(&pool, -1, fat_mirror_scan, &(chunk[i]))) < 0)
+        break;
+    fat_pool_wait(&pool);
+    fat_pool_destroy(&pool);
+    if (err < 0)
+      goto out;
+  } else {
+    pool.data = &s;
+    for (i = 0; i < nchunk; i++)
+      fat_mirror_scan(&pool, 0, &(chunk[i]));
+  }
+
+  /* join ranges across chunks */
+  for (i = 0; i < nchunk; i++) {
+    c = &(chunk[i]);
+    if ((err = c->err) < 0)
+      goto out;
+    for (j = 0; j < c->count; j++)
+      if ((err = fat_mirror_add(&(s.all), c->range[j].m.first,
+              c->range[j].m.last, c->range[j].m.differs)) < 0)
+        goto out;
+  }
+  if (!s.all.count)
+    goto report;
+
+  /* walk chains with each copy */
+  s.copy = malloc(s.copies * sizeof(*(s.copy)));
+  s.dirty = calloc((size_t)s.last / CHAR_BIT + 1, 1);
+  if (!s.copy || !s.dirty) {
+    err = -ENOMEM;
+    goto out;
+  }
+  for (k = 0; k < s.copies; k++) {
+    s.copy[k] = *vol;
+    s.copy[k].fat = vol->fat + (size_t)k * vol->geo.fat_size;
+    /* expanded FAT12 table is of first FAT only */
+    if (k)
+      s.copy[k].fat12 = NULL;
+  }
+  for (j = 0; j < s.all.count; j++)
+    for (clus = s.all.range[j].m.first; clus <= s.all.range[j].m.last; clus++)
+      set_bit(s.dirty, clus);
+  if (vol->fstype == FAT32_FILESYSTEM
+      && (err = fat_mirror_chain(&s, vol->RootClus, 0)) < 0)
+    goto out;
+  if ((err = fat_tree_foreach(tree, fat_mirror_node, &s)) < 0)
+    goto out;
+
+  fat_mirror_resolve(&s, all);
+
+  for (j = 0; j < s.all.count; j++) {
+    r = &(s.all.range[j]);
+    if (!r->m.chains)
+      r->m.matches = fat_mirror_free(&s, r);
+    out->ops->mirror(out, &(r->m));
+    stat.ranges++;
+    stat.clusters += r->m.last - r->m.first + 1;
+  }
+  err = -EIO;
+report:
+  out->ops->mirrorstat(out, &stat);
+out:
+  if (chunk)
+    for (i = 0; i < nchunk; i++)
+      free(chunk[i].range);
+  free(chunk);
+  free(s.all.range);
+  free(s.copy);
+  free(s.dirty);
+  free(s.walk);
+  free(s.crossed);
+  return err;
+}
@@ -0,0 +1,834 @@
+/*
+ * output.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+#define LABEL_SIZE 64
+
+/**
+ * Labels of dentry in text output
+ */
+enum {
+  LABEL_NAME,
+  LABEL_ATTR,
+  LABEL_NTRES,
+  LABEL_CTIME,
+  LABEL_ATIME,
+  LABEL_MTIME,
+  LABEL_CLUSTER,
+  LABEL_FILESIZE,
+  LABEL_LONGNAME,
+  LABEL_COUNT,
+};
+
+/* translated and padded labels, attribute strings (built only once) */
+static char fat_label[LABEL_COUNT][LABEL_SIZE];
+static char fat_attrname[256][ATTR_ONELINE];
+static pthread_once_t fat_label_once = PTHREAD_ONCE_INIT;
+/* mark of each change in delta */
+static const char fat_change_mark[] = {'+', '-', 'M'};
+/* mark of each type, and name of each state in recovery */
+static const char fat_found_mark[] = {'D', 'O'};
+static const char *const fat_found_state[] = {
+  "recoverable", "partial", "overwritten", "empty",
+};
+
+static void fat_output_labels(void)
+{
+  int i;
+  const char *label[LABEL_COUNT] = {
+    _("FileName"),
+    _("File Attribute"),
+    _("Smaller information"),
+    _("Create Time (ms)"),
+    _("Access Time (ms)"),
+    _("Modify Time (ms)"),
+    _("First Sector"),
+    _("File size"),
+    _("Long File Name"),
+  };
+
+  for (i = 0; i < LABEL_COUNT; i++)
+    snprintf(fat_label[i], LABEL_SIZE, "%-28s\t: ", label[i]);
+  for (i = 0; i < 256; i++)
+    fat_attrformat((unsigned char *)fat_attrname[i], i);
+}
+
+/**
+ * text output
+ */
+static void fat_text_image(struct fat_output *out, const char *path)
+{
+  fprintf(out->fp, "==> %s <==\n", path);
+}
+
+static void fat_text_volume(struct fat_output *out, struct fat_volume *vol)
+{
+  fat_volume_dump(vol, out->fp);
+}
+
+static void fat_text_dir(struct fat_output *out, const char *path,
+    struct fat_node *dir)
+{
+  fprintf(out->fp, "\n%s:\n", path);
+}
+
+static void fat_text_dentry(struct fat_output *out, const char *path,
+    struct fat_node *dir, struct fat_node *node)
+{
+  int len;
+  char line[LABEL_COUNT * (LABEL_SIZE + ATTR_ONELINE)];
+  unsigned char name[NameSIZE + 1];
+  struct fat_dentry *d = &(node->dentry);
+  struct tm mtime = {0}, atime = {0}, ctime = {0};
+  u_int16_t msec = d->DIR_CrtTimeTenth;
+
+  fat_timeformat(&mtime, d->DIR_WrtTime);
+  fat_dateformat(&mtime, d->DIR_WrtDate);
+  fat_dateformat(&atime, d->DIR_LstAccDate);
+  fat_timeformat(&ctime, d->DIR_CrtTime);
+  fat_dateformat(&ctime, d->DIR_CrtDate);
+
+  len = snprintf(line, sizeof(line),
+      "%s%s\n%s%s\n%s%x\n"
+      "%s%d-%02d-%02d %02d:%02d:%02d.%02d\n"
+      "%s%d-%02d-%02d %02d:%02d:%02d.%02d\n"
+      "%s%d-%02d-%02d %02d:%02d:%02d.%02d\n"
+      "%s%02x %02x\n%s%x\n",
+      fat_label[LABEL_NAME], setcharc(d->IR_Name, name, NameSIZE),
+      fat_label[LABEL_ATTR], fat_attrname[d->DIR_Attr],
+      fat_label[LABEL_NTRES], d->DIR_NTRes,
+      fat_label[LABEL_CTIME], 1980 + ctime.tm_year, ctime.tm_mon, ctime.tm_mday,
+      ctime.tm_hour, ctime.tm_min, (ctime.tm_sec * 2) + (msec / 100), msec % 100,
+      fat_label[LABEL_ATIME], 1980 + atime.tm_year, atime.tm_mon, atime.tm_mday,
+      0, 0, 0, 0,
+      fat_label[LABEL_MTIME], 1980 + mtime.tm_year, mtime.tm_mon, mtime.tm_mday,
+      mtime.tm_hour, mtime.tm_min, mtime.tm_sec * 2, 0,
+      fat_label[LABEL_CLUSTER], d->DIR_FstClusHI, d->DIR_FstClusLO,
+      fat_label[LABEL_FILESIZE], d->DIR_FileSize);
+  fwrite(line, 1, len < sizeof(line) ? len : sizeof(line) - 1, out->fp);
+  if (node->name)
+    fprintf(out->fp, "%s%s\n", fat_label[LABEL_LONGNAME], node->name);
+
+  if (node->extent)
+    fat_dump_extents(node, out->fp);
+  fputc('\n', out->fp);
+}
+
+static void fat_text_delta(struct fat_output *out, enum fat_change change,
+    const char *path, struct fat_node *dir, struct fat_node *node)
+{
+  char name[NameSIZE + 2];
+
+  fprintf(out->fp, "%c %s/%s\n", fat_change_mark[change],
+      strcmp(path, "/") ? path : "", fat_node_name(node, name));
+}
+
+static void fat_text_digest(struct fat_output *out, const char *path,
+    struct fat_node *node, u_int64_t digest)
+{
+  fprintf(out->fp, "%016llx  %10u  %s\n", (unsigned long long)digest,
+      node->dentry.DIR_FileSize, path);
+}
+
+static void fat_text_found(struct fat_output *out, struct fat_found *found)
+{
+  u_int32_t i;
+  char name[NameSIZE + 2];
+  struct fat_dentry d = found->dentry;
+
+  if (found->type == FOUND_ORPHAN) {
+    fprintf(out->fp, "%c %#010llx  cluster %u, parent %u  %s\n",
+        fat_found_mark[found->type], (unsigned long long)found->offset,
+        found->cluster, found->parent, fat_found_state[found->state]);
+    return;
+  }
+
+  d.IR_Name[0] = '?';
+  fprintf(out->fp, "%c %#010llx  %-12s  %10u  %s", fat_found_mark[found->type],
+      (unsigned long long)found->offset, fat_format_shortname(&d, name),
+      d.DIR_FileSize, fat_found_state[found->state]);
+  for (i = 0; i < found->nextent; i++)
+    fprintf(out->fp, " %u-%u", found->extent[i].cluster,
+        found->extent[i].cluster + found->extent[i].count - 1);
+  fputc('\n', out->fp);
+}
+
+static void fat_text_frag(struct fat_output *out, const char *path,
+    struct fat_node *node, u_int32_t extents, u_int32_t clusters)
+{
+  fprintf(out->fp, "%8u  %10u  %s\n", extents, clusters, path);
+}
+
+static void fat_text_fragstat(struct fat_output *out, struct fat_frag *frag)
+{
+  int i, level;
+  char map[FAT_FRAG_HEAT + 1];
+  static const char shade[] = " .:-=+*#%@";
+
+  fputc('\n', out->fp);
+  fprintf(out->fp, "%-28s\t: %llu\n", _("Files"), (unsigned long long)frag->files);
+  fprintf(out->fp, "%-28s\t: %llu\n", _("Fragmented files"),
+      (unsigned long long)frag->fragmented);
+  fprintf(out->fp, "%-28s\t: %llu\n", _("Extents"),
+      (unsigned long long)frag->extents);
+  fprintf(out->fp, "%-28s\t: %u / %u\n", _("Free clusters"), frag->free,
+      frag->clusters);
+  fprintf(out->fp, "%-28s\t: %u\n", _("Free extents"), frag->free_extents);
+  fprintf(out->fp, "%-28s\t: %u\n", _("Largest free extent"), frag->largest_free);
+  for (i = 0; i < FAT_FRAG_BUCKETS; i++) {
+    if (!frag->histogram[i])
+      continue;
+    fprintf(out->fp, "  %10u - %-10u\t\t: %u\n", 1U << i,
+        (u_int32_t)((2ULL << i) - 1), frag->histogram[i]);
+  }
+  /* small volume does not fill all cells */
+  for (i = 0; i < FAT_FRAG_HEAT
+      && (u_int64_t)i * frag->heat_clusters < frag->clusters; i++) {
+    level = frag->heat[i] ? 1 + (frag->heat[i] - 1) * 9 / 100 : 0;
+    map[i] = shade[level];
+  }
+  map[i] = '\0';
+  fprintf(out->fp, "%-28s\t: [%s] (%u clusters each)\n", _("Allocation map"),
+      map, frag->heat_clusters);
+}
+
+/* "FAT2,FAT3" of copies in @mask ("-" if none) */
+static char *fat_text_copies(char *buf, u_int32_t mask)
+{
+  int k;
+  char *p = buf;
+
+  for (k = 0; k < FAT_MIRROR_COPIES; k++)
+    if (mask & (1U << k))
+      p += sprintf(p, "%sFAT%d", p == buf ? "" : ",", k + 1);
+  if (p == buf)
+    strcpy(buf, "-");
+  return buf;
+}
+
+static void fat_text_mirror(struct fat_output *out, struct fat_mirror *m)
+{
+  char differs[FAT_MIRROR_COPIES * 7], matches[FAT_MIRROR_COPIES * 7];
+
+  fprintf(out->fp, "%10u - %-10u  %-10s  %8u  %s\n", m->first, m->last,
+      fat_text_copies(differs, m->differs), m->chains,
+      fat_text_copies(matches, m->matches));
+}
+
+static void fat_text_mirrorstat(struct fat_output *out, struct fat_mirrorstat *stat)
+{
+  if (stat->ranges)
+    fputc('\n', out->fp);
+  fprintf(out->fp, "%-28s\t: %u\n", _("FAT copies"), stat->copies);
+  fprintf(out->fp, "%-28s\t: %llu\n", _("Compared bytes"),
+      (unsigned long long)stat->bytes);
+  fprintf(out->fp, "%-28s\t: %u\n", _("Differing ranges"), stat->ranges);
+  fprintf(out->fp, "%-28s\t: %llu\n", _("Differing clusters"),
+      (unsigned long long)stat->clusters);
+}
+
+/* names of enum fat_problem_kind */
+static const char *fat_problem_name(u_int32_t kind)
+{
+  static const char *names[] = {
+    [PROBLEM_INVALID] = "invalid",
+    [PROBLEM_FREE] = "free",
+    [PROBLEM_BAD] = "bad",
+    [PROBLEM_LOOP] = "loop",
+    [PROBLEM_CROSSLINK] = "crosslink",
+    [PROBLEM_LENGTH] = "length",
+    [PROBLEM_DOT] = "dot",
+    [PROBLEM_DOTDOT] = "dotdot",
+    [PROBLEM_LOST] = "lost",
+    [PROBLEM_MEDIA] = "media",
+    [PROBLEM_FSINFO_FREE] = "fsinfo-free",
+    [PROBLEM_FSINFO_NEXT] = "fsinfo-next",
+  };
+
+  if (kind >= sizeof(names) / sizeof(names[0]))
+    return "unknown";
+  return names[kind];
+}
+
+static void fat_text_problem(struct fat_output *out, const char *path,
+    struct fat_problem *p)
+{
+  fprintf(out->fp, "%-11s  %10u  %10u  %s\n", fat_problem_name(p->kind),
+      p->cluster, p->value, path ? path : "-");
+}
+
+static void fat_text_verifystat(struct fat_output *out, struct fat_verify *v)
+{
+  if (v->problems)
+    fputc('\n', out->fp);
+  fprintf(out->fp, "%-28s\t: %llu\n", _("Files"),
+      (unsigned long long)v->files);
+  fprintf(out->fp, "%-28s\t: %llu\n", _("Directories"),
+      (unsigned long long)v->dirs);
+  fprintf(out->fp, "%-28s\t: %u / %u\n", _("Free clusters"),
+      v->free, v->clusters);
+  fprintf(out->fp, "%-28s\t: %u\n", _("Bad clusters"), v->bad);
+  fprintf(out->fp, "%-28s\t: %u\n", _("Invalid FAT entries"), v->invalid);
+  fprintf(out->fp, "%-28s\t: %u\n", _("Cross-linked clusters"),
+      v->crosslinked);
+  fprintf(out->fp, "%-28s\t: %u (%u clusters)\n", _("Lost chains"),
+      v->lost_chains, v->lost_clusters);
+  fprintf(out->fp, "%-28s\t: %llu\n", _("Problems"),
+      (unsigned long long)v->problems);
+}
+
+static const struct fat_output_ops fat_text_ops = {
+  .image = fat_text_image,
+  .volume = fat_text_volume,
+  .dir = fat_text_dir,
+  .dentry = fat_text_dentry,
+  .delta = fat_text_delta,
+  .digest = fat_text_digest,
+  .found = fat_text_found,
+  .frag = fat_text_frag,
+  .fragstat = fat_text_fragstat,
+  .mirror = fat_text_mirror,
+  .mirrorstat = fat_text_mirrorstat,
+  .problem = fat_text_problem,
+  .verifystat = fat_text_verifystat,
+};
+
+/**
+ * JSON output (one object per line)
+ */
+/**
+ * fat_json_utf8 - get length of UTF-8 sequence.
+ * @p: string
+ *
+ * Return: length of valid sequence at @p, or 0
+ */
+static int fat_json_utf8(const unsigned char *p)
+{
+  int i, n;
+
+  if (*p >= 0xc2 && *p < 0xe0)
+    n = 2;
+  else if (*p >= 0xe0 && *p < 0xf0)
+    n = 3;
+  else if (*p >= 0xf0 && *p < 0xf5)
+    n = 4;
+  else
+    return 0;
+  for (i = 1; i < n; i++)
+    if ((p[i] & 0xc0) != 0x80)
+      return 0;
+  return n;
+}
+
+/* UTF-8 (long file name) is kept, other bytes (OEM short name) are escaped */
+static void fat_json_string(FILE *fp, const char *s)
+{
+  int n;
+  const unsigned char *p;
+
+  fputc('"', fp);
+  for (p = (const unsigned char *)s; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      fprintf(fp, "\\%c", *p);
+    else if (*p >= 0x80 && (n = fat_json_utf8(p))) {
+      fwrite(p, 1, n, fp);
+      p += n - 1;
+    } else if (*p < 0x20 || *p >= 0x7f)
+      fprintf(fp, "\\u%04x", *p);
+    else
+      fputc(*p, fp);
+  }
+  fputc('"', fp);
+}
+
+static void fat_json_image(struct fat_output *out, const char *path)
+{
+  fputs("{\"type\":\"image\",\"path\":", out->fp);
+  fat_json_string(out->fp, path);
+  fputs("}\n", out->fp);
+}
+
+static void fat_json_volume(struct fat_output *out, struct fat_volume *vol)
+{
+  struct fat_stat st;
+  unsigned char label[VolLabSIZE + 1];
+  struct fat12_reserved_info *fat12_info = (struct fat12_reserved_info *)(vol->resv.reserved1);
+  struct fat32_reserved_info *fat32_info = (struct fat32_reserved_info *)(vol->resv.reserved1);
+
+  fat_count_fattable(vol, &st);
+  setcharc(is_fat32format(&(vol->resv)) ? fat32_info->BS_VolLab : fat12_info->BS_VolLab,
+      label, VolLabSIZE);
+
+  fprintf(out->fp, "{\"type\":\"volume\",\"fstype\":%d,\"label\":", vol->fstype);
+  fat_json_string(out->fp, (char *)label);
+  fprintf(out->fp, ",\"bytes_per_sector\":%u,\"sectors_per_cluster\":%u"
+      ",\"reserved_sectors\":%u,\"fats\":%u,\"root_entries\":%u"
+      ",\"total_sectors\":%u,\"sectors_per_fat\":%u,\"clusters\":%u"
+      ",\"root_cluster\":%u,\"free\":%u,\"bad\":%u}\n",
+      vol->geo.sector, vol->resv.BPB_SecPerClus, vol->resv.BPB_RevdSecCnt,
+      vol->resv.BPB_NumFATs, vol->resv.BPB_RootEntCnt, vol->totSec,
+      vol->secsPerFat, vol->CountofClusters, vol->RootClus, st.free, st.bad);
+}
+
+static void fat_json_dir(struct fat_output *out, const char *path,
+    struct fat_node *dir)
+{
+}
+
+static void fat_json_dentry(struct fat_output *out, const char *path,
+    struct fat_node *dir, struct fat_node *node)
+{
+  u_int32_t i;
+  char name[NameSIZE + 2];
+  struct fat_dentry *d = &(node->dentry);
+  struct tm mtime = {0}, atime = {0}, ctime = {0};
+  u_int16_t msec = d->DIR_CrtTimeTenth;
+
+  /* long name slots are given as long_name of their dentry */
+  if ((d->DIR_Attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME)
+    return;
+  fat_timeformat(&mtime, d->DIR_WrtTime);
+  fat_dateformat(&mtime, d->DIR_WrtDate);
+  fat_dateformat(&atime, d->DIR_LstAccDate);
+  fat_timeformat(&ctime, d->DIR_CrtTime);
+  fat_dateformat(&ctime, d->DIR_CrtDate);
+
+  fputs("{\"type\":\"dentry\",\"dir\":", out->fp);
+  fat_json_string(out->fp, path);
+  fputs(",\"name\":", out->fp);
+  fat_json_string(out->fp, fat_format_shortname(d, name));
+  if (node->name) {
+    fputs(",\"long_name\":", out->fp);
+    fat_json_string(out->fp, node->name);
+  }
+  fprintf(out->fp, ",\"attr\":%u,\"cluster\":%u,\"size\":%u,\"offset\":%llu"
+      ",\"ctime\":\"%d-%02d-%02dT%02d:%02d:%02d.%02d\""
+      ",\"atime\":\"%d-%02d-%02d\""
+      ",\"mtime\":\"%d-%02d-%02dT%02d:%02d:%02d\"",
+      d->DIR_Attr, ((u_int32_t)d->DIR_FstClusHI << 16) | d->DIR_FstClusLO,
+      d->DIR_FileSize, (unsigned long long)node->offset,
+      1980 + ctime.tm_year, ctime.tm_mon, ctime.tm_mday,
+      ctime.tm_hour, ctime.tm_min, (ctime.tm_sec * 2) + (msec / 100), msec % 100,
+      1980 + atime.tm_year, atime.tm_mon, atime.tm_mday,
+      1980 + mtime.tm_year, mtime.tm_mon, mtime.tm_mday,
+      mtime.tm_hour, mtime.tm_min, mtime.tm_sec * 2);
+  if (node->extent) {
+    fputs(",\"extents\":[", out->fp);
+    for (i = 0; i < node->nextent; i++)
+      fprintf(out->fp, "%s[%u,%u]", i ? "," : "",
+          node->extent[i].cluster, node->extent[i].count);
+    fputc(']', out->fp);
+  }
+  fputs("}\n", out->fp);
+}
+
+static void fat_json_delta(struct fat_output *out, enum fat_change change,
+    const char *path, struct fat_node *dir, struct fat_node *node)
+{
+  static const char *const name[] = {"created", "deleted", "modified"};
+  char shortname[NameSIZE + 2];
+  struct fat_dentry *dentry = &(node->dentry);
+
+  fprintf(out->fp, "{\"type\":\"delta\",\"change\":\"%s\",\"dir\":", name[change]);
+  fat_json_string(out->fp, path);
+  fputs(",\"name\":", out->fp);
+  fat_json_string(out->fp, fat_format_shortname(dentry, shortname));
+  if (node->name) {
+    fputs(",\"long_name\":", out->fp);
+    fat_json_string(out->fp, node->name);
+  }
+  fprintf(out->fp, ",\"attr\":%u,\"cluster\":%u,\"size\":%u,\"offset\":%llu}\n",
+      dentry->DIR_Attr, ((u_int32_t)dentry->DIR_FstClusHI << 16) | dentry->DIR_FstClusLO,
+      dentry->DIR_FileSize, (unsigned long long)node->offset);
+}
+
+static void fat_json_digest(struct fat_output *out, const char *path,
+    struct fat_node *node, u_int64_t digest)
+{
+  fputs("{\"type\":\"hash\",\"path\":", out->fp);
+  fat_json_string(out->fp, path);
+  fprintf(out->fp, ",\"size\":%u,\"xxh64\":\"%016llx\"}\n",
+      node->dentry.DIR_FileSize, (unsigned long long)digest);
+}
+
+static void fat_json_found(struct fat_output *out, struct fat_found *found)
+{
+  u_int32_t i;
+  char name[NameSIZE + 2];
+  struct fat_dentry d = found->dentry;
+
+  if (found->type == FOUND_ORPHAN) {
+    fprintf(out->fp, "{\"type\":\"orphan\",\"offset\":%llu,\"cluster\":%u,"
+        "\"parent\":%u,\"state\":\"%s\"}\n", (unsigned long long)found->offset,
+        found->cluster, found->parent, fat_found_state[found->state]);
+    return;
+  }
+
+  d.IR_Name[0] = '?';
+  fprintf(out->fp, "{\"type\":\"deleted\",\"offset\":%llu,\"dir\":%u,\"name\":",
+      (unsigned long long)found->offset, found->cluster);
+  fat_json_string(out->fp, fat_format_shortname(&d, name));
+  fprintf(out->fp, ",\"attr\":%u,\"cluster\":%u,\"size\":%u,\"state\":\"%s\","
+      "\"runs\":[", d.DIR_Attr, ((u_int32_t)d.DIR_FstClusHI << 16) | d.DIR_FstClusLO,
+      d.DIR_FileSize, fat_found_state[found->state]);
+  for (i = 0; i < found->nextent; i++)
+    fprintf(out->fp, "%s[%u,%u]", i ? "," : "", found->extent[i].cluster,
+        found->extent[i].count);
+  fputs("]}\n", out->fp);
+}
+
+static void fat_json_frag(struct fat_output *out, const char *path,
+    struct fat_node *node, u_int32_t extents, u_int32_t clusters)
+{
+  fputs("{\"type\":\"frag\",\"path\":", out->fp);
+  fat_json_string(out->fp, path);
+  fprintf(out->fp, ",\"extents\":%u,\"clusters\":%u}\n", extents, clusters);
+}
+
+static void fat_json_fragstat(struct fat_output *out, struct fat_frag *frag)
+{
+  int i;
+
+  fprintf(out->fp, "{\"type\":\"fragstat\",\"files\":%llu,\"fragmented\":%llu,"
+      "\"extents\":%llu,\"clusters\":%u,\"free\":%u,\"free_extents\":%u,"
+      "\"largest_free\":%u,\"histogram\":[",
+      (unsigned long long)frag->files, (unsigned long long)frag->fragmented,
+      (unsigned long long)frag->extents, frag->clusters, frag->free,
+      frag->free_extents, frag->largest_free);
+  for (i = 0; i < FAT_FRAG_BUCKETS; i++)
+    fprintf(out->fp, "%s%u", i ? "," : "", frag->histogram[i]);
+  fprintf(out->fp, "],\"heat_clusters\":%u,\"heat\":[", frag->heat_clusters);
+  for (i = 0; i < FAT_FRAG_HEAT; i++)
+    fprintf(out->fp, "%s%u", i ? "," : "", frag->heat[i]);
+  fputs("]}\n", out->fp);
+}
+
+static void fat_json_copies(FILE *fp, u_int32_t mask)
+{
+  int k;
+  bool first = true;
+
+  fputc('[', fp);
+  for (k = 0; k < FAT_MIRROR_COPIES; k++) {
+    if (!(mask & (1U << k)))
+      continue;
+    fprintf(fp, "%s%d", first ? "" : ",", k + 1);
+    first = false;
+  }
+  fputc(']', fp);
+}
+
+static void fat_json_mirror(struct fat_output *out, struct fat_mirror *m)
+{
+  fprintf(out->fp, "{\"type\":\"mirror\",\"first\":%u,\"last\":%u,\"differs\":",
+      m->first, m->last);
+  fat_json_copies(out->fp, m->differs);
+  fprintf(out->fp, ",\"chains\":%u,\"matches\":", m->chains);
+  fat_json_copies(out->fp, m->matches);
+  fputs("}\n", out->fp);
+}
+
+static void fat_json_mirrorstat(struct fat_output *out, struct fat_mirrorstat *stat)
+{
+  fprintf(out->fp, "{\"type\":\"mirrorstat\",\"copies\":%u,\"bytes\":%llu,"
+      "\"ranges\":%u,\"clusters\":%llu}\n", stat->copies,
+      (unsigned long long)stat->bytes, stat->ranges,
+      (unsigned long long)stat->clusters);
+}
+
+static void fat_json_problem(struct fat_output *out, const char *path,
+    struct fat_problem *p)
+{
+  fprintf(out->fp, "{\"type\":\"problem\",\"kind\":\"%s\",\"path\":",
+      fat_problem_name(p->kind));
+  if (path)
+    fat_json_string(out->fp, path);
+  else
+    fputs("null", out->fp);
+  fprintf(out->fp, ",\"offset\":%llu,\"cluster\":%u,\"value\":%u}\n",
+      (unsigned long long)p->offset, p->cluster, p->value);
+}
+
+static void fat_json_verifystat(struct fat_output *out, struct fat_verify *v)
+{
+  fprintf(out->fp, "{\"type\":\"verifystat\",\"files\":%llu,\"dirs\":%llu,"
+      "\"problems\":%llu,\"clusters\":%u,\"free\":%u,\"bad\":%u,"
+      "\"invalid\":%u,\"crosslinked\":%u,\"lost_chains\":%u,"
+      "\"lost_clusters\":%u}\n", (unsigned long long)v->files,
+      (unsigned long long)v->dirs, (unsigned long long)v->problems,
+      v->clusters, v->free, v->bad, v->invalid, v->crosslinked,
+      v->lost_chains, v->lost_clusters);
+}
+
+static const struct fat_output_ops fat_json_ops = {
+  .image = fat_json_image,
+  .volume = fat_json_volume,
+  .dir = fat_json_dir,
+  .dentry = fat_json_dentry,
+  .delta = fat_json_delta,
+  .digest = fat_json_digest,
+  .found = fat_json_found,
+  .frag = fat_json_frag,
+  .fragstat = fat_json_fragstat,
+  .mirror = fat_json_mirror,
+  .mirrorstat = fat_json_mirrorstat,
+  .problem = fat_json_problem,
+  .verifystat = fat_json_verifystat,
+};
+
+/**
+ * binary output (fixed-width little endian records)
+ */
+static void fat_binary_image(struct fat_output *out, const char *path)
+{
+}
+
+static void fat_binary_volume(struct fat_output *out, struct fat_volume *vol)
+{
+  struct fat_binary_header hdr = {
+    .magic = FAT_BINARY_MAGIC,
+    .version = FAT_BINARY_VERSION,
+    .record_size = sizeof(struct fat_binary_record),
+    .fstype = vol->fstype,
+    .bytes_per_sector = vol->geo.sector,
+    .cluster_size = vol->geo.cluster_size,
+    .clusters = vol->CountofClusters,
+    .root_cluster = vol->RootClus,
+    .data_offset = vol->geo.data_offset,
+  };
+
+  fwrite(&hdr, sizeof(hdr), 1, out->fp);
+}
+
+static void fat_binary_dir(struct fat_output *out, const char *path,
+    struct fat_node *dir)
+{
+}
+
+static void fat_binary_dentry(struct fat_output *out, const char *path,
+    struct fat_node *dir, struct fat_node *node)
+{
+  struct fat_dentry *d = &(node->dentry);
+  struct fat_binary_record rec = {
+    .offset = node->offset,
+    .parent = dir->offset,
+    .cluster = ((u_int32_t)d->DIR_FstClusHI << 16) | d->DIR_FstClusLO,
+    .size = d->DIR_FileSize,
+    .crt_time = d->DIR_CrtTime,
+    .crt_date = d->DIR_CrtDate,
+    .acc_date = d->DIR_LstAccDate,
+    .wrt_time = d->DIR_WrtTime,
+    .wrt_date = d->DIR_WrtDate,
+    .attr = d->DIR_Attr,
+    .crt_tenth = d->DIR_CrtTimeTenth,
+  };
+
+  if ((d->DIR_Attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME)
+    return;
+  memcpy(rec.name, d->IR_Name, NameSIZE);
+  fwrite(&rec, sizeof(rec), 1, out->fp);
+}
+
+static void fat_binary_delta(struct fat_output *out, enum fat_change change,
+    const char *path, struct fat_node *dir, struct fat_node *node)
+{
+  struct fat_dentry *d = &(node->dentry);
+  struct fat_binary_record rec = {
+    .offset = node->offset,
+    .parent = dir->offset,
+    .cluster = ((u_int32_t)d->DIR_FstClusHI << 16) | d->DIR_FstClusLO,
+    .size = d->DIR_FileSize,
+    .crt_time = d->DIR_CrtTime,
+    .crt_date = d->DIR_CrtDate,
+    .acc_date = d->DIR_LstAccDate,
+    .wrt_time = d->DIR_WrtTime,
+    .wrt_date = d->DIR_WrtDate,
+    .attr = d->DIR_Attr,
+    .crt_tenth = d->DIR_CrtTimeTenth,
+    .change = fat_change_mark[change],
+  };
+
+  memcpy(rec.name, d->IR_Name, NameSIZE);
+  fwrite(&rec, sizeof(rec), 1, out->fp);
+}
+
+static void fat_binary_digest(struct fat_output *out, const char *path,
+    struct fat_node *node, u_int64_t digest)
+{
+  struct fat_binary_digest rec = {
+    .offset = node->offset,
+    .digest = digest,
+    .size = node->dentry.DIR_FileSize,
+  };
+
+  fwrite(&rec, sizeof(rec), 1, out->fp);
+}
+
+static void fat_binary_found(struct fat_output *out, struct fat_found *found)
+{
+  struct fat_dentry *d = &(found->dentry);
+  struct fat_binary_record rec = {
+    .offset = found->offset,
+    .cluster = ((u_int32_t)d->DIR_FstClusHI << 16) | d->DIR_FstClusLO,
+    .size = d->DIR_FileSize,
+    .crt_time = d->DIR_CrtTime,
+    .crt_date = d->DIR_CrtDate,
+    .acc_date = d->DIR_LstAccDate,
+    .wrt_time = d->DIR_WrtTime,
+    .wrt_date = d->DIR_WrtDate,
+    .attr = d->DIR_Attr,
+    .crt_tenth = d->DIR_CrtTimeTenth,
+    .change = fat_found_mark[found->type],
+  };
+
+  /* orphan: cluster of itself and of its parent */
+  if (found->type == FOUND_ORPHAN) {
+    rec.cluster = found->cluster;
+    rec.parent = found->parent;
+  }
+  memcpy(rec.name, d->IR_Name, NameSIZE);
+  fwrite(&rec, sizeof(rec), 1, out->fp);
+}
+
+static void fat_binary_frag(struct fat_output *out, const char *path,
+    struct fat_node *node, u_int32_t extents, u_int32_t clusters)
+{
+  struct fat_binary_frag rec = {
+    .offset = node->offset,
+    .extents = extents,
+    .clusters = clusters,
+  };
+
+  fwrite(&rec, sizeof(rec), 1, out->fp);
+}
+
+static void fat_binary_fragstat(struct fat_output *out, struct fat_frag *frag)
+{
+  fwrite(frag, sizeof(*frag), 1, out->fp);
+}
+
+static void fat_binary_mirror(struct fat_output *out, struct fat_mirror *m)
+{
+  fwrite(m, sizeof(*m), 1, out->fp);
+}
+
+static void fat_binary_mirrorstat(struct fat_output *out, struct fat_mirrorstat *stat)
+{
+  fwrite(stat, sizeof(*stat), 1, out->fp);
+}
+
+static void fat_binary_problem(struct fat_output *out, const char *path,
+    struct fat_problem *p)
+{
+  fwrite(p, sizeof(*p), 1, out->fp);
+}
+
+static void fat_binary_verifystat(struct fat_output *out, struct fat_verify *v)
+{
+  fwrite(v, sizeof(*v), 1, out->fp);
+}
+
+static const struct fat_output_ops fat_binary_ops = {
+  .image = fat_binary_image,
+  .volume = fat_binary_volume,
+  .dir = fat_binary_dir,
+  .dentry = fat_binary_dentry,
+  .delta = fat_binary_delta,
+  .digest = fat_binary_digest,
+  .found = fat_binary_found,
+  .frag = fat_binary_frag,
+  .fragstat = fat_binary_fragstat,
+  .mirror = fat_binary_mirror,
+  .mirrorstat = fat_binary_mirrorstat,
+  .problem = fat_binary_problem,
+  .verifystat = fat_binary_verifystat,
+};
+
+/**
+ * fat_output_format - get output format from its name.
+ * @name: "text", "json" or "binary"
+ *
+ * Return: output format
+ *         -EINVAL - unknown name
+ */
+int fat_output_format(const char *name)
+{
+  if (!strcmp(name, "text"))
+    return FORMAT_TEXT;
+  if (!strcmp(name, "json"))
+    return FORMAT_JSON;
+  if (!strcmp(name, "binary"))
+    return FORMAT_BINARY;
+  return -EINVAL;
+}
+
+/**
+ * fat_output_open - start output to stream.
+ * @out:    output sink
+ * @fp:     output stream
+ * @format: output format
+ */
+void fat_output_open(struct fat_output *out, FILE *fp, enum fat_output_format format)
+{
+  pthread_once(&fat_label_once, fat_output_labels);
+
+  out->fp = fp;
+  switch (format) {
+    case FORMAT_JSON:
+      out->ops = &fat_json_ops;
+      break;
+    case FORMAT_BINARY:
+      out->ops = &fat_binary_ops;
+      break;
+    default:
+      out->ops = &fat_text_ops;
+  }
+}
+
+/**
+ * fat_output_close - flush output.
+ * @out: output sink
+ *
+ * Return: 0 - success
+ *         -EIO - write error
+ */
+int fat_output_close(struct fat_output *out)
+{
+  if (fflush(out->fp) || ferror(out->fp))
+    return -EIO;
+  return 0;
+}
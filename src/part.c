@@ -0,0 +1,249 @@
+/*
+ * part.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/**
+ * Partitions found so far
+ */
+struct fat_part_list {
+  struct fat_image *img;
+  struct fat_part *part;
+  size_t count;
+  size_t alloc;
+};
+
+/**
+ * fat_part_extended - whether MBR partition type is extended partition.
+ * @type: partition type
+ */
+static bool fat_part_extended(u_int8_t type)
+{
+  return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+/**
+ * fat_part_add - append partition if it holds FAT volume.
+ * @list:   partitions found so far
+ * @offset: byte offset of partition
+ * @size:   byte length of partition
+ * @number: number of partition
+ *
+ * Partition type is not trusted: boot sector is probed instead, so that
+ * FAT volumes in partitions of other (or wrong) types are found as well.
+ *
+ * Return: 0 - success (also when partition is not FAT)
+ *         -ENOMEM - out of memory
+ */
+static int fat_part_add(struct fat_part_list *list, u_int64_t offset,
+    u_int64_t size, unsigned int number)
+{
+  bool fat;
+  unsigned char *boot;
+  struct fat_part *part;
+
+  if (!size || offset >= list->img->size
+      || list->img->size - offset < RESVAREA_SIZE)
+    return 0;
+  if (!(boot = fat_image_get(list->img, offset, RESVAREA_SIZE)))
+    return 0;
+  fat = fat_probe_bpb(boot);
+  fat_image_put(list->img, boot);
+  if (!fat)
+    return 0;
+
+  if (list->count == list->alloc) {
+    list->alloc = list->alloc ? list->alloc * 2 : 4;
+    if (!(part = realloc(list->part, list->alloc * sizeof(*part))))
+      return -ENOMEM;
+    list->part = part;
+  }
+  part = &(list->part[list->count++]);
+  part->offset = offset;
+  part->size = size;
+  part->number = number;
+  return 0;
+}
+
+/**
+ * fat_part_gpt - read GUID partition table.
+ * @list:   partitions found so far
+ * @sector: logical sector size of disk
+ *
+ * Return: 1 - GPT is found at LBA 1
+ *         0 - no GPT
+ *         -ENOMEM - out of memory
+ */
+static int fat_part_gpt(struct fat_part_list *list, u_int32_t sector)
+{
+  int err = 0;
+  u_int32_t i;
+  unsigned char *buf, *table;
+  struct fat_gpt_header hdr;
+  struct fat_gpt_entry e;
+  static const u_int8_t unused[16];
+
+  if (!(buf = fat_image_get(list->img, sector, sizeof(hdr))))
+    return 0;
+  memcpy(&hdr, buf, sizeof(hdr));
+  fat_image_put(list->img, buf);
+  if (memcmp(hdr.signature, GPT_SIGNATURE, sizeof(hdr.signature))
+      || hdr.entry_size < sizeof(e) || hdr.entry_size > sector
+      || hdr.entry_lba > list->img->size / sector)
+    return 0;
+  if (hdr.entry_count > FAT_PART_MAX)
+    hdr.entry_count = FAT_PART_MAX;
+
+  table = fat_image_get(list->img, hdr.entry_lba * sector,
+      (size_t)hdr.entry_count * hdr.entry_size);
+  if (!table)
+    return 0;
+  for (i = 0; i < hdr.entry_count && !err; i++) {
+    memcpy(&e, table + (size_t)i * hdr.entry_size, sizeof(e));
+    if (!memcmp(e.type_guid, unused, sizeof(unused)) || e.last_lba < e.first_lba
+        || e.first_lba > list->img->size / sector)
+      continue;
+    if (e.last_lba > list->img->size / sector)
+      e.last_lba = list->img->size / sector;
+    err = fat_part_add(list, e.first_lba * sector,
+        (e.last_lba - e.first_lba + 1) * sector, i + 1);
+  }
+  fat_image_put(list->img, table);
+  return err < 0 ? err : 1;
+}
+
+/**
+ * fat_part_logical - read chain of extended boot records.
+ * @list:  partitions found so far
+ * @start: first sector of extended partition
+ *
+ * Logical partition is relative to its EBR, and next EBR is relative to
+ * start of extended partition. Chain is cut after FAT_PART_MAX records,
+ * so that looping chain of broken image ends.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+static int fat_part_logical(struct fat_part_list *list, u_int32_t start)
+{
+  int err = 0, i;
+  unsigned int number = MBR_LOGICAL_FIRST;
+  u_int64_t ebr = start;
+  unsigned char *buf;
+  struct fat_mbr_entry e[2];
+
+  for (i = 0; i < FAT_PART_MAX && !err; i++) {
+    if (!(buf = fat_image_get(list->img, ebr * MBR_SECTOR_SIZE, RESVAREA_SIZE)))
+      break;
+    memcpy(e, buf + MBR_PART_OFFSET, sizeof(e));
+    if (buf[510] != 0x55 || buf[511] != 0xaa) {
+      fat_image_put(list->img, buf);
+      break;
+    }
+    fat_image_put(list->img, buf);
+
+    if (e[0].type && e[0].sectors && !fat_part_extended(e[0].type))
+      err = fat_part_add(list, (ebr + e[0].lba) * MBR_SECTOR_SIZE,
+          (u_int64_t)e[0].sectors * MBR_SECTOR_SIZE, number++);
+    if (!fat_part_extended(e[1].type) || !e[1].lba)
+      break;
+    ebr = (u_int64_t)start + e[1].lba;
+  }
+  return err;
+}
+
+/**
+ * fat_part_scan - find FAT volumes in partition table of whole disk image.
+ * @img:   image
+ * @part:  (out) allocated array of partitions, or NULL
+ * @count: (out) count of partitions
+ *
+ * When image itself starts with FAT boot sector, no partition is
+ * returned. Otherwise MBR (with logical partitions in extended partition)
+ * or GPT (behind protective MBR, with 512 or 4096 bytes sectors) is read,
+ * and every partition starting with FAT boot sector is returned.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+int fat_part_scan(struct fat_image *img, struct fat_part **part, size_t *count)
+{
+  int err = 0, i;
+  bool gpt = false, fat;
+  unsigned char *buf;
+  struct fat_mbr_entry e[MBR_PART_COUNT];
+  struct fat_part_list list = {
+    .img = img,
+  };
+
+  *part = NULL;
+  *count = 0;
+  if (!(buf = fat_image_get(img, 0, RESVAREA_SIZE)))
+    return 0;
+  fat = fat_probe_bpb(buf);
+  memcpy(e, buf + MBR_PART_OFFSET, sizeof(e));
+  if (fat || buf[510] != 0x55 || buf[511] != 0xaa) {
+    fat_image_put(img, buf);
+    return 0;
+  }
+  fat_image_put(img, buf);
+
+  for (i = 0; i < MBR_PART_COUNT; i++)
+    if (e[i].type == MBR_TYPE_GPT)
+      gpt = true;
+  if (gpt) {
+    if (!(err = fat_part_gpt(&list, MBR_SECTOR_SIZE)))
+      err = fat_part_gpt(&list, 4096);
+    goto out;
+  }
+
+  for (i = 0; i < MBR_PART_COUNT && err >= 0; i++) {
+    if (!e[i].type || !e[i].sectors)
+      continue;
+    if (fat_part_extended(e[i].type))
+      err = fat_part_logical(&list, e[i].lba);
+    else
+      err = fat_part_add(&list, (u_int64_t)e[i].lba * MBR_SECTOR_SIZE,
+          (u_int64_t)e[i].sectors * MBR_SECTOR_SIZE, i + 1);
+  }
+out:
+  if (err < 0) {
+    free(list.part);
+    return err;
+  }
+  *part = list.part;
+  *count = list.count;
+  return 0;
+}
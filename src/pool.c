@@ -0,0 +1,273 @@
+/*
+ * pool.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/**
+ * fat_deque_push - push task to tail of deque.
+ * @dq:   deque
+ * @task: task to push
+ */
+static int fat_deque_push(struct fat_deque *dq, struct fat_task *task)
+{
+  size_t i;
+  size_t alloc;
+  struct fat_task *t;
+
+  pthread_mutex_lock(&(dq->lock));
+  if (dq->count == dq->alloc) {
+    alloc = dq->alloc ? dq->alloc * 2 : 64;
+    if (!(t = malloc(alloc * sizeof(*t)))) {
+      pthread_mutex_unlock(&(dq->lock));
+      return -ENOMEM;
+    }
+    for (i = 0; i < dq->count; i++)
+      t[i] = dq->task[(dq->head + i) % dq->alloc];
+    free(dq->task);
+    dq->task = t;
+    dq->head = 0;
+    dq->alloc = alloc;
+  }
+  dq->task[(dq->head + dq->count) % dq->alloc] = *task;
+  dq->count++;
+  pthread_mutex_unlock(&(dq->lock));
+  return 0;
+}
+
+/**
+ * fat_deque_pop - take task from deque.
+ * @dq:   deque
+ * @task: taken task
+ * @tail: true - newest task (owner), false - oldest task (thief)
+ */
+static bool fat_deque_pop(struct fat_deque *dq, struct fat_task *task, bool tail)
+{
+  bool ret = false;
+
+  pthread_mutex_lock(&(dq->lock));
+  if (dq->count) {
+    if (tail) {
+      *task = dq->task[(dq->head + dq->count - 1) % dq->alloc];
+    } else {
+      *task = dq->task[dq->head];
+      dq->head = (dq->head + 1) % dq->alloc;
+    }
+    dq->count--;
+    ret = true;
+  }
+  pthread_mutex_unlock(&(dq->lock));
+  return ret;
+}
+
+/**
+ * fat_pool_take - find task for worker.
+ * @pool:   thread pool
+ * @worker: worker index
+ * @task:   found task
+ *
+ * Worker takes newest task of its own deque at first, and steals oldest
+ * task of other deques only when its own is empty.
+ */
+static bool fat_pool_take(struct fat_pool *pool, int worker, struct fat_task *task)
+{
+  int i;
+
+  if (fat_deque_pop(&(pool->deque[worker]), task, true))
+    return true;
+  for (i = 1; i < pool->jobs; i++)
+    if (fat_deque_pop(&(pool->deque[(worker + i) % pool->jobs]), task, false))
+      return true;
+  return false;
+}
+
+struct fat_worker_arg {
+  struct fat_pool *pool;
+  int worker;
+};
+
+static void *fat_pool_worker(void *data)
+{
+  struct fat_worker_arg *arg = data;
+  struct fat_pool *pool = arg->pool;
+  int worker = arg->worker;
+  struct fat_task task;
+
+  for (;;) {
+    if (fat_pool_take(pool, worker, &task)) {
+      pthread_mutex_lock(&(pool->lock));
+      pool->queued--;
+      pthread_mutex_unlock(&(pool->lock));
+
+      task.fn(pool, worker, task.arg);
+
+      pthread_mutex_lock(&(pool->lock));
+      if (!--pool->pending)
+        pthread_cond_broadcast(&(pool->cond));
+      pthread_mutex_unlock(&(pool->lock));
+      continue;
+    }
+
+    pthread_mutex_lock(&(pool->lock));
+    while (!pool->queued && !pool->stop)
+      pthread_cond_wait(&(pool->cond), &(pool->lock));
+    if (!pool->queued && pool->stop) {
+      pthread_mutex_unlock(&(pool->lock));
+      break;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+  }
+  return NULL;
+}
+
+/**
+ * fat_pool_init - start worker threads.
+ * @pool: thread pool
+ * @jobs: count of worker threads
+ *
+ * Return: 0 - success
+ *         negative - error
+ */
+int fat_pool_init(struct fat_pool *pool, int jobs)
+{
+  int i;
+  struct fat_worker_arg *arg;
+
+  memset(pool, 0, sizeof(*pool));
+  pool->jobs = jobs < 1 ? 1 : jobs;
+  pthread_mutex_init(&(pool->lock), NULL);
+  pthread_cond_init(&(pool->cond), NULL);
+
+  pool->deque = calloc(pool->jobs, sizeof(*(pool->deque)));
+  pool->thread = calloc(pool->jobs, sizeof(*(pool->thread)));
+  arg = calloc(pool->jobs, sizeof(*arg));
+  pool->arg = arg;
+  if (!pool->deque || !pool->thread || !arg)
+    goto err_free;
+
+  for (i = 0; i < pool->jobs; i++)
+    pthread_mutex_init(&(pool->deque[i].lock), NULL);
+  for (i = 0; i < pool->jobs; i++) {
+    arg[i].pool = pool;
+    arg[i].worker = i;
+    if (pthread_create(&(pool->thread[i]), NULL, fat_pool_worker, &arg[i]))
+      break;
+  }
+  pool->started = i;
+  if (!i)
+    goto err_free;
+  return 0;
+
+err_free:
+  free(pool->deque);
+  free(pool->thread);
+  free(arg);
+  return -ENOMEM;
+}
+
+/**
+ * fat_pool_submit - add task to thread pool.
+ * @pool:   thread pool
+ * @worker: index of calling worker, or -1 from outside of pool
+ * @fn:     task function
+ * @arg:    argument of @fn
+ */
+int fat_pool_submit(struct fat_pool *pool, int worker,
+    void (*fn)(struct fat_pool *, int, void *), void *arg)
+{
+  int err;
+  struct fat_task task = {fn, arg};
+
+  if (worker < 0) {
+    pthread_mutex_lock(&(pool->lock));
+    worker = pool->next++ % pool->started;
+    pthread_mutex_unlock(&(pool->lock));
+  }
+  /* count before push, or the task may be stolen and done first */
+  pthread_mutex_lock(&(pool->lock));
+  pool->pending++;
+  pool->queued++;
+  pthread_mutex_unlock(&(pool->lock));
+
+  err = fat_deque_push(&(pool->deque[worker]), &task);
+
+  pthread_mutex_lock(&(pool->lock));
+  if (err < 0) {
+    pool->queued--;
+    pool->pending--;
+  }
+  pthread_cond_broadcast(&(pool->cond));
+  pthread_mutex_unlock(&(pool->lock));
+  return err;
+}
+
+/**
+ * fat_pool_wait - wait until all tasks, including spawned ones, finish.
+ * @pool: thread pool
+ */
+void fat_pool_wait(struct fat_pool *pool)
+{
+  pthread_mutex_lock(&(pool->lock));
+  while (pool->pending)
+    pthread_cond_wait(&(pool->cond), &(pool->lock));
+  pthread_mutex_unlock(&(pool->lock));
+}
+
+/**
+ * fat_pool_destroy - stop worker threads.
+ * @pool: thread pool
+ */
+void fat_pool_destroy(struct fat_pool *pool)
+{
+  int i;
+
+  pthread_mutex_lock(&(pool->lock));
+  pool->stop = true;
+  pthread_cond_broadcast(&(pool->cond));
+  pthread_mutex_unlock(&(pool->lock));
+
+  for (i = 0; i < pool->started; i++)
+    pthread_join(pool->thread[i], NULL);
+  for (i = 0; i < pool->jobs; i++) {
+    pthread_mutex_destroy(&(pool->deque[i].lock));
+    free(pool->deque[i].task);
+  }
+  pthread_mutex_destroy(&(pool->lock));
+  pthread_cond_destroy(&(pool->cond));
+  free(pool->deque);
+  free(pool->thread);
+  free(pool->arg);
+}
@@ -0,0 +1,390 @@
+/*
+ * recover.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "fat.h"
+
+/**
+ * Clusters swept by one task, and what was found there
+ */
+struct fat_recover_chunk {
+  u_int32_t first;
+  u_int32_t count;
+  struct fat_found *found;
+  size_t nfound;
+  size_t afound;
+  int err;
+};
+
+/**
+ * State of recovery
+ */
+struct fat_recover {
+  struct fat_volume *vol;
+  unsigned char *dirmap;
+  struct fat_recover_chunk *chunk;
+  size_t nchunk;
+};
+
+/**
+ * fat_recover_runs - guess clusters of deleted file.
+ * @vol:   FAT volume
+ * @found: deleted dentry (extent and state are filled)
+ *
+ * FAT chain of deleted file is cleared, so clusters are guessed in the way
+ * of most undelete tools: from the first cluster onward, free clusters are
+ * taken and allocated ones are skipped, until the file size is covered.
+ * Deleted directory is assumed to be one cluster.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+int fat_recover_runs(struct fat_volume *vol, struct fat_found *found)
+{
+  u_int32_t clus, need, alloc = 0;
+  u_int32_t end = vol->CountofClusters + 2;
+  struct fat_extent *extent, *last = NULL;
+  struct fat_dentry *d = &(found->dentry);
+
+  found->extent = NULL;
+  found->nextent = 0;
+  clus = fat_dentry_cluster(vol, d);
+  if (d->DIR_Attr & ATTR_DIRECTORY)
+    need = 1;
+  else
+    need = ((u_int64_t)d->DIR_FileSize + vol->geo.cluster_size - 1) / vol->geo.cluster_size;
+  if (!need || !clus) {
+    found->state = FOUND_EMPTY;
+    return 0;
+  }
+  if (!fat_valid_cluster(vol, clus) || fat_get_entry(vol, clus)) {
+    found->state = FOUND_OVERWRITTEN;
+    return 0;
+  }
+
+  for (; clus < end && need; clus++) {
+    if (fat_get_entry(vol, clus))
+      continue;
+    need--;
+    if (last && last->cluster + last->count == clus) {
+      last->count++;
+      continue;
+    }
+    if (found->nextent == alloc) {
+      alloc = alloc ? alloc * 2 : 4;
+      if (!(extent = realloc(found->extent, alloc * sizeof(*extent)))) {
+        free(found->extent);
+        found->extent = NULL;
+        found->nextent = 0;
+        return -ENOMEM;
+      }
+      found->extent = extent;
+    }
+    last = &(found->extent[found->nextent]);
+    last->offset = found->nextent ? last[-1].offset + last[-1].count : 0;
+    last->cluster = clus;
+    last->count = 1;
+    found->nextent++;
+  }
+  found->state = need ? FOUND_PARTIAL : FOUND_RECOVERABLE;
+  return 0;
+}
+
+/**
+ * fat_recover_add - append found item to chunk.
+ * @c: chunk
+ *
+ * Return: new item, or NULL if out of memory
+ */
+static struct fat_found *fat_recover_add(struct fat_recover_chunk *c)
+{
+  struct fat_found *found;
+
+  if (c->nfound == c->afound) {
+    c->afound = c->afound ? c->afound * 2 : 16;
+    if (!(found = realloc(c->found, c->afound * sizeof(*found))))
+      return NULL;
+    c->found = found;
+  }
+  found = &(c->found[c->nfound++]);
+  memset(found, 0, sizeof(*found));
+  return found;
+}
+
+/**
+ * fat_recover_entries - collect deleted dentries of directory cluster.
+ * @vol:    FAT volume
+ * @c:      chunk
+ * @buf:    directory data
+ * @len:    length of @buf
+ * @offset: byte offset of @buf in image
+ * @clus:   cluster of @buf (0: root region)
+ *
+ * Deleted long file name entries are not reported, as their short entry
+ * carries everything to recover.
+ */
+static int fat_recover_entries(struct fat_volume *vol, struct fat_recover_chunk *c,
+    const unsigned char *buf, size_t len, u_int64_t offset, u_int32_t clus)
+{
+  int err;
+  size_t i, j;
+  unsigned char attr;
+  struct fat_found *found;
+
+  for (i = 0; i + DENTRY_SIZE <= len; i += DENTRY_SIZE) {
+    if (buf[i] == DENTRY_END)
+      break;
+    if (buf[i] != DENTRY_DELETED)
+      continue;
+    attr = buf[i + 11];
+    if ((attr & 0xc0) || (attr & ATTR_VOLUME_ID))
+      continue;
+    for (j = 1; j < NameSIZE; j++)
+      if (buf[i + j] < 0x20)
+        break;
+    if (j < NameSIZE)
+      continue;
+
+    if (!(found = fat_recover_add(c)))
+      return -ENOMEM;
+    found->type = FOUND_DELETED;
+    found->offset = offset + i;
+    found->cluster = clus;
+    memcpy(&(found->dentry), buf + i, DENTRY_SIZE);
+    if ((err = fat_recover_runs(vol, found)) < 0)
+      return err;
+  }
+  return 0;
+}
+
+/**
+ * fat_recover_cluster - look at one cluster of data region.
+ * @r:    state of recovery
+ * @c:    chunk
+ * @buf:  cluster data
+ * @clus: cluster number
+ *
+ * Clusters of known directories are searched for deleted dentries. Any
+ * other cluster which starts with "." and ".." is head of directory which
+ * is not reachable from root, and is searched as well.
+ */
+static int fat_recover_cluster(struct fat_recover *r, struct fat_recover_chunk *c,
+    const unsigned char *buf, u_int32_t clus)
+{
+  struct fat_volume *vol = r->vol;
+  struct fat_found *found;
+  struct fat_dentry dotdot;
+  u_int64_t offset = fat_cluster_offset(vol, clus);
+
+  if (!test_bit(r->dirmap, clus - 2)) {
+    if (!fat_stream_dirlike(buf, vol->geo.cluster_size, true))
+      return 0;
+    if (!(found = fat_recover_add(c)))
+      return -ENOMEM;
+    memcpy(&dotdot, buf + DENTRY_SIZE, DENTRY_SIZE);
+    found->type = FOUND_ORPHAN;
+    found->state = fat_get_entry(vol, clus) ? FOUND_OVERWRITTEN : FOUND_RECOVERABLE;
+    found->offset = offset;
+    found->cluster = clus;
+    found->parent = fat_dentry_cluster(vol, &dotdot);
+    memcpy(&(found->dentry), buf, DENTRY_SIZE);
+  }
+  return fat_recover_entries(vol, c, buf, vol->geo.cluster_size, offset, clus);
+}
+
+static void fat_recover_task(struct fat_pool *pool, int worker, void *arg)
+{
+  struct fat_recover *r = pool->data;
+  struct fat_recover_chunk *c = arg;
+  struct fat_volume *vol = r->vol;
+  u_int32_t clus = c->first, end = c->first + c->count, n, i;
+  u_int32_t block = FAT_RECOVER_BLOCK / vol->geo.cluster_size;
+  u_int64_t offset;
+  unsigned char *buf;
+
+  if (!block)
+    block = 1;
+  for (; clus < end; clus += n) {
+    n = end - clus < block ? end - clus : block;
+    offset = fat_cluster_offset(vol, clus);
+    if (end - clus > n)
+      fat_image_advise(vol->img, offset + (u_int64_t)n * vol->geo.cluster_size,
+          (size_t)block * vol->geo.cluster_size, MADV_WILLNEED);
+    if (!(buf = fat_image_get(vol->img, offset, (size_t)n * vol->geo.cluster_size))) {
+      c->err = -EIO;
+      return;
+    }
+    for (i = 0; i < n && !c->err; i++)
+      c->err = fat_recover_cluster(r, c, buf + (size_t)i * vol->geo.cluster_size, clus + i);
+    fat_image_put(vol->img, buf);
+    if (c->err)
+      return;
+  }
+}
+
+/**
+ * fat_recover_mark - mark clusters of directory in map.
+ * @node: dentry node
+ * @arg:  state of recovery
+ */
+static int fat_recover_mark(struct fat_node *node, void *arg)
+{
+  struct fat_recover *r = arg;
+  struct fat_chain ch;
+  u_int32_t clus;
+
+  if (!fat_is_subdir(&(node->dentry)))
+    return 0;
+  clus = fat_dentry_cluster(r->vol, &(node->dentry));
+  if (!fat_valid_cluster(r->vol, clus))
+    return 0;
+  fat_chain_init(&ch, r->vol, clus);
+  while (fat_chain_next(&ch))
+    if (test_and_set_bit(r->dirmap, ch.cluster - 2))
+      break;
+  return 0;
+}
+
+/**
+ * fat_recover_root - collect deleted dentries of FAT12/16 root region.
+ * @vol: FAT volume
+ * @c:   chunk for root region
+ */
+static int fat_recover_root(struct fat_volume *vol, struct fat_recover_chunk *c)
+{
+  int err;
+  u_int64_t offset = vol->geo.root_offset;
+  size_t len = vol->geo.root_size;
+  unsigned char *buf;
+
+  if (!len)
+    return 0;
+  if (!(buf = fat_image_get(vol->img, offset, len)))
+    return -EIO;
+  err = fat_recover_entries(vol, c, buf, len, offset, 0);
+  fat_image_put(vol->img, buf);
+  return err;
+}
+
+/**
+ * fat_recover - search volume for deleted files and orphan directories.
+ * @vol:  FAT volume
+ * @tree: directory tree
+ * @out:  output sink
+ * @jobs: count of threads
+ *
+ * Data region is swept once in cluster order, split into chunks of
+ * FAT_RECOVER_CHUNK bytes on thread pool. Found items are printed out in
+ * the order of the image.
+ *
+ * Return: 0 - success
+ *         -EOPNOTSUPP - image is read in single pass
+ *         negative - error (errno)
+ */
+int fat_recover(struct fat_volume *vol, struct fat_tree *tree,
+    struct fat_output *out, int jobs)
+{
+  int err = 0;
+  size_t i, j;
+  u_int32_t per, clus;
+  struct fat_pool pool;
+  struct fat_recover_chunk *c;
+  struct fat_recover r = {
+    .vol = vol,
+  };
+
+  if (vol->img->seg)
+    return -EOPNOTSUPP;
+  r.dirmap = calloc(vol->CountofClusters / CHAR_BIT + 1, sizeof(*r.dirmap));
+  if (!r.dirmap)
+    return -ENOMEM;
+  if ((err = fat_recover_mark(&(tree->root), &r)) < 0
+      || (err = fat_tree_foreach(tree, fat_recover_mark, &r)) < 0)
+    goto out;
+
+  /* chunk 0 is root region of FAT12/16 */
+  per = FAT_RECOVER_CHUNK / vol->geo.cluster_size;
+  if (!per)
+    per = 1;
+  r.nchunk = 1 + (vol->CountofClusters + (u_int64_t)per - 1) / per;
+  if (!(r.chunk = calloc(r.nchunk, sizeof(*r.chunk)))) {
+    err = -ENOMEM;
+    goto out;
+  }
+  for (i = 1, clus = 2; i < r.nchunk; i++, clus += per) {
+    r.chunk[i].first = clus;
+    r.chunk[i].count = vol->CountofClusters + 2 - clus < per
+      ? vol->CountofClusters + 2 - clus : per;
+  }
+  r.chunk[0].err = fat_recover_root(vol, &(r.chunk[0]));
+
+  if (jobs > 1 && r.nchunk > 2 && !fat_pool_init(&pool, jobs)) {
+    pool.data = &r;
+    for (i = 1; i < r.nchunk; i++) {
+      if ((err = fat_pool_submit(&pool, -1, fat_recover_task, &(r.chunk[i]))) < 0)
+        break;
+    }
+    fat_pool_wait(&pool);
+    fat_pool_destroy(&pool);
+    if (err < 0)
+      goto out;
+  } else {
+    pool.data = &r;
+    for (i = 1; i < r.nchunk; i++)
+      fat_recover_task(&pool, 0, &(r.chunk[i]));
+  }
+
+  for (i = 0; i < r.nchunk; i++) {
+    c = &(r.chunk[i]);
+    if (c->err) {
+      err = c->err;
+      goto out;
+    }
+    for (j = 0; j < c->nfound; j++)
+      out->ops->found(out, &(c->found[j]));
+  }
+out:
+  for (i = 0; i < r.nchunk; i++) {
+    c = &(r.chunk[i]);
+    for (j = 0; j < c->nfound; j++)
+      free(c->found[j].extent);
+    free(c->found);
+  }
+  free(r.chunk);
+  free(r.dirmap);
+  return err;
+}
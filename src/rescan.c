@@ -0,0 +1,477 @@
+/*
+ * rescan.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/**
+ * Directory waiting to be compared
+ */
+struct fat_delta_item {
+  struct fat_node *node;  /* NULL: directory was deleted */
+  u_int32_t old;          /* FAT_INDEX_NONE: directory was created */
+  char *path;
+};
+
+/**
+ * State of incremental rescan
+ */
+struct fat_delta {
+  struct fat_volume *vol;
+  struct fat_index *old;
+  struct fat_tree *tree;
+  struct fat_output *out;
+  struct fat_arena names;  /* children of old records, with long names */
+  unsigned char *dirty;
+  unsigned char *visited;
+  struct fat_delta_item *queue;
+  size_t head;
+  size_t count;
+  size_t alloc;
+};
+
+/**
+ * fat_delta_dirty - find FAT sectors which differ from old index.
+ * @d: state of rescan
+ *
+ * Without old index, or if FAT is resized, every sector is dirty.
+ */
+static int fat_delta_dirty(struct fat_delta *d)
+{
+  u_int32_t i;
+  struct fat_volume *vol = d->vol;
+
+  if (!(d->dirty = calloc(vol->secsPerFat / CHAR_BIT + 1, sizeof(*d->dirty))))
+    return -ENOMEM;
+  for (i = 0; i < vol->secsPerFat; i++) {
+    if (!d->old || d->old->hdr->fathash_count != vol->secsPerFat
+        || d->old->fathash[i] != fat_hash64(vol->fat + (size_t)i * vol->geo.sector,
+          vol->geo.sector, 0))
+      set_bit(d->dirty, i);
+  }
+  return 0;
+}
+
+/**
+ * fat_delta_entry_dirty - whether FAT entry of cluster has changed.
+ * @vol:   FAT volume
+ * @dirty: bitmap of changed sectors of FAT
+ * @clus:  cluster
+ */
+bool fat_delta_entry_dirty(struct fat_volume *vol, const unsigned char *dirty,
+    u_int32_t clus)
+{
+  u_int64_t first, last;
+
+  switch (vol->fstype) {
+    case FAT12_FILESYSTEM:
+      first = clus + clus / 2;
+      last = first + 1;
+      break;
+    case FAT16_FILESYSTEM:
+      first = (u_int64_t)clus * 2;
+      last = first + 1;
+      break;
+    default:
+      first = (u_int64_t)clus * 4;
+      last = first + 3;
+  }
+  first /= vol->geo.sector;
+  last /= vol->geo.sector;
+  if (last >= vol->secsPerFat)
+    return true;
+  return test_bit(dirty, first) || test_bit(dirty, last);
+}
+
+/**
+ * fat_delta_record - get old record of directory with its children.
+ * @d:   state of rescan
+ * @old: index of record
+ *
+ * Return: record, or NULL if directory has no children in old index
+ */
+static struct fat_index_node *fat_delta_record(struct fat_delta *d, u_int32_t old)
+{
+  struct fat_index_node *rec;
+  u_int64_t count;
+
+  if (!d->old || old == FAT_INDEX_NONE)
+    return NULL;
+  count = d->old->hdr->node_count;
+  rec = &(d->old->node[old]);
+  if (rec->child == FAT_INDEX_NONE || rec->child > count
+      || rec->nchild > count - rec->child)
+    return NULL;
+  return rec;
+}
+
+/**
+ * fat_delta_push - queue directory to compare.
+ * @d:      state of rescan
+ * @node:   directory node (NULL: deleted)
+ * @old:    index of old record (FAT_INDEX_NONE: created)
+ * @path:   path of parent directory
+ * @entry:  entry of directory in parent, to name it
+ */
+static int fat_delta_push(struct fat_delta *d, struct fat_node *node,
+    u_int32_t old, const char *path, struct fat_node *entry)
+{
+  size_t len;
+  const char *name;
+  char buf[NameSIZE + 2];
+  struct fat_delta_item *tmp, *item;
+
+  if (d->count == d->alloc) {
+    d->alloc = d->alloc ? d->alloc * 2 : 64;
+    if (!(tmp = realloc(d->queue, d->alloc * sizeof(*tmp))))
+      return -ENOMEM;
+    d->queue = tmp;
+  }
+  item = &(d->queue[d->count]);
+  name = fat_node_name(entry, buf);
+  len = strlen(path) + strlen(name) + 2;
+  if (!(item->path = malloc(len)))
+    return -ENOMEM;
+  snprintf(item->path, len, "%s/%s", strcmp(path, "/") ? path : "", name);
+  item->node = node;
+  item->old = old;
+  d->count++;
+  return 0;
+}
+
+/**
+ * fat_delta_skip - whether dentry is not reported in delta.
+ * @dentry: directory entry
+ *
+ * Long file name entries change along with their short entry, and "."
+ * and ".." follow their directory.
+ */
+static bool fat_delta_skip(struct fat_dentry *dentry)
+{
+  if ((dentry->DIR_Attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME)
+    return true;
+  return dentry->IR_Name[0] == DENTRY_DOT;
+}
+
+static int fat_delta_cmp_name(const void *a, const void *b)
+{
+  const struct fat_delta_name *x = a, *y = b;
+  int ret;
+
+  if ((ret = strcmp(x->name, y->name)))
+    return ret;
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+/**
+ * fat_delta_clean - whether directory is the same as in old index.
+ * @d:    state of rescan
+ * @node: directory node
+ * @rec:  old record of directory
+ *
+ * Directory is clean if it starts at the same cluster, FAT entries of its
+ * chain are in clean sectors, and every cluster has the same hash.
+ * Clusters of clean directory are marked as visited.
+ */
+static bool fat_delta_clean(struct fat_delta *d, struct fat_node *node,
+    struct fat_index_node *rec)
+{
+  u_int64_t hash, old;
+  struct fat_chain ch;
+  struct fat_dentry dentry = rec->dentry;
+  u_int32_t clus = fat_dentry_cluster(d->vol, &(node->dentry));
+
+  if (clus != fat_dentry_cluster(d->vol, &dentry))
+    return false;
+  if (!clus)
+    return !fat_cluster_hash(d->vol, 0, &hash)
+      && fat_index_dirhash(d->old, 0, &old) && hash == old;
+
+  fat_chain_init(&ch, d->vol, clus);
+  while (fat_chain_next(&ch)) {
+    if (test_bit(d->visited, ch.cluster - 2)
+        || fat_delta_entry_dirty(d->vol, d->dirty, ch.cluster)
+        || fat_cluster_hash(d->vol, ch.cluster, &hash)
+        || !fat_index_dirhash(d->old, ch.cluster, &old) || hash != old)
+      return false;
+  }
+  if (ch.err)
+    return false;
+
+  fat_chain_init(&ch, d->vol, clus);
+  while (fat_chain_next(&ch))
+    set_bit(d->visited, ch.cluster - 2);
+  return true;
+}
+
+/**
+ * fat_delta_children - take children of directory from old index.
+ * @d:     state of rescan
+ * @rec:   old record of directory
+ * @dir:   node to attach children to
+ * @arena: arena to store children and their long names in
+ */
+static int fat_delta_children(struct fat_delta *d, struct fat_index_node *rec,
+    struct fat_node *dir, struct fat_arena *arena)
+{
+  size_t i;
+  struct fat_node *child;
+
+  if (!(dir->child = fat_arena_calloc(arena, rec->nchild, sizeof(*child))))
+    return -ENOMEM;
+  dir->nchild = rec->nchild;
+  for (i = 0; i < dir->nchild; i++) {
+    child = &(dir->child[i]);
+    child->dentry = d->old->node[rec->child + i].dentry;
+    child->offset = d->old->node[rec->child + i].offset;
+  }
+  return fat_lfn_assemble(dir, arena);
+}
+
+/**
+ * fat_delta_copy - take children of clean directory from old index.
+ * @d:    state of rescan
+ * @item: directory
+ * @rec:  old record of directory
+ */
+static int fat_delta_copy(struct fat_delta *d, struct fat_delta_item *item,
+    struct fat_index_node *rec)
+{
+  int err;
+  size_t i;
+  struct fat_node *node = item->node, *child;
+
+  if ((err = fat_delta_children(d, rec, node, d->tree->arena)) < 0)
+    return err;
+  for (i = 0; i < node->nchild; i++) {
+    child = &(node->child[i]);
+    if (!fat_is_subdir(&(child->dentry))
+        || !fat_valid_cluster(d->vol, fat_dentry_cluster(d->vol, &(child->dentry))))
+      continue;
+    if ((err = fat_delta_push(d, child, rec->child + i, item->path, child)) < 0)
+      return err;
+  }
+  return 0;
+}
+
+/**
+ * fat_delta_names - list dentries to report, sorted by name.
+ * @names: (out) allocated list
+ * @count: (out) count of @names
+ * @child: children of directory, with long names attached
+ * @n:     count of @child
+ *
+ * Entries are named by long name if any, so that renaming only the long
+ * name is reported. Short names are formatted in the same allocation,
+ * right after the list.
+ */
+int fat_delta_names(struct fat_delta_name **names, size_t *count,
+    struct fat_node *child, size_t n)
+{
+  size_t i;
+  char *buf;
+
+  *count = 0;
+  if (!(*names = malloc((n ? n : 1) * (sizeof(**names) + NameSIZE + 2))))
+    return -ENOMEM;
+  buf = (char *)(*names + (n ? n : 1));
+  for (i = 0; i < n; i++) {
+    if (fat_delta_skip(&(child[i].dentry)))
+      continue;
+    (*names)[*count].name = fat_node_name(&(child[i]), buf + i * (NameSIZE + 2));
+    (*names)[(*count)++].index = i;
+  }
+  qsort(*names, *count, sizeof(**names), fat_delta_cmp_name);
+  return 0;
+}
+
+/**
+ * fat_delta_dir - compare directory with old index.
+ * @d:    state of rescan
+ * @item: directory
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+static int fat_delta_dir(struct fat_delta *d, struct fat_delta_item *item)
+{
+  int err = 0;
+  size_t i = 0, j = 0, nnew = 0, nold = 0;
+  struct fat_node *node = item->node, *child, *oldchild;
+  struct fat_index_node *rec = fat_delta_record(d, item->old);
+  struct fat_delta_name *new = NULL, *old = NULL;
+  struct fat_node olddir = {0};
+  bool subdir;
+  int cmp;
+
+  if (node && rec && fat_delta_clean(d, node, rec)) {
+    d->tree->count += rec->nchild;
+    return fat_delta_copy(d, item, rec);
+  }
+
+  if (node) {
+    if ((err = fat_scan_dir(d->vol, node, d->visited, d->tree->arena)) < 0) {
+      if (err == -ENOMEM)
+        return err;
+      fat_dir_error(d->vol, node, err);
+    }
+    d->tree->count += node->nchild;
+    if ((err = fat_lfn_assemble(node, d->tree->arena)) < 0)
+      return err;
+  }
+  if (rec) {
+    olddir.dentry = rec->dentry;
+    olddir.offset = rec->offset;
+    if ((err = fat_delta_children(d, rec, &olddir, &(d->names))) < 0)
+      return err;
+  }
+  if ((err = fat_delta_names(&new, &nnew, node ? node->child : NULL,
+          node ? node->nchild : 0)) < 0)
+    goto out;
+  if ((err = fat_delta_names(&old, &nold, olddir.child, olddir.nchild)) < 0)
+    goto out;
+
+  /* both lists are sorted by name, so merge them */
+  while (i < nnew || j < nold) {
+    if (i == nnew)
+      cmp = 1;
+    else if (j == nold)
+      cmp = -1;
+    else
+      cmp = strcmp(new[i].name, old[j].name);
+
+    child = cmp <= 0 ? &(node->child[new[i].index]) : NULL;
+    oldchild = cmp >= 0 ? &(olddir.child[old[j].index]) : NULL;
+
+    if (!oldchild)
+      d->out->ops->delta(d->out, CHANGE_CREATED, item->path, node, child);
+    else if (!child)
+      d->out->ops->delta(d->out, CHANGE_DELETED, item->path, &olddir, oldchild);
+    else if (memcmp(&(child->dentry), &(oldchild->dentry), sizeof(child->dentry)))
+      d->out->ops->delta(d->out, CHANGE_MODIFIED, item->path, node, child);
+
+    subdir = child && fat_is_subdir(&(child->dentry))
+      && fat_valid_cluster(d->vol, fat_dentry_cluster(d->vol, &(child->dentry)));
+    if (subdir)
+      err = fat_delta_push(d, child, oldchild ? rec->child + old[j].index
+          : FAT_INDEX_NONE, item->path, child);
+    else if (oldchild && d->old->node[rec->child + old[j].index].child != FAT_INDEX_NONE)
+      err = fat_delta_push(d, NULL, rec->child + old[j].index, item->path, oldchild);
+    if (err < 0)
+      goto out;
+
+    if (cmp <= 0)
+      i++;
+    if (cmp >= 0)
+      j++;
+  }
+out:
+  free(new);
+  free(old);
+  return err;
+}
+
+/**
+ * fat_rescan - build directory tree, and report changes since old index.
+ * @vol:  FAT volume
+ * @old:  last index of the image (NULL: none)
+ * @tree: directory tree to build
+ * @out:  output sink of changes
+ *
+ * Only directories whose clusters or FAT entries have changed since @old
+ * are read again, the others are taken from @old as they are.
+ * Entries are matched by long name if any, otherwise by short name, and
+ * reported as created, deleted or modified. Whole subtree of created or
+ * deleted directory is reported.
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+int fat_rescan(struct fat_volume *vol, struct fat_index *old,
+    struct fat_tree *tree, struct fat_output *out)
+{
+  int err = 0;
+  struct fat_delta_item item;
+  struct fat_delta d = {
+    .vol = vol,
+    .old = old,
+    .tree = tree,
+    .out = out,
+  };
+
+  if ((err = fat_init_tree(tree, 1)) < 0)
+    return err;
+  tree->root.dentry.DIR_Attr = ATTR_DIRECTORY;
+  tree->root.dentry.DIR_FstClusHI = vol->RootClus >> 16;
+  tree->root.dentry.DIR_FstClusLO = vol->RootClus & 0xffff;
+
+  if (old && (old->hdr->fstype != vol->fstype || !old->hdr->node_count))
+    d.old = NULL;
+  if ((err = fat_delta_dirty(&d)) < 0)
+    goto out;
+  if (!(d.visited = calloc(vol->CountofClusters / CHAR_BIT + 1, sizeof(*d.visited)))) {
+    err = -ENOMEM;
+    goto out;
+  }
+
+  if (!(d.queue = malloc(sizeof(*d.queue))) || !(d.queue[0].path = strdup("/"))) {
+    err = -ENOMEM;
+    goto out;
+  }
+  d.queue[0].node = &(tree->root);
+  d.queue[0].old = d.old ? 0 : FAT_INDEX_NONE;
+  d.count = d.alloc = 1;
+
+  /* queue may be reallocated while directory is compared */
+  while (d.head < d.count) {
+    item = d.queue[d.head++];
+    err = fat_delta_dir(&d, &item);
+    free(item.path);
+    if (err < 0)
+      break;
+  }
+out:
+  if (d.queue) {
+    for (; d.head < d.count; d.head++)
+      free(d.queue[d.head].path);
+  }
+  free(d.queue);
+  free(d.visited);
+  free(d.dirty);
+  fat_arena_free(&(d.names));
+  if (err < 0)
+    fat_free_tree(tree);
+  return err;
+}
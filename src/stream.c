@@ -0,0 +1,447 @@
+/*
+ * stream.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/**
+ * Single pass reader of non-seekable image
+ *
+ * Reserved area, FATs and fixed root directory are kept as they are.
+ * Data region is read cluster by cluster, and only clusters of directories
+ * are kept. A directory is known only after its parent dentry has been
+ * read, and the parent may be behind it on disk. So clusters which may be
+ * such a directory are kept as pending, and whenever a directory is found,
+ * its chain is resolved through the deferred queue: clusters which are
+ * still ahead are marked as wanted, and pending clusters which are already
+ * read are accepted. Pending clusters which are never accepted are dropped
+ * at the end of stream.
+ */
+struct fat_stream {
+  struct fat_image *img;
+  struct fat_volume vol;
+  u_int32_t cur;
+  unsigned char *pointed;
+  unsigned char *back;
+  unsigned char *follow;
+  unsigned char *wanted;
+  unsigned char *marked;
+  u_int32_t *queue;
+  size_t nqueue;
+  size_t aqueue;
+};
+
+/**
+ * fat_stream_read - read from stream until buffer is full.
+ * @fd:  input stream
+ * @buf: buffer
+ * @len: length of @buf
+ *
+ * Return: read bytes (less than @len at end of stream)
+ *         negative - error (errno)
+ */
+static ssize_t fat_stream_read(int fd, unsigned char *buf, size_t len)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len) {
+    n = read(fd, buf + done, len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -errno;
+    if (!n)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+/**
+ * fat_stream_region - read region and keep it.
+ * @img: streamed image
+ * @off:  byte offset of region (current position of stream)
+ * @len:  byte length of region
+ * @head: already read head of region, or NULL
+ * @hlen: length of @head
+ */
+static int fat_stream_region(struct fat_image *img, u_int64_t off, size_t len,
+    const unsigned char *head, size_t hlen)
+{
+  int err;
+  ssize_t n;
+  unsigned char *buf;
+
+  if (!(buf = malloc(len)))
+    return -ENOMEM;
+  if (hlen)
+    memcpy(buf, head, hlen);
+  if ((n = fat_stream_read(img->fd, buf + hlen, len - hlen)) < 0
+      || (size_t)n != len - hlen) {
+    free(buf);
+    return n < 0 ? n : -EIO;
+  }
+  if ((err = fat_image_append(img, off, buf, len, false)) < 0)
+    free(buf);
+  return err;
+}
+
+/**
+ * fat_stream_dirlike - check whether cluster may be directory.
+ * @buf:  cluster data
+ * @len:  cluster size
+ * @head: cluster is head of chain
+ *
+ * Head of subdirectory always starts with "." and "..".
+ * Other clusters are accepted when all dentries before the end look sane.
+ */
+bool fat_stream_dirlike(const unsigned char *buf, size_t len, bool head)
+{
+  size_t i, j;
+  unsigned char attr;
+
+  if (head)
+    return !memcmp(buf, ".          ", NameSIZE) && (buf[11] & ATTR_DIRECTORY)
+      && !memcmp(buf + DENTRY_SIZE, "..         ", NameSIZE)
+      && (buf[DENTRY_SIZE + 11] & ATTR_DIRECTORY);
+
+  for (i = 0; i + DENTRY_SIZE <= len; i += DENTRY_SIZE) {
+    if (buf[i] == DENTRY_END)
+      break;
+    attr = buf[i + 11];
+    if (attr & 0xc0)
+      return false;
+    if ((attr & ATTR_LONG_FILE_NAME) == ATTR_LONG_FILE_NAME
+        || buf[i] == DENTRY_DELETED)
+      continue;
+    for (j = 0; j < NameSIZE; j++)
+      if (buf[i + j] < 0x20 && !(j == 0 && buf[i] == 0x05))
+        return false;
+  }
+  return true;
+}
+
+/**
+ * fat_stream_defer - queue directory whose chain must be resolved.
+ * @st:      stream
+ * @cluster: first cluster of directory
+ */
+static int fat_stream_defer(struct fat_stream *st, u_int32_t cluster)
+{
+  u_int32_t *q;
+  size_t alloc;
+
+  if (!fat_valid_cluster(&(st->vol), cluster))
+    return 0;
+  if (test_and_set_bit(st->marked, cluster - 2))
+    return 0;
+  if (st->nqueue == st->aqueue) {
+    alloc = st->aqueue ? st->aqueue * 2 : 64;
+    if (!(q = realloc(st->queue, alloc * sizeof(*q))))
+      return -ENOMEM;
+    st->queue = q;
+    st->aqueue = alloc;
+  }
+  st->queue[st->nqueue++] = cluster;
+  return 0;
+}
+
+/**
+ * fat_stream_scan - queue subdirectories in directory data.
+ * @st:  stream
+ * @buf: directory data
+ * @len: length of @buf
+ */
+static int fat_stream_scan(struct fat_stream *st, const unsigned char *buf,
+    size_t len)
+{
+  int err;
+  size_t i;
+  struct fat_dentry d;
+
+  for (i = 0; i + DENTRY_SIZE <= len; i += DENTRY_SIZE) {
+    if (buf[i] == DENTRY_END)
+      break;
+    if (check_dentryfree(buf + i))
+      continue;
+    fat_load_dentry(&d, buf + i);
+    if (!fat_is_subdir(&d))
+      continue;
+    if ((err = fat_stream_defer(st, fat_dentry_cluster(&(st->vol), &d))) < 0)
+      return err;
+  }
+  return 0;
+}
+
+/**
+ * fat_stream_resolve - resolve chains of queued directories.
+ * @st: stream
+ */
+static int fat_stream_resolve(struct fat_stream *st)
+{
+  int err;
+  struct fat_chain ch;
+  struct fat_segment *seg;
+
+  while (st->nqueue) {
+    fat_chain_init(&ch, &(st->vol), st->queue[--st->nqueue]);
+    while (fat_chain_next(&ch)) {
+      if (ch.cluster >= st->cur) {
+        set_bit(st->wanted, ch.cluster - 2);
+        continue;
+      }
+      seg = fat_image_segment(st->img, fat_cluster_offset(&(st->vol), ch.cluster));
+      if (!seg || !seg->pending)
+        continue;
+      seg->pending = false;
+      if ((err = fat_stream_scan(st, seg->data, seg->len)) < 0)
+        return err;
+    }
+  }
+  return 0;
+}
+
+/**
+ * fat_stream_chains - find heads of chains and backward links.
+ * @st: stream (FAT is loaded)
+ */
+static void fat_stream_chains(struct fat_stream *st)
+{
+  u_int32_t buf[256];
+  u_int32_t c, i, n, next;
+  u_int32_t last = st->vol.CountofClusters + 2;
+
+  for (c = 2; c < last; c += n) {
+    n = last - c < 256 ? last - c : 256;
+    fat_get_entries(&(st->vol), c, n, buf);
+    for (i = 0; i < n; i++) {
+      next = buf[i];
+      if (!fat_valid_cluster(&(st->vol), next))
+        continue;
+      set_bit(st->pointed, next - 2);
+      if (next < c + i)
+        set_bit(st->back, next - 2);
+    }
+  }
+}
+
+/**
+ * fat_stream_pending - check whether cluster should be kept as pending.
+ * @st:  stream
+ * @buf: cluster data
+ *
+ * Head of chain is kept if it looks like head of subdirectory. Other
+ * clusters are kept if they look like directory, and previous cluster in
+ * chain is either ahead, or kept as pending too.
+ */
+static bool fat_stream_pending(struct fat_stream *st, const unsigned char *buf)
+{
+  u_int32_t c = st->cur - 2;
+  u_int32_t next = fat_get_entry(&(st->vol), st->cur);
+
+  if (!next)
+    return false;
+  if (!test_bit(st->pointed, c)) {
+    if (!fat_stream_dirlike(buf, st->vol.geo.cluster_size, true))
+      return false;
+  } else if (!test_bit(st->back, c) && !test_bit(st->follow, c)) {
+    return false;
+  } else if (!fat_stream_dirlike(buf, st->vol.geo.cluster_size, false)) {
+    return false;
+  }
+  if (fat_valid_cluster(&(st->vol), next) && next > st->cur)
+    set_bit(st->follow, next - 2);
+  return true;
+}
+
+/**
+ * fat_stream_data - read data region cluster by cluster.
+ * @st: stream
+ */
+static int fat_stream_data(struct fat_stream *st)
+{
+  int err = 0;
+  ssize_t n;
+  size_t i, bufsize;
+  unsigned char *buf, *data, *p;
+  struct fat_volume *vol = &(st->vol);
+  u_int32_t last = vol->CountofClusters + 2;
+  bool keep, pending;
+
+  bufsize = FAT_STREAM_BUFSIZE;
+  if (bufsize < vol->geo.cluster_size)
+    bufsize = vol->geo.cluster_size;
+  if (!(buf = malloc(bufsize)))
+    return -ENOMEM;
+
+  st->cur = 2;
+  while (st->cur < last) {
+    if ((n = fat_stream_read(st->img->fd, buf, bufsize)) < 0) {
+      err = n;
+      break;
+    }
+    for (i = 0; i + vol->geo.cluster_size <= (size_t)n && st->cur < last;
+        i += vol->geo.cluster_size, st->cur++) {
+      p = buf + i;
+      keep = test_bit(st->wanted, st->cur - 2);
+      pending = !keep && fat_stream_pending(st, p);
+      if (!keep && !pending)
+        continue;
+      if (!(data = malloc(vol->geo.cluster_size))) {
+        err = -ENOMEM;
+        goto out;
+      }
+      memcpy(data, p, vol->geo.cluster_size);
+      if ((err = fat_image_append(st->img, fat_cluster_offset(vol, st->cur),
+              data, vol->geo.cluster_size, pending)) < 0) {
+        free(data);
+        goto out;
+      }
+      if (pending)
+        continue;
+      if ((err = fat_stream_scan(st, data, vol->geo.cluster_size)) < 0
+          || (err = fat_stream_resolve(st)) < 0)
+        goto out;
+    }
+    if ((size_t)n < bufsize)
+      break;
+  }
+out:
+  free(buf);
+  return err;
+}
+
+/**
+ * fat_stream_finish - drop pending clusters which are not directories.
+ * @img: streamed image
+ */
+static void fat_stream_finish(struct fat_image *img)
+{
+  size_t i, n = 0;
+
+  for (i = 0; i < img->nseg; i++) {
+    if (img->seg[i].pending) {
+      free(img->seg[i].data);
+      continue;
+    }
+    img->seg[n++] = img->seg[i];
+  }
+  img->nseg = n;
+}
+
+/**
+ * fat_stream_load - read non-seekable image in a single pass.
+ * @img: image (img->fd is opened)
+ *
+ * Only metadata is kept in memory, file data are discarded.
+ *
+ * Return: 0 - success
+ *         negative - error (errno)
+ */
+int fat_stream_load(struct fat_image *img)
+{
+  int err;
+  ssize_t n;
+  size_t resv, mapsize;
+  unsigned char boot[RESVAREA_SIZE];
+  struct fat_reserved_info info;
+  struct fat_stream st = {0};
+  struct fat_volume *vol = &(st.vol);
+  u_int64_t start, end;
+  unsigned char *root;
+
+  st.img = img;
+  if ((n = fat_stream_read(img->fd, boot, sizeof(boot))) < 0)
+    return n;
+  if (n != sizeof(boot) || fat_load_reservedinfo(&info, boot) < 0)
+    return -EINVAL;
+
+  /* reserved area, and then FATs and fixed root directory */
+  resv = (size_t)info.BPB_RevdSecCnt * info.BPB_BytesPerSec;
+  if (resv < sizeof(boot))
+    return -EINVAL;
+  img->size = resv;
+  if ((err = fat_stream_region(img, 0, resv, boot, sizeof(boot))) < 0)
+    return err;
+  if ((err = fat_volume_layout(vol, img)) < 0)
+    return err;
+
+  start = vol->geo.fat_offset;
+  end = vol->geo.data_offset;
+  img->size = vol->geo.size;
+  if (start != resv)
+    return -EINVAL;
+  if ((err = fat_stream_region(img, start, end - start, NULL, 0)) < 0)
+    return err;
+  if ((err = fat_volume_open(vol, img)) < 0)
+    return err;
+
+  mapsize = vol->CountofClusters / CHAR_BIT + 1;
+  st.pointed = calloc(mapsize, 1);
+  st.back = calloc(mapsize, 1);
+  st.follow = calloc(mapsize, 1);
+  st.wanted = calloc(mapsize, 1);
+  st.marked = calloc(mapsize, 1);
+  if (!st.pointed || !st.back || !st.follow || !st.wanted || !st.marked) {
+    err = -ENOMEM;
+    goto out;
+  }
+  fat_stream_chains(&st);
+
+  st.cur = 2;
+  if (vol->RootDirSectors) {
+    root = img->seg[img->nseg - 1].data + (end - start)
+      - vol->geo.root_size;
+    err = fat_stream_scan(&st, root, vol->geo.root_size);
+  } else {
+    err = fat_stream_defer(&st, vol->RootClus);
+  }
+  if (err < 0 || (err = fat_stream_resolve(&st)) < 0)
+    goto out;
+
+  err = fat_stream_data(&st);
+  fat_stream_finish(img);
+out:
+  fat_volume_close(vol);
+  free(st.pointed);
+  free(st.back);
+  free(st.follow);
+  free(st.wanted);
+  free(st.marked);
+  free(st.queue);
+  return err;
+}
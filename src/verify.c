@@ -0,0 +1,422 @@
+/*
+ * verify.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "fat.h"
+
+/**
+ * State of check: bitmaps of CountofClusters bits
+ */
+struct fat_verify_state {
+  struct fat_volume *vol;
+  struct fat_output *out;
+  struct fat_verify *res;
+  unsigned char *owned;    /* in chain of some dentry */
+  unsigned char *lost;     /* used, but in chain of no dentry */
+  unsigned char *pointed;  /* lost cluster which another lost one points to */
+  struct fat_node *root;
+};
+
+/**
+ * fat_verify_report - print out one problem.
+ * @s:       state of check
+ * @path:    path of dentry (NULL: none)
+ * @offset:  byte offset of dentry (0: none)
+ * @kind:    enum fat_problem_kind
+ * @cluster: cluster of problem
+ * @value:   value of problem
+ */
+static void fat_verify_report(struct fat_verify_state *s, const char *path,
+    u_int64_t offset, u_int32_t kind, u_int32_t cluster, u_int32_t value)
+{
+  struct fat_problem p = {
+    .offset = offset,
+    .kind = kind,
+    .cluster = cluster,
+    .value = value,
+  };
+
+  s->res->problems++;
+  s->out->ops->problem(s->out, path, &p);
+}
+
+/**
+ * fat_verify_in_chain - whether cluster is in head of chain.
+ * @vol:   volume
+ * @head:  first cluster of chain
+ * @clus:  cluster to look for
+ * @count: clusters already walked from @head (all valid)
+ *
+ * Only called once a chain runs into a cluster already taken, so a chain
+ * is walked twice in FAT only when it is broken.
+ */
+static bool fat_verify_in_chain(struct fat_volume *vol, u_int32_t head,
+    u_int32_t clus, u_int32_t count)
+{
+  for (; count; count--) {
+    if (head == clus)
+      return true;
+    head = fat_get_entry(vol, head);
+  }
+  return false;
+}
+
+/**
+ * fat_verify_chain - check chain of dentry, and take its clusters.
+ * @s:      state of check
+ * @path:   path of dentry
+ * @offset: byte offset of dentry
+ * @head:   first cluster of chain
+ * @count:  clusters until end or first problem (output)
+ *
+ * Return: true - chain ends with EOC
+ *         false - some problem is reported
+ */
+static bool fat_verify_chain(struct fat_verify_state *s, const char *path,
+    u_int64_t offset, u_int32_t head, u_int32_t *count)
+{
+  struct fat_volume *vol = s->vol;
+  u_int32_t clus = head, next;
+
+  *count = 0;
+  if (!fat_valid_cluster(vol, head)) {
+    fat_verify_report(s, path, offset, PROBLEM_INVALID, 0, head);
+    return false;
+  }
+  while (true) {
+    if (test_and_set_bit(s->owned, clus - 2)) {
+      if (fat_verify_in_chain(vol, head, clus, *count)) {
+        fat_verify_report(s, path, offset, PROBLEM_LOOP, clus, *count);
+      } else {
+        fat_verify_report(s, path, offset, PROBLEM_CROSSLINK, clus, 0);
+        s->res->crosslinked++;
+      }
+      return false;
+    }
+    (*count)++;
+    next = fat_get_entry(vol, clus);
+    if (fat_is_eoc(vol, next))
+      return true;
+    if (!next)
+      fat_verify_report(s, path, offset, PROBLEM_FREE, clus, next);
+    else if (fat_is_bad(vol, next))
+      fat_verify_report(s, path, offset, PROBLEM_BAD, clus, next);
+    else if (!fat_valid_cluster(vol, next))
+      fat_verify_report(s, path, offset, PROBLEM_INVALID, clus, next);
+    else {
+      clus = next;
+      continue;
+    }
+    return false;
+  }
+}
+
+/**
+ * fat_verify_node - check chain of file or directory.
+ * @s:    state of check
+ * @path: path of @node
+ * @node: dentry to check
+ */
+static void fat_verify_node(struct fat_verify_state *s, const char *path,
+    struct fat_node *node)
+{
+  struct fat_dentry *d = &(node->dentry);
+  u_int32_t clus = fat_dentry_cluster(s->vol, d), count, expect;
+
+  if (d->DIR_Attr & ATTR_DIRECTORY) {
+    s->res->dirs++;
+    fat_verify_chain(s, path, node->offset, clus, &count);
+    return;
+  }
+  s->res->files++;
+  expect = (d->DIR_FileSize + s->vol->geo.cluster_size - 1)
+    >> s->vol->geo.cluster_shift;
+  if (!clus) {
+    /* empty file has no chain */
+    if (expect)
+      fat_verify_report(s, path, node->offset, PROBLEM_LENGTH, 0, 0);
+    return;
+  }
+  if (fat_verify_chain(s, path, node->offset, clus, &count) && count != expect)
+    fat_verify_report(s, path, node->offset, PROBLEM_LENGTH, clus, count);
+}
+
+/**
+ * fat_verify_dot - check "." or ".." of directory.
+ * @s:      state of check
+ * @path:   path of directory
+ * @dir:    directory
+ * @index:  0 - ".", 1 - ".."
+ * @expect: cluster the entry should point to
+ */
+static void fat_verify_dot(struct fat_verify_state *s, const char *path,
+    struct fat_node *dir, u_int32_t index, u_int32_t expect)
+{
+  static const char *names[] = { ".          ", "..         " };
+  u_int32_t kind = index ? PROBLEM_DOTDOT : PROBLEM_DOT, clus;
+  struct fat_node *node;
+
+  if (dir->nchild <= index)
+    goto missing;
+  node = &(dir->child[index]);
+  if (memcmp(node->dentry.IR_Name, names[index], NameSIZE)
+      || !(node->dentry.DIR_Attr & ATTR_DIRECTORY))
+    goto missing;
+  clus = fat_dentry_cluster(s->vol, &(node->dentry));
+  /* some formatters point ".." of FAT32 root children to RootClus */
+  if (clus == expect || (index && !expect && clus == s->vol->RootClus))
+    return;
+  fat_verify_report(s, path, node->offset, kind, expect, clus);
+  return;
+missing:
+  fat_verify_report(s, path, dir->offset, kind, expect, UINT32_MAX);
+}
+
+/**
+ * fat_verify_entry - check dentry, and "." and ".." of directory.
+ * @path: path of @node
+ * @dir:  parent directory node
+ * @node: dentry node
+ * @arg:  state of check
+ */
+static int fat_verify_entry(const char *path, struct fat_node *dir,
+    struct fat_node *node, void *arg)
+{
+  struct fat_verify_state *s = arg;
+  u_int32_t parent;
+
+  fat_verify_node(s, path, node);
+  /* directory which is not read has no entries to check */
+  if (!fat_is_subdir(&(node->dentry)) || !node->nchild)
+    return 0;
+  parent = dir == s->root ? 0 : fat_dentry_cluster(s->vol, &(dir->dentry));
+  fat_verify_dot(s, path, node, 0, fat_dentry_cluster(s->vol, &(node->dentry)));
+  fat_verify_dot(s, path, node, 1, parent);
+  return 0;
+}
+
+/**
+ * fat_verify_tree - check every dentry in tree.
+ * @s:    state of check
+ * @tree: directory tree
+ *
+ * Return: 0 - success
+ *         -ENOMEM - out of memory
+ */
+static int fat_verify_tree(struct fat_verify_state *s, struct fat_tree *tree)
+{
+  u_int32_t count;
+
+  if (s->vol->fstype == FAT32_FILESYSTEM)
+    fat_verify_chain(s, "/", 0, s->vol->RootClus, &count);
+  s->root = &(tree->root);
+  return fat_tree_foreach_path(tree, fat_verify_entry, s);
+}
+
+/**
+ * fat_verify_fat - count FAT entries, and find clusters of no dentry.
+ * @s: state of check
+ *
+ * Single pass over FAT after fat_verify_tree(). Special values of the FAT
+ * type are read once, so that each entry is tested by plain comparisons.
+ */
+static void fat_verify_fat(struct fat_verify_state *s)
+{
+  struct fat_volume *vol = s->vol;
+  u_int32_t last = vol->CountofClusters + 1;
+  u_int32_t eoc = vol->ops->eoc, bad = vol->ops->bad;
+  u_int32_t clus, i, n, e, buf[256];
+  bool valid;
+
+  for (clus = 2; clus <= last; clus += n) {
+    n = last - clus + 1 < 256 ? last - clus + 1 : 256;
+    fat_get_entries(vol, clus, n, buf);
+    for (i = 0; i < n; i++) {
+      e = buf[i];
+      if (!e) {
+        s->res->free++;
+        continue;
+      }
+      if (e == bad) {
+        s->res->bad++;
+        continue;
+      }
+      valid = e >= 2 && e <= last;
+      if (!valid && e < eoc)
+        s->res->invalid++;
+      if (test_bit(s->owned, clus + i - 2))
+        continue;
+      set_bit(s->lost, clus + i - 2);
+      if (valid)
+        set_bit(s->pointed, e - 2);
+    }
+  }
+}
+
+/**
+ * fat_verify_lost - report chains of lost clusters.
+ * @s:     state of check
+ * @heads: only clusters no lost cluster points to
+ *
+ * Called with @heads first, then without it for the cycles left.
+ * A lost chain which comes back to itself is also reported as a loop, and
+ * one which runs into a chain of a dentry, or into another lost chain
+ * already walked, as cross-linked.
+ */
+static void fat_verify_lost(struct fat_verify_state *s, bool heads)
+{
+  struct fat_volume *vol = s->vol;
+  u_int32_t i, clus, count, next;
+
+  for (i = 0; i < vol->CountofClusters; i++) {
+    if (!(i % CHAR_BIT) && !s->lost[i / CHAR_BIT]) {
+      i += CHAR_BIT - 1;
+      continue;
+    }
+    if (!test_bit(s->lost, i) || (heads && test_bit(s->pointed, i)))
+      continue;
+    count = 0;
+    clus = i + 2;
+    while (fat_valid_cluster(vol, clus) && test_bit(s->lost, clus - 2)) {
+      clear_bit(s->lost, clus - 2);
+      count++;
+      clus = fat_get_entry(vol, clus);
+    }
+    s->res->lost_chains++;
+    s->res->lost_clusters += count;
+    fat_verify_report(s, NULL, 0, PROBLEM_LOST, i + 2, count);
+
+    if (!fat_valid_cluster(vol, clus))
+      continue;
+    if (!test_bit(s->owned, clus - 2)) {
+      /* free or bad cluster ends the chain without sharing it */
+      next = fat_get_entry(vol, clus);
+      if (!next || fat_is_bad(vol, next))
+        continue;
+      if (fat_verify_in_chain(vol, i + 2, clus, count)) {
+        fat_verify_report(s, NULL, 0, PROBLEM_LOOP, clus, count);
+        continue;
+      }
+    }
+    fat_verify_report(s, NULL, 0, PROBLEM_CROSSLINK, clus, 0);
+    s->res->crosslinked++;
+  }
+}
+
+/**
+ * fat_verify_header - check FAT[0] and FSInfo against counted FAT.
+ * @s: state of check
+ */
+static void fat_verify_header(struct fat_verify_state *s)
+{
+  struct fat_volume *vol = s->vol;
+  struct fat32_fsinfo *fsinfo = &(vol->fsinfo);
+  bool ok;
+
+  switch (vol->fstype) {
+    case FAT12_FILESYSTEM:
+      ok = fat12_get_entry(vol, 0) == (0xf00 | vol->resv.BPB_Media);
+      break;
+    case FAT16_FILESYSTEM:
+      ok = fat16_check_fattable(vol);
+      break;
+    default:
+      ok = fat32_check_fattable(vol);
+      break;
+  }
+  if (!ok)
+    fat_verify_report(s, NULL, 0, PROBLEM_MEDIA, 0, fat_get_entry(vol, 0));
+
+  if (vol->fstype != FAT32_FILESYSTEM)
+    return;
+  if (fsinfo->FSI_Free_Count != UINT32_MAX
+      && fsinfo->FSI_Free_Count != s->res->free)
+    fat_verify_report(s, NULL, 0, PROBLEM_FSINFO_FREE, s->res->free,
+        fsinfo->FSI_Free_Count);
+  if (fsinfo->FSI_Nxt_Free != UINT32_MAX
+      && (fsinfo->FSI_Nxt_Free < 2
+        || fsinfo->FSI_Nxt_Free > vol->CountofClusters + 1))
+    fat_verify_report(s, NULL, 0, PROBLEM_FSINFO_NEXT, 0, fsinfo->FSI_Nxt_Free);
+}
+
+/**
+ * fat_verify_volume - check consistency of volume, like fsck.
+ * @vol:  volume
+ * @tree: directory tree (each directory cluster read once)
+ * @out:  output sink
+ *
+ * Chains of dentries are walked in the in-memory FAT, taking clusters in
+ * a bitmap; a cluster taken twice is cross-linked. The FAT is then scanned
+ * once, and used clusters not taken are walked as lost chains. Three bitmaps
+ * of CountofClusters bits are the only memory used beside the tree.
+ *
+ * Return: 0 - no problem
+ *         -EIO - some problems are found
+ *         -ENOMEM - out of memory
+ */
+int fat_verify_volume(struct fat_volume *vol, struct fat_tree *tree,
+    struct fat_output *out)
+{
+  int err;
+  size_t size = vol->CountofClusters / CHAR_BIT + 1;
+  struct fat_verify res = { .clusters = vol->CountofClusters };
+  struct fat_verify_state s = {
+    .vol = vol,
+    .out = out,
+    .res = &res,
+  };
+
+  s.owned = calloc(1, size);
+  s.lost = calloc(1, size);
+  s.pointed = calloc(1, size);
+  if (!s.owned || !s.lost || !s.pointed) {
+    err = -ENOMEM;
+    goto out;
+  }
+  if ((err = fat_verify_tree(&s, tree)) < 0)
+    goto out;
+  fat_verify_fat(&s);
+  fat_verify_lost(&s, true);
+  fat_verify_lost(&s, false);
+  fat_verify_header(&s);
+  out->ops->verifystat(out, &res);
+  err = res.problems ? -EIO : 0;
+out:
+  free(s.pointed);
+  free(s.lost);
+  free(s.owned);
+  return err;
+}
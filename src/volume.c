@@ -0,0 +1,235 @@
+/*
+ * volume.c
+ *
+ * FAT tracer interface
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "fat.h"
+
+/**
+ * fat_volume_geometry - calculate region of volume.
+ * @vol: FAT volume (reserved area is already loaded)
+ *
+ * Sector numbers are kept as in BPB, and byte offsets of each region are
+ * computed once in 64-bit for all users (FAT32 volume may be 2 TiB with
+ * 512 bytes sectors, and 16 TiB with 4096 bytes sectors).
+ *
+ * Return: 0 - success
+ *         -EINVAL - geometry is inconsistent
+ */
+static int fat_volume_geometry(struct fat_volume *vol)
+{
+  struct fat_reserved_info *info = &(vol->resv);
+  struct fat_geometry *geo = &(vol->geo);
+  u_int64_t fatClusters;
+
+  vol->totSec = info->BPB_TotSec16 ? info->BPB_TotSec16 : info->BPB_TotSec32;
+  vol->FatStartSector = info->BPB_RevdSecCnt;
+  vol->FatSectors = vol->secsPerFat * info->BPB_NumFATs;
+  vol->RootDirStartSector = vol->FatStartSector + vol->FatSectors;
+  vol->RootDirSectors = (DENTRY_SIZE * info->BPB_RootEntCnt
+      + info->BPB_BytesPerSec - 1) / info->BPB_BytesPerSec;
+  vol->DataStartSector = vol->RootDirStartSector + vol->RootDirSectors;
+  if (!vol->secsPerFat || (u_int64_t)vol->secsPerFat * info->BPB_NumFATs > UINT32_MAX
+      || vol->DataStartSector < vol->RootDirStartSector
+      || vol->DataStartSector > vol->totSec) {
+    fprintf(stderr, _("bogus volume geometry\n"));
+    return -EINVAL;
+  }
+  vol->DataSectors = vol->totSec - vol->DataStartSector;
+
+  /* sizes are powers of 2 (checked with BPB) */
+  geo->sector = info->BPB_BytesPerSec;
+  geo->cluster_size = (u_int32_t)info->BPB_SecPerClus * geo->sector;
+  geo->cluster_shift = __builtin_ctz(geo->cluster_size);
+  geo->fat_offset = (u_int64_t)vol->FatStartSector * geo->sector;
+  geo->fat_size = (u_int64_t)vol->secsPerFat * geo->sector;
+  geo->fats_size = (u_int64_t)vol->FatSectors * geo->sector;
+  geo->root_offset = (u_int64_t)vol->RootDirStartSector * geo->sector;
+  geo->root_size = (u_int64_t)vol->RootDirSectors * geo->sector;
+  geo->data_offset = (u_int64_t)vol->DataStartSector * geo->sector;
+  geo->data_size = (u_int64_t)vol->DataSectors * geo->sector;
+  geo->size = (u_int64_t)vol->totSec * geo->sector;
+
+  vol->CountofClusters = vol->DataSectors / info->BPB_SecPerClus;
+  if (vol->CountofClusters < FAT16_CLUSTERS) {
+    vol->fstype = FAT12_FILESYSTEM;
+    vol->ops = &fat12_entry_ops;
+  } else if (vol->CountofClusters < FAT32_CLUSTERS) {
+    vol->fstype = FAT16_FILESYSTEM;
+    vol->ops = &fat16_entry_ops;
+  } else {
+    vol->fstype = FAT32_FILESYSTEM;
+    vol->ops = &fat32_entry_ops;
+  }
+
+  /* Ignore clusters which FAT can not describe */
+  fatClusters = geo->fat_size * 8 / vol->fstype;
+  if (fatClusters < 2)
+    return -EINVAL;
+  if (vol->CountofClusters > fatClusters - 2) {
+    fprintf(stderr, _("FAT is too small for %u clusters\n"),
+        vol->CountofClusters);
+    vol->CountofClusters = fatClusters - 2;
+  }
+  return 0;
+}
+
+/**
+ * fat_volume_layout - load reserved area and calculate region of volume.
+ * @vol: FAT volume to initialize
+ * @img: opened image
+ *
+ * Only boot sector and FSInfo are read, FAT is not loaded yet.
+ *
+ * Return: 0 - success
+ *         negative - error
+ */
+int fat_volume_layout(struct fat_volume *vol, struct fat_image *img)
+{
+  int err = 0;
+  int offset;
+  unsigned char *resv_area;
+  unsigned char *fsinfo_area;
+  struct fat32_reserved_info *fat32_info;
+
+  memset(vol, 0, sizeof(*vol));
+  vol->img = img;
+
+  resv_area = fat_image_get(img, 0, RESVAREA_SIZE);
+  if (!resv_area)
+    return -EIO;
+
+  offset = fat_load_reservedinfo(&(vol->resv), resv_area);
+  if (offset < 0) {
+    err = -EINVAL;
+    goto resv_end;
+  }
+
+  if (is_fat32format(&(vol->resv))) {
+    fat32_load_reservedinfo(&(vol->resv), resv_area, offset);
+    fat32_info = (struct fat32_reserved_info *)(vol->resv.reserved1);
+    fsinfo_area = fat_image_get(img,
+        (u_int64_t)fat32_info->BPB_FSInfo * vol->resv.BPB_BytesPerSec,
+        RESVAREA_SIZE);
+    if (!fsinfo_area) {
+      err = -EIO;
+      goto resv_end;
+    }
+    fat32_load_fsinfo(&(vol->fsinfo), fsinfo_area);
+    fat_image_put(img, fsinfo_area);
+    vol->secsPerFat = fat32_info->BPB_FATSz32;
+    vol->RootClus = fat32_info->BPB_RootClus;
+  } else {
+    fat12_load_reservedinfo(&(vol->resv), resv_area, offset);
+    vol->secsPerFat = vol->resv.BPB_FATSz16;
+  }
+
+  err = fat_volume_geometry(vol);
+
+resv_end:
+  fat_image_put(img, resv_area);
+  return err;
+}
+
+/**
+ * fat_volume_open - load FAT volume from image.
+ * @vol: FAT volume to initialize
+ * @img: opened image
+ *
+ * Return: 0 - success
+ *         negative - error
+ */
+int fat_volume_open(struct fat_volume *vol, struct fat_image *img)
+{
+  int err;
+
+  if ((err = fat_volume_layout(vol, img)) < 0)
+    return err;
+
+  fat_image_advise(img, vol->geo.fat_offset, vol->geo.fats_size, MADV_WILLNEED);
+  vol->fat = fat_image_get(img, vol->geo.fat_offset, vol->geo.fats_size);
+  if (!vol->fat)
+    return -EIO;
+
+  if (vol->fstype == FAT12_FILESYSTEM)
+    err = fat12_load_fattable(vol);
+  return err;
+}
+
+/**
+ * fat_volume_close - release FAT volume.
+ * @vol: FAT volume
+ */
+void fat_volume_close(struct fat_volume *vol)
+{
+  if (vol->fat)
+    fat_image_put(vol->img, vol->fat);
+  free(vol->fat12);
+  vol->fat = NULL;
+  vol->fat12 = NULL;
+}
+
+/**
+ * fat_volume_dump - print out reserved area and region of volume.
+ * @vol: FAT volume
+ * @out: output stream
+ */
+void fat_volume_dump(struct fat_volume *vol, FILE *out)
+{
+  struct fat_geometry *geo = &(vol->geo);
+
+  fat_dump_reservedinfo(&(vol->resv), out);
+  if (is_fat32format(&(vol->resv))) {
+    fat32_dump_reservedinfo(&(vol->resv), out);
+    fat32_dump_fsinfo(&(vol->fsinfo), out);
+  } else {
+    fat12_dump_reservedinfo(&(vol->resv), out);
+  }
+
+  fprintf(out, "%-28s\t: %08llx - %08llx\n", _("Fat Table Sector"),
+      (unsigned long long)geo->fat_offset,
+      (unsigned long long)(geo->fat_offset + geo->fats_size - 1));
+  fprintf(out, "%-28s\t: %08llx - %08llx\n", _("Root Directory Sector"),
+      (unsigned long long)geo->root_offset,
+      (unsigned long long)(geo->root_offset + geo->root_size - 1));
+  fprintf(out, "%-28s\t: %08llx - %08llx\n", _("Data Directory Sector"),
+      (unsigned long long)geo->data_offset,
+      (unsigned long long)(geo->data_offset + geo->data_size - 1));
+  fat_dump_fattable(vol, out);
+}
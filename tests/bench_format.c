@@ -0,0 +1,128 @@
+/*
+ * bench_format.c
+ *
+ * benchmark of dump formatting helpers
+ *
+ * MIT License
+ *
+ * Copyright (c) 2019 LeavaTail
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <config.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "../src/fat.h"
+
+#define LOOPS 20000
+
+/* previous implementation: sprintf() and strcat() for each byte */
+static unsigned char *legacy_setcharc(unsigned const char *buf,
+    unsigned char *ret, size_t len)
+{
+  int i;
+  memset(ret, '\0', len);
+  for (i = 0; i < len; i++) {
+    char tmp[1 + 1] = ".";
+    if (buf[i] >= 0x20 && buf[i] <= 0x7e)
+      sprintf(tmp, "%c", buf[i]);
+    strcat((char *)ret, tmp);
+  }
+  return ret;
+}
+
+static unsigned char *legacy_setcharx(unsigned const char *buf,
+    unsigned char *ret, size_t len)
+{
+  int i;
+  char tmp[2 + 1] = "";
+  memset(ret, '\0', len);
+  for (i = 0; i < len; i++) {
+    sprintf(tmp, "%x", buf[i]);
+    strcat((char *)ret, tmp);
+  }
+  return ret;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench(const char *name, size_t len,
+    unsigned char *(*legacy)(unsigned const char *, unsigned char *, size_t),
+    unsigned char *(*table)(unsigned const char *, unsigned char *, size_t))
+{
+  int i;
+  double t0, t1, t2;
+  unsigned char buf[RESVAREA_SIZE];
+  unsigned char a[2 * RESVAREA_SIZE + 1];
+  unsigned char b[2 * RESVAREA_SIZE + 1];
+
+  for (i = 0; i < len; i++)
+    buf[i] = rand();
+  if (strcmp((char *)legacy(buf, a, len), (char *)table(buf, b, len))) {
+    fprintf(stderr, "%s: output differs\n", name);
+    return 1;
+  }
+
+  t0 = now();
+  for (i = 0; i < LOOPS; i++)
+    legacy(buf, a, len);
+  t1 = now();
+  for (i = 0; i < LOOPS; i++)
+    table(buf, b, len);
+  t2 = now();
+
+  printf("%-10s %4zu bytes: legacy %8.1f ns, table %8.1f ns, %6.1fx\n",
+      name, len, (t1 - t0) / LOOPS * 1e9, (t2 - t1) / LOOPS * 1e9,
+      (t1 - t0) / (t2 - t1));
+  return 0;
+}
+
+static unsigned char *table_setcharc(unsigned const char *buf,
+    unsigned char *ret, size_t len)
+{
+  return setcharc(buf, ret, len);
+}
+
+static unsigned char *table_setcharx(unsigned const char *buf,
+    unsigned char *ret, size_t len)
+{
+  return setcharx(buf, ret, len);
+}
+
+int main(void)
+{
+  int err = 0;
+
+  err |= bench("setcharc", BootCodeSIZE, legacy_setcharc, table_setcharc);
+  err |= bench("setcharc", BootCode32SIZE, legacy_setcharc, table_setcharc);
+  err |= bench("setcharx", FSI_Reserved1SIZE, legacy_setcharx, table_setcharx);
+  err |= bench("setcharx", VolIDSIZE, legacy_setcharx, table_setcharx);
+  return err;
+}
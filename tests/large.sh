@@ -0,0 +1,123 @@
+#!/bin/bash
+#
+# Sparse multi-TB volumes: only boot sector, FSInfo, FAT entries, root
+# directory and one file near the end of volume are written.
+
+mkdir -p sample
+
+# put FILE OFFSET BYTES VALUE - write little-endian integer
+put() {
+  local s="" i
+  for ((i = 0; i < $3; i++)); do
+    s+=$(printf '\\x%02x' $((($4 >> (8 * i)) & 0xff)))
+  done
+  printf "$s" | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+# fat32 FILE BASE SECTOR SECPERCLUS TOTSEC - FAT32 volume at byte BASE with
+# /BIG.BIN of two clusters at the last two clusters of volume
+fat32() {
+  local img=$1 base=$2 sec=$3 spc=$4 tot=$5 fatsz clusters last i off
+  fatsz=$(((tot / spc * 4 + sec - 1) / sec))
+  clusters=$(((tot - 32 - 2 * fatsz) / spc))
+  last=$((clusters + 1))
+  DATA=$((base + (32 + 2 * fatsz) * sec))
+  END=$((base + tot * sec))
+  CLUSTERS=$clusters
+
+  truncate -s "$END" "$img"
+  printf '\xeb\x58\x90MSWIN4.1' | dd of="$img" bs=1 seek="$base" conv=notrunc 2>/dev/null
+  put "$img" $((base + 11)) 2 "$sec"
+  put "$img" $((base + 13)) 1 "$spc"
+  put "$img" $((base + 14)) 2 32
+  put "$img" $((base + 16)) 1 2
+  put "$img" $((base + 21)) 1 0xf8
+  put "$img" $((base + 32)) 4 "$tot"
+  put "$img" $((base + 36)) 4 "$fatsz"
+  put "$img" $((base + 44)) 4 2
+  put "$img" $((base + 48)) 2 1
+  put "$img" $((base + 50)) 2 6
+  put "$img" $((base + 66)) 1 0x29
+  printf 'NO NAME    FAT32   ' | dd of="$img" bs=1 seek=$((base + 71)) conv=notrunc 2>/dev/null
+  put "$img" $((base + 510)) 2 0xaa55
+
+  put "$img" $((base + sec)) 4 0x41615252
+  put "$img" $((base + sec + 484)) 4 0x61417272
+  put "$img" $((base + sec + 488)) 4 $((clusters - 3))
+  put "$img" $((base + sec + 492)) 4 0xffffffff
+  put "$img" $((base + sec + 508)) 4 0xaa550000
+
+  for ((i = 0; i < 2; i++)); do
+    off=$((base + (32 + i * fatsz) * sec))
+    put "$img" "$off" 4 0x0ffffff8
+    put "$img" $((off + 4)) 4 0x0fffffff
+    put "$img" $((off + 8)) 4 0x0fffffff
+    put "$img" $((off + (last - 1) * 4)) 4 "$last"
+    put "$img" $((off + last * 4)) 4 0x0fffffff
+  done
+
+  printf 'BIG     BIN\x20' | dd of="$img" bs=1 seek="$DATA" conv=notrunc 2>/dev/null
+  put "$img" $((DATA + 20)) 2 $(((last - 1) >> 16))
+  put "$img" $((DATA + 26)) 2 $(((last - 1) & 0xffff))
+  put "$img" $((DATA + 28)) 4 $((spc * sec + 4))
+
+  FILE=$((DATA + (last - 3) * spc * sec))
+  printf 'head' | dd of="$img" bs=1 seek="$FILE" conv=notrunc 2>/dev/null
+  printf 'tail' | dd of="$img" bs=1 seek=$((FILE + spc * sec)) conv=notrunc 2>/dev/null
+}
+
+# just below 2 TiB with 512 bytes sectors
+fat32 sample/large512.img 0 512 64 $((0xfffffff0))
+./fatracer sample/large512.img > sample/large.out
+if [ $? -gt 0 ]; then
+  rm -f sample/large512.img; exit 1;
+fi
+
+grep -q "^Data Directory Sector.*: $(printf '%08x - %08x' $DATA $((END - 1)))$" sample/large.out
+if [ $? -gt 0 ]; then
+  rm -f sample/large512.img; exit 2;
+fi
+
+./fatracer -x /BIG.BIN sample/large512.img | cmp -s - \
+  <(printf 'head'; head -c $((32768 - 4)) /dev/zero; printf 'tail')
+if [ $? -gt 0 ]; then
+  rm -f sample/large512.img; exit 3;
+fi
+
+./fatracer --frag sample/large512.img | grep -q "$((CLUSTERS - 3)) / $CLUSTERS"
+if [ $? -gt 0 ]; then
+  rm -f sample/large512.img; exit 4;
+fi
+rm -f sample/large512.img sample/large.out
+
+# 8 TiB with 4096 bytes sectors
+fat32 sample/large4k.img 0 4096 128 $((0x7ffffff0))
+./fatracer -x /BIG.BIN sample/large4k.img | cmp -s - \
+  <(printf 'head'; head -c $((524288 - 4)) /dev/zero; printf 'tail')
+if [ $? -gt 0 ]; then
+  rm -f sample/large4k.img; exit 5;
+fi
+
+./fatracer --hash sample/large4k.img | grep -q ' /BIG.BIN$'
+if [ $? -gt 0 ]; then
+  rm -f sample/large4k.img; exit 6;
+fi
+rm -f sample/large4k.img
+
+# whole disk image: MBR partition starting beyond 4 GiB of disk
+lba=$((0x10000000))
+fat32 sample/largedisk.img $((lba * 512)) 512 1 $((0x20000))
+put sample/largedisk.img 450 1 0x0c
+put sample/largedisk.img 454 4 "$lba"
+put sample/largedisk.img 458 4 $((0x20000))
+put sample/largedisk.img 510 2 0xaa55
+dd if=sample/largedisk.img of=sample/largepart.img bs=512 skip="$lba" \
+  count=$((0x20000)) conv=sparse 2>/dev/null
+./fatracer --hash sample/largedisk.img | tail -n +2 | cmp -s - \
+  <(./fatracer --hash sample/largepart.img)
+if [ $? -gt 0 ]; then
+  rm -f sample/largedisk.img sample/largepart.img; exit 7;
+fi
+rm -f sample/largedisk.img sample/largepart.img
+
+exit 0;
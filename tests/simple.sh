@@ -10,6 +10,16 @@ touch sample/mnt16/FILE1
 
 mkdir sample/mnt32/DIR1
 touch sample/mnt32/FILE1
+touch sample/mnt32/DIR1/FILE2
+# FRAG.BIN grows after GAP.BIN is written, so its clusters are in two runs
+seq 1 3000 > sample/frag.txt
+head -c 5000 sample/frag.txt > sample/mnt32/FRAG.BIN
+head -c 5000 sample/frag.txt > sample/mnt32/GAP.BIN
+tail -c +5001 sample/frag.txt >> sample/mnt32/FRAG.BIN
+# long names filling exactly one and two slots of 13 characters
+touch sample/mnt32/DIR1/Thirteen.Char
+seq 1 10 > sample/mnt32/DIR1/twenty-six-characters.long
+touch sample/mnt32/abcdefghij.txt
 cleanup
 
 ./fatracer sample/fat12.img
@@ -26,3 +36,187 @@ fi
 if [ $? -gt 0 ]; then
   exit 3;
 fi
+
+./fatracer sample/fat32.img | grep -q '^/DIR1:$'
+if [ $? -gt 0 ]; then
+  exit 4;
+fi
+
+ls sample/fat12.img sample/fat16.img sample/fat32.img | ./fatracer -j 2 -T - | grep -c '^==> ' | grep -q '^3$'
+if [ $? -gt 0 ]; then
+  exit 5;
+fi
+
+cat sample/fat32.img | ./fatracer - | cmp -s - <(./fatracer sample/fat32.img)
+if [ $? -gt 0 ]; then
+  exit 6;
+fi
+
+mkdir -p sample/cache
+./fatracer -C sample/cache sample/fat32.img > /dev/null
+./fatracer -C sample/cache sample/fat32.img | cmp -s - <(./fatracer sample/fat32.img)
+if [ $? -gt 0 ]; then
+  exit 7;
+fi
+
+./fatracer -C sample/cache -d sample/fat32.img | grep -q '^[-+M] /'
+if [ $? -eq 0 ]; then
+  exit 8;
+fi
+
+./fatracer --diff sample/fat16.img sample/fat32.img | grep -q '^+ /DIR1/FILE2$'
+if [ $? -gt 0 ]; then
+  exit 9;
+fi
+
+./fatracer -x /dir1/file2 sample/fat32.img | cmp -s - /dev/null
+if [ $? -gt 0 ]; then
+  exit 10;
+fi
+
+./fatracer --hash sample/fat32.img | grep -q '^ef46db3751d8e999 \+0  /DIR1/FILE2$'
+if [ $? -gt 0 ]; then
+  exit 11;
+fi
+
+./fatracer --recover sample/fat16.img | cmp -s - /dev/null
+if [ $? -gt 0 ]; then
+  exit 12;
+fi
+
+./fatracer -f json --stat /dir1/file2 sample/fat32.img | grep -q '"name":"FILE2"'
+if [ $? -gt 0 ]; then
+  exit 13;
+fi
+
+./fatracer --frag sample/fat32.img | grep -q '^ \+1 \+1  /DIR1$'
+if [ $? -gt 0 ]; then
+  exit 14;
+fi
+
+# whole disk image: MBR with fat16.img as first partition at sector 2048
+dd if=/dev/zero of=sample/disk.img bs=512 count=2048 2>/dev/null
+printf '\x0e\x00\x00\x00\x00\x08\x00\x00\x20\x4e\x00\x00' \
+  | dd of=sample/disk.img bs=1 seek=450 conv=notrunc 2>/dev/null
+printf '\x55\xaa' | dd of=sample/disk.img bs=1 seek=510 conv=notrunc 2>/dev/null
+cat sample/fat16.img >> sample/disk.img
+./fatracer sample/disk.img | tail -n +2 | cmp -s - <(./fatracer sample/fat16.img)
+if [ $? -gt 0 ]; then
+  exit 15;
+fi
+
+./fatracer --check-fats sample/fat32.img > /dev/null
+if [ $? -gt 0 ]; then
+  exit 16;
+fi
+
+# second FAT marks free cluster 100 as end of chain
+cp sample/fat32.img sample/fats.img
+bps=$(od -An -tu2 -j11 -N2 sample/fats.img)
+rsv=$(od -An -tu2 -j14 -N2 sample/fats.img)
+fatsz=$(od -An -tu4 -j36 -N4 sample/fats.img)
+printf '\xff\xff\xff\x0f' | dd of=sample/fats.img bs=1 \
+  seek=$(((rsv + fatsz) * bps + 100 * 4)) conv=notrunc 2>/dev/null
+./fatracer --check-fats sample/fats.img | grep -q '^ \+100 - 100 \+FAT2 \+0  FAT1$'
+if [ $? -gt 0 ]; then
+  exit 17;
+fi
+
+./fatracer --verify sample/fat32.img > /dev/null
+if [ $? -gt 0 ]; then
+  exit 18;
+fi
+
+# first FAT marks free cluster 100 as end of chain of no file
+cp sample/fat32.img sample/lost.img
+printf '\xff\xff\xff\x0f' | dd of=sample/lost.img bs=1 \
+  seek=$((rsv * bps + 100 * 4)) conv=notrunc 2>/dev/null
+./fatracer --verify sample/lost.img | grep -q '^lost \+100 \+1  -$'
+if [ $? -gt 0 ]; then
+  exit 19;
+fi
+
+# partition of whole disk image selected as PATH:pN
+./fatracer -s /DIR1 sample/disk.img:p1 | cmp -s - <(./fatracer -s /DIR1 sample/fat16.img)
+if [ $? -gt 0 ]; then
+  exit 20;
+fi
+
+# lost cluster 100 points into root directory at cluster 2
+printf '\x02\x00\x00\x00' | dd of=sample/lost.img bs=1 \
+  seek=$((rsv * bps + 100 * 4)) conv=notrunc 2>/dev/null
+./fatracer --verify sample/lost.img | grep -q '^crosslink \+2 \+0  -$'
+if [ $? -gt 0 ]; then
+  exit 21;
+fi
+
+# runs of fragmented file are found by file offset
+./fatracer -x /FRAG.BIN sample/fat32.img | cmp -s - sample/frag.txt
+if [ $? -gt 0 ]; then
+  exit 22;
+fi
+
+./fatracer -f json --stat /dir1/thirteen.char sample/fat32.img | grep -q '"long_name":"Thirteen.Char"'
+if [ $? -gt 0 ]; then
+  exit 23;
+fi
+
+./fatracer -x /DIR1/TWENTY-SIX-characters.long sample/fat32.img | cmp -s - <(seq 1 10)
+if [ $? -gt 0 ]; then
+  exit 24;
+fi
+
+./fatracer --hash sample/fat32.img | grep -q '^ef46db3751d8e999 \+0  /DIR1/Thirteen.Char$'
+if [ $? -gt 0 ]; then
+  exit 25;
+fi
+
+# U+1F600 as surrogate pair in 4th and 5th characters of abcdefghij.txt
+cp sample/fat32.img sample/lfn.img
+off=$(./fatracer -f json --stat /abcdefghij.txt sample/lfn.img | sed -n 's/.*"offset":\([0-9]*\).*/\1/p')
+printf '\x3d\xd8\x00\xde' | dd of=sample/lfn.img bs=1 seek=$((off - 32 + 7)) conv=notrunc 2>/dev/null
+name=$(printf 'abc\xf0\x9f\x98\x80fghij.txt')
+./fatracer -f json --stat "/$name" sample/lfn.img | grep -q "\"long_name\":\"$name\""
+if [ $? -gt 0 ]; then
+  exit 26;
+fi
+
+# slot whose checksum does not match short entry leaves short name only
+cp sample/fat32.img sample/lfn.img
+off=$(./fatracer -f json --stat /DIR1/Thirteen.Char sample/lfn.img | sed -n 's/.*"offset":\([0-9]*\).*/\1/p')
+sum=$(od -An -tu1 -j$((off - 32 + 13)) -N1 sample/lfn.img)
+printf "\\x$(printf %02x $((sum ^ 0xff)))" | dd of=sample/lfn.img bs=1 \
+  seek=$((off - 32 + 13)) conv=notrunc 2>/dev/null
+./fatracer -f json sample/lfn.img | grep "\"offset\":$off," | grep -vq '"long_name"'
+if [ $? -gt 0 ]; then
+  exit 27;
+fi
+
+# rename of long name only is reported by --diff
+./fatracer --diff sample/fat32.img sample/lfn.img | grep -q '^- /DIR1/Thirteen.Char$'
+if [ $? -gt 0 ]; then
+  exit 28;
+fi
+
+# orphaned slot: first slot of twenty-six-characters.long lost its last mark
+cp sample/fat32.img sample/lfn.img
+off=$(./fatracer -f json --stat /DIR1/twenty-six-characters.long sample/lfn.img | sed -n 's/.*"offset":\([0-9]*\).*/\1/p')
+printf '\x02' | dd of=sample/lfn.img bs=1 seek=$((off - 64)) conv=notrunc 2>/dev/null
+./fatracer -f json sample/lfn.img | grep "\"offset\":$off," | grep -vq '"long_name"'
+if [ $? -gt 0 ]; then
+  exit 29;
+fi
+
+# slots out of order
+printf '\x41' | dd of=sample/lfn.img bs=1 seek=$((off - 64)) conv=notrunc 2>/dev/null
+printf '\x42' | dd of=sample/lfn.img bs=1 seek=$((off - 32)) conv=notrunc 2>/dev/null
+./fatracer -f json sample/lfn.img | grep "\"offset\":$off," | grep -vq '"long_name"'
+if [ $? -gt 0 ]; then
+  exit 30;
+fi
+
+# root directory has no entry to print
+./fatracer --stat / sample/fat32.img > /dev/null 2>&1
+if [ $? -eq 0 ]; then
+  exit 31;
+fi